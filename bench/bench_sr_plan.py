@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+
+'''
+Measure overhead of sr_plan on planning with pgbench.
+
+Every scenario runs pgbench on a fresh cluster with sr_plan in
+shared_preload_libraries and reports TPS and percentiles of latency of
+whole transactions, as one JSON object per line. Planning time is not
+measured by itself, but queries are cheap to execute and are sent with
+the simple protocol, so transaction latency is dominated by parsing and
+planning.
+
+Usage: bench_sr_plan.py [--duration SEC] [--max-clients N] [--output FILE]
+'''
+
+import argparse
+import glob
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from testgres import get_new_node, get_bin_path
+
+sql_init = '''
+CREATE EXTENSION sr_plan;
+CREATE TABLE test_table(test_attr1 int PRIMARY KEY, test_attr2 int);
+INSERT INTO test_table SELECT i, i + 1 FROM generate_series(1, 10000) i;
+ANALYZE test_table;
+'''
+
+# eight-way self join, planning of which takes a while
+join_query = 'SELECT * FROM ' + \
+    ', '.join('test_table t%d' % i for i in range(8)) + \
+    ' WHERE ' + ' AND '.join(
+        't%d.test_attr1 = t%d.test_attr2' % (i, i + 1) for i in range(7)) + \
+    ' AND t0.test_attr1 = _p(%s)'
+
+scripts = {
+    'point': '\\set id random(1, 10000)\n'
+             'SELECT * FROM test_table WHERE test_attr1 = :id;\n',
+    'point_param': '\\set id random(1, 10000)\n'
+                   'SELECT * FROM test_table WHERE test_attr1 = _p(:id);\n',
+    'join_param': '\\set id random(1, 10000)\n' + join_query % ':id' + ';\n',
+}
+
+
+def capture(node, query):
+    ''' Save the plan of the query and enable it '''
+    node.safe_psql('SET sr_plan.write_mode = on; ' + query)
+    node.safe_psql('UPDATE sr_plans SET enable = true')
+
+
+def setup_no_plans(node):
+    pass
+
+
+def setup_miss(node):
+    # enabled plans of other queries
+    for i in range(100):
+        capture(node, 'SELECT * FROM test_table WHERE test_attr2 = %d' % i)
+
+
+def setup_hit(node):
+    capture(node, 'SELECT * FROM test_table WHERE test_attr1 = _p(1)')
+
+
+def setup_join_hit(node):
+    capture(node, join_query % '1')
+
+
+def setup_write_mode(node):
+    node.append_conf('sr_plan.write_mode = on\n')
+    node.reload()
+
+
+# name, setup function, pgbench script, run with 1..max clients
+scenarios = [
+    ('no_plans', setup_no_plans, 'point', False),
+    ('lookup_miss', setup_miss, 'point', False),
+    ('lookup_hit_params', setup_hit, 'point_param', False),
+    ('large_join_hit', setup_join_hit, 'join_param', False),
+    ('write_mode', setup_write_mode, 'point', True),
+]
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    k = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[k]
+
+
+def run_pgbench(node, script, clients, duration, workdir):
+    script_path = os.path.join(workdir, 'script.sql')
+    with open(script_path, 'w') as f:
+        f.write(scripts[script])
+
+    for log in glob.glob(os.path.join(workdir, 'sr_plan_bench*')):
+        os.remove(log)
+
+    out = subprocess.check_output([
+        get_bin_path('pgbench'), '-n', '-M', 'simple',
+        '-h', node.host, '-p', str(node.port), '-f', script_path,
+        '-T', str(duration), '-c', str(clients), '-j', str(clients),
+        '-l', '--log-prefix', os.path.join(workdir, 'sr_plan_bench'),
+        'postgres'], cwd=workdir).decode()
+
+    # third column of transaction log is latency in microseconds
+    latencies = []
+    for log in glob.glob(os.path.join(workdir, 'sr_plan_bench*')):
+        with open(log) as f:
+            for line in f:
+                latencies.append(int(line.split()[2]) / 1000.0)
+
+    tps = float(re.search(r'tps = ([\d.]+)', out).group(1))
+    return tps, latencies
+
+
+def run_scenarios(args, out, workdir):
+    for name, setup, script, scale in scenarios:
+        clients = [1]
+        while scale and clients[-1] * 2 <= args.max_clients:
+            clients.append(clients[-1] * 2)
+
+        for c in clients:
+            with get_new_node() as node:
+                node.init()
+                node.append_conf("shared_preload_libraries = 'sr_plan'\n")
+                node.start()
+                node.safe_psql(sql_init)
+                setup(node)
+
+                tps, latencies = run_pgbench(node, script, c,
+                                             args.duration, workdir)
+                node.stop()
+
+            result = {
+                'scenario': name,
+                'clients': c,
+                'duration': args.duration,
+                'transactions': len(latencies),
+                'tps': tps,
+                'transaction_latency_ms': {
+                    'p50': percentile(latencies, 50),
+                    'p90': percentile(latencies, 90),
+                    'p99': percentile(latencies, 99),
+                    'max': max(latencies) if latencies else None,
+                },
+            }
+            out.write(json.dumps(result, sort_keys=True) + '\n')
+            out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='sr_plan benchmark')
+    parser.add_argument('--duration', type=int, default=10,
+                        help='seconds per pgbench run')
+    parser.add_argument('--max-clients', type=int, default=8,
+                        help='maximum number of clients for write_mode')
+    parser.add_argument('--output', default=None,
+                        help='file to write results to, stdout by default')
+    args = parser.parse_args()
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    workdir = tempfile.mkdtemp()
+    try:
+        run_scenarios(args, out, workdir)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+        if args.output:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,673 @@
+/*
+ * capture.c
+ *		Asynchronous saving of plans captured by sr_plan.write_mode.
+ *
+ * With sr_plan.capture_mode = async a backend does not write to sr_plans
+ * while planning a query. A new plan is put into a shared-memory queue
+ * instead and a background worker of the database saves all queued plans
+ * in a single transaction. If it fails, plans are saved one by one, and a
+ * plan that can't be saved is logged and skipped. One worker per database is started on demand and
+ * exits after a while of inactivity. If the queue is full, the plan is too
+ * large for a queue entry or a worker could not be started, the backend
+ * saves the plan itself.
+ *
+ * A plan is known to be in sr_plans only after the worker has committed it,
+ * so the worker publishes saved plans in a shared ring and backends remember
+ * them from there. Until then a plan already queued is not queued again.
+ */
+#include "sr_plan.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#define SR_PLAN_MAX_CAPTURE_WORKERS		8
+
+/* worker which did not attach in this time is considered dead, in ms */
+#define SR_PLAN_CAPTURE_START_TIMEOUT	10000
+
+/* worker exits after being idle for this time, in ms */
+#define SR_PLAN_CAPTURE_IDLE_TIMEOUT	10000
+
+/* number of recently saved plans published by workers */
+#define SR_PLAN_CAPTURE_SAVED			64
+
+/* states of queue entries */
+#define CAPTURE_FREE		0
+#define CAPTURE_FILLING		1
+#define CAPTURE_READY		2
+
+typedef struct SrPlanCaptureEntry
+{
+	pg_atomic_uint32	state;
+	Oid					dbid;
+	int32				query_hash;
+	int32				plan_hash;
+	int64				query_id;
+	int					nreloids;
+	int					nindex_reloids;
+	Size				query_len;		/* including terminating zero */
+	Size				plan_len;
+	char				data[FLEXIBLE_ARRAY_MEMBER];
+	/* reloids, index_reloids, query and plan follow */
+} SrPlanCaptureEntry;
+
+typedef struct SrPlanCaptureWorker
+{
+	Oid			dbid;			/* InvalidOid if slot is free */
+	Latch	   *latch;			/* NULL until the worker has started */
+	TimestampTz	launched;
+} SrPlanCaptureWorker;
+
+typedef struct SrPlanCaptureSaved
+{
+	Oid			dbid;
+	int32		query_hash;
+	int32		plan_hash;
+} SrPlanCaptureSaved;
+
+typedef struct SrPlanCaptureState
+{
+	slock_t				mutex;		/* protects workers and saved */
+	SrPlanCaptureWorker	workers[SR_PLAN_MAX_CAPTURE_WORKERS];
+	pg_atomic_uint64	nsaved;		/* plans ever published in saved */
+	SrPlanCaptureSaved	saved[SR_PLAN_CAPTURE_SAVED];
+	/* followed by sr_plan_capture_queue_length entries */
+} SrPlanCaptureState;
+
+int		sr_plan_capture_queue_length = 32;
+int		sr_plan_capture_entry_size = 32;
+
+static SrPlanCaptureState *capture_state = NULL;
+
+/* saved plans already looked at by this backend */
+static uint64 seen_saved = 0;
+
+#define CAPTURE_ENTRY_SIZE	((Size) sr_plan_capture_entry_size * 1024)
+
+#define CAPTURE_ENTRY(state, i) \
+	((SrPlanCaptureEntry *) ((char *) (state) + \
+		MAXALIGN(sizeof(SrPlanCaptureState)) + (Size) (i) * CAPTURE_ENTRY_SIZE))
+
+Size
+sr_plan_capture_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(SrPlanCaptureState)),
+					mul_size(sr_plan_capture_queue_length, CAPTURE_ENTRY_SIZE));
+}
+
+void
+sr_plan_capture_shmem_init(void)
+{
+	bool		found;
+	int			i;
+
+	capture_state = ShmemInitStruct("sr_plan capture queue",
+									sr_plan_capture_shmem_size(), &found);
+	if (found)
+		return;
+
+	SpinLockInit(&capture_state->mutex);
+	for (i = 0; i < SR_PLAN_MAX_CAPTURE_WORKERS; i++)
+	{
+		capture_state->workers[i].dbid = InvalidOid;
+		capture_state->workers[i].latch = NULL;
+		capture_state->workers[i].launched = 0;
+	}
+
+	pg_atomic_init_u64(&capture_state->nsaved, 0);
+
+	for (i = 0; i < sr_plan_capture_queue_length; i++)
+		pg_atomic_init_u32(&CAPTURE_ENTRY(capture_state, i)->state, CAPTURE_FREE);
+}
+
+/*
+ * Return true if the same plan of current database is already queued.
+ */
+static bool
+capture_is_queued(SrPlanCapture *capture)
+{
+	int		i;
+
+	for (i = 0; i < sr_plan_capture_queue_length; i++)
+	{
+		SrPlanCaptureEntry *entry = CAPTURE_ENTRY(capture_state, i);
+
+		if (pg_atomic_read_u32(&entry->state) != CAPTURE_READY)
+			continue;
+
+		pg_read_barrier();
+
+		if (entry->dbid == MyDatabaseId &&
+			entry->query_hash == capture->query_hash &&
+			entry->plan_hash == capture->plan_hash)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Remember plans of current database saved by the worker since the last
+ * call. Plans which have already left the ring are just queued again and
+ * found to be duplicates by the worker.
+ */
+void
+sr_plan_capture_collect(void)
+{
+	SrPlanCaptureSaved	saved[SR_PLAN_CAPTURE_SAVED];
+	uint64				nsaved;
+	uint64				from;
+	int					n = 0;
+	int					i;
+
+	if (capture_state == NULL)
+		return;
+
+	nsaved = pg_atomic_read_u64(&capture_state->nsaved);
+	if (nsaved == seen_saved)
+		return;
+
+	from = Max(seen_saved, nsaved - Min(nsaved, SR_PLAN_CAPTURE_SAVED));
+
+	SpinLockAcquire(&capture_state->mutex);
+	nsaved = Min(nsaved, pg_atomic_read_u64(&capture_state->nsaved));
+	for (; from < nsaved; from++)
+	{
+		SrPlanCaptureSaved *item = &capture_state->saved[from % SR_PLAN_CAPTURE_SAVED];
+
+		if (item->dbid == MyDatabaseId)
+			saved[n++] = *item;
+	}
+	SpinLockRelease(&capture_state->mutex);
+
+	seen_saved = nsaved;
+
+	for (i = 0; i < n; i++)
+		sr_plan_remember_plan(saved[i].query_hash, saved[i].plan_hash);
+}
+
+/*
+ * Skip plans published so far, they could be deleted from sr_plans since.
+ */
+void
+sr_plan_capture_forget(void)
+{
+	if (capture_state != NULL)
+		seen_saved = pg_atomic_read_u64(&capture_state->nsaved);
+}
+
+/*
+ * Publish plans the worker has just committed.
+ */
+static void
+capture_publish(SrPlanCapture *captures, int ncaptures)
+{
+	uint64		nsaved;
+	int			i;
+
+	SpinLockAcquire(&capture_state->mutex);
+	nsaved = pg_atomic_read_u64(&capture_state->nsaved);
+	for (i = 0; i < ncaptures; i++, nsaved++)
+	{
+		SrPlanCaptureSaved *item = &capture_state->saved[nsaved % SR_PLAN_CAPTURE_SAVED];
+
+		item->dbid = MyDatabaseId;
+		item->query_hash = captures[i].query_hash;
+		item->plan_hash = captures[i].plan_hash;
+	}
+	pg_atomic_write_u64(&capture_state->nsaved, nsaved);
+	SpinLockRelease(&capture_state->mutex);
+}
+
+/*
+ * Return true if there are queued plans of current database.
+ */
+static bool
+capture_has_ready(void)
+{
+	int		i;
+
+	for (i = 0; i < sr_plan_capture_queue_length; i++)
+	{
+		SrPlanCaptureEntry *entry = CAPTURE_ENTRY(capture_state, i);
+
+		if (pg_atomic_read_u32(&entry->state) == CAPTURE_READY &&
+			entry->dbid == MyDatabaseId)
+			return true;
+	}
+
+	return false;
+}
+
+static bool
+capture_launch_worker(void)
+{
+	BackgroundWorker		worker;
+	BackgroundWorkerHandle *handle;
+
+	MemSet(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "sr_plan capture worker");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "sr_plan capture worker");
+#endif
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "sr_plan");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "sr_plan_capture_main");
+	worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+	worker.bgw_notify_pid = 0;
+
+	return RegisterDynamicBackgroundWorker(&worker, &handle);
+}
+
+/*
+ * Wake up the worker of current database, starting it if needed.
+ * Returns false if there is no worker and it could not be started.
+ */
+static bool
+capture_wakeup_worker(void)
+{
+	TimestampTz				now = GetCurrentTimestamp();
+	SrPlanCaptureWorker	   *worker = NULL;
+	Latch				   *latch = NULL;
+	bool					launch = false;
+	int						i;
+
+	SpinLockAcquire(&capture_state->mutex);
+	for (i = 0; i < SR_PLAN_MAX_CAPTURE_WORKERS; i++)
+	{
+		if (capture_state->workers[i].dbid == MyDatabaseId)
+		{
+			worker = &capture_state->workers[i];
+			break;
+		}
+
+		if (worker == NULL && capture_state->workers[i].dbid == InvalidOid)
+			worker = &capture_state->workers[i];
+	}
+
+	if (worker != NULL)
+	{
+		if (worker->dbid != MyDatabaseId ||
+			(worker->latch == NULL &&
+			 TimestampDifferenceExceeds(worker->launched, now,
+										SR_PLAN_CAPTURE_START_TIMEOUT)))
+		{
+			worker->dbid = MyDatabaseId;
+			worker->latch = NULL;
+			worker->launched = now;
+			launch = true;
+		}
+		else
+			latch = worker->latch;
+	}
+	SpinLockRelease(&capture_state->mutex);
+
+	if (worker == NULL)
+		return false;
+
+	if (latch != NULL)
+		SetLatch(latch);
+
+	if (launch && !capture_launch_worker())
+	{
+		SpinLockAcquire(&capture_state->mutex);
+		if (worker->dbid == MyDatabaseId && worker->latch == NULL)
+			worker->dbid = InvalidOid;
+		SpinLockRelease(&capture_state->mutex);
+
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Put captured plan into the queue. Returns false if the plan should be
+ * saved by the caller.
+ */
+bool
+sr_plan_capture_enqueue(SrPlanCapture *capture)
+{
+	SrPlanCaptureEntry *entry = NULL;
+	Size				query_len = strlen(capture->query) + 1;
+	Size				plan_len = VARSIZE(capture->plan);
+	Size				len;
+	char			   *ptr;
+	uint32				expected;
+	int					i;
+
+	if (capture_state == NULL || sr_plan_capture_queue_length == 0)
+		return false;
+
+	if (capture_is_queued(capture))
+		return true;
+
+	len = offsetof(SrPlanCaptureEntry, data) +
+		sizeof(Oid) * (capture->nreloids + capture->nindex_reloids) +
+		query_len + plan_len;
+	if (len > CAPTURE_ENTRY_SIZE)
+		return false;
+
+	for (i = 0; i < sr_plan_capture_queue_length; i++)
+	{
+		entry = CAPTURE_ENTRY(capture_state, i);
+		expected = CAPTURE_FREE;
+
+		if (pg_atomic_compare_exchange_u32(&entry->state, &expected,
+										   CAPTURE_FILLING))
+			break;
+
+		entry = NULL;
+	}
+
+	if (entry == NULL)
+		return false;
+
+	entry->dbid = MyDatabaseId;
+	entry->query_hash = capture->query_hash;
+	entry->plan_hash = capture->plan_hash;
+	entry->query_id = capture->query_id;
+	entry->nreloids = capture->nreloids;
+	entry->nindex_reloids = capture->nindex_reloids;
+	entry->query_len = query_len;
+	entry->plan_len = plan_len;
+
+	ptr = entry->data;
+	memcpy(ptr, capture->reloids, sizeof(Oid) * capture->nreloids);
+	ptr += sizeof(Oid) * capture->nreloids;
+	memcpy(ptr, capture->index_reloids, sizeof(Oid) * capture->nindex_reloids);
+	ptr += sizeof(Oid) * capture->nindex_reloids;
+	memcpy(ptr, capture->query, query_len);
+	ptr += query_len;
+	memcpy(ptr, capture->plan, plan_len);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&entry->state, CAPTURE_READY);
+
+	if (capture_wakeup_worker())
+		return true;
+
+	/* Nobody is going to save it, take the entry back unless it's gone */
+	expected = CAPTURE_READY;
+	return !pg_atomic_compare_exchange_u32(&entry->state, &expected,
+										   CAPTURE_FREE);
+}
+
+/*
+ * Move queued plans of current database to 'captures', which must have room
+ * for the whole queue. Returns number of plans.
+ */
+static int
+capture_dequeue(SrPlanCapture *captures)
+{
+	int		n = 0;
+	int		i;
+
+	for (i = 0; i < sr_plan_capture_queue_length; i++)
+	{
+		SrPlanCaptureEntry *entry = CAPTURE_ENTRY(capture_state, i);
+		SrPlanCapture	   *capture = &captures[n];
+		uint32				expected = CAPTURE_READY;
+		char			   *ptr;
+
+		if (entry->dbid != MyDatabaseId ||
+			!pg_atomic_compare_exchange_u32(&entry->state, &expected,
+											CAPTURE_FILLING))
+			continue;
+
+		pg_read_barrier();
+
+		capture->query_hash = entry->query_hash;
+		capture->plan_hash = entry->plan_hash;
+		capture->query_id = entry->query_id;
+		capture->nreloids = entry->nreloids;
+		capture->nindex_reloids = entry->nindex_reloids;
+
+		ptr = entry->data;
+		capture->reloids = palloc(sizeof(Oid) * entry->nreloids);
+		memcpy(capture->reloids, ptr, sizeof(Oid) * entry->nreloids);
+		ptr += sizeof(Oid) * entry->nreloids;
+		capture->index_reloids = palloc(sizeof(Oid) * entry->nindex_reloids);
+		memcpy(capture->index_reloids, ptr, sizeof(Oid) * entry->nindex_reloids);
+		ptr += sizeof(Oid) * entry->nindex_reloids;
+		capture->query = pstrdup(ptr);
+		ptr += entry->query_len;
+		capture->plan = palloc(entry->plan_len);
+		memcpy(capture->plan, ptr, entry->plan_len);
+
+		pg_atomic_write_u32(&entry->state, CAPTURE_FREE);
+		n++;
+	}
+
+	return n;
+}
+
+/* Caller must hold the mutex */
+static void
+capture_worker_release(void)
+{
+	int		i;
+
+	for (i = 0; i < SR_PLAN_MAX_CAPTURE_WORKERS; i++)
+	{
+		if (capture_state->workers[i].dbid == MyDatabaseId &&
+			capture_state->workers[i].latch == MyLatch)
+		{
+			capture_state->workers[i].dbid = InvalidOid;
+			capture_state->workers[i].latch = NULL;
+		}
+	}
+}
+
+static void
+capture_worker_detach(int code, Datum arg)
+{
+	SpinLockAcquire(&capture_state->mutex);
+	capture_worker_release();
+	SpinLockRelease(&capture_state->mutex);
+}
+
+/*
+ * Take the worker slot of current database. Returns false if another
+ * worker already serves it.
+ */
+static bool
+capture_worker_attach(void)
+{
+	SrPlanCaptureWorker *worker = NULL;
+	bool		result = true;
+	int			i;
+
+	SpinLockAcquire(&capture_state->mutex);
+	for (i = 0; i < SR_PLAN_MAX_CAPTURE_WORKERS; i++)
+	{
+		if (capture_state->workers[i].dbid == MyDatabaseId)
+		{
+			worker = &capture_state->workers[i];
+			break;
+		}
+
+		if (worker == NULL && capture_state->workers[i].dbid == InvalidOid)
+			worker = &capture_state->workers[i];
+	}
+
+	if (worker == NULL ||
+		(worker->dbid == MyDatabaseId && worker->latch != NULL))
+		result = false;
+	else
+	{
+		worker->dbid = MyDatabaseId;
+		worker->latch = MyLatch;
+	}
+	SpinLockRelease(&capture_state->mutex);
+
+	return result;
+}
+
+/*
+ * Exit if there is nothing more to do. The slot is released together with
+ * the check, and backends look at it only after queueing a plan, so plans
+ * queued after the check get a new worker.
+ */
+static void
+capture_worker_try_exit(void)
+{
+	bool	done;
+
+	SpinLockAcquire(&capture_state->mutex);
+	done = !capture_has_ready();
+	if (done)
+		capture_worker_release();
+	SpinLockRelease(&capture_state->mutex);
+
+	if (done)
+		proc_exit(0);
+}
+
+/*
+ * Save plans in a transaction of its own. Returns false if it has failed,
+ * the error is logged. 'installed' is set to false if sr_plan is not
+ * installed in the database.
+ */
+static bool
+capture_save_xact(SrPlanCapture *captures, int ncaptures, bool *installed)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	bool			ok = true;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PG_TRY();
+	{
+		PushActiveSnapshot(GetTransactionSnapshot());
+		*installed = sr_plan_save_captured(captures, ncaptures);
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		HOLD_INTERRUPTS();
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+		RESUME_INTERRUPTS();
+		ok = false;
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+static void
+capture_save(SrPlanCapture *captures, int ncaptures)
+{
+	bool	installed = true;
+	int		i;
+
+	pgstat_report_activity(STATE_RUNNING, "sr_plan: saving captured plans");
+
+	if (capture_save_xact(captures, ncaptures, &installed))
+	{
+		if (installed)
+			capture_publish(captures, ncaptures);
+	}
+	else
+	{
+		/* Don't lose the whole batch because of one plan */
+		for (i = 0; i < ncaptures && installed; i++)
+		{
+			if (!capture_save_xact(&captures[i], 1, &installed))
+				elog(WARNING, "sr_plan: captured plan is lost for query: %s",
+					 captures[i].query);
+			else if (installed)
+				capture_publish(&captures[i], 1);
+		}
+	}
+
+	if (!installed)
+		elog(WARNING, "sr_plan: extension is not installed, %d captured plans are lost",
+			 ncaptures);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+void
+sr_plan_capture_main(Datum main_arg)
+{
+	Oid				dbid = DatumGetObjectId(main_arg);
+	MemoryContext	batch_context;
+	SrPlanCapture  *captures;
+	TimestampTz		last_activity;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid);
+#endif
+
+	if (capture_state == NULL || !capture_worker_attach())
+		proc_exit(0);
+
+	before_shmem_exit(capture_worker_detach, (Datum) 0);
+
+	batch_context = AllocSetContextCreate(TopMemoryContext,
+										  "sr_plan capture batch",
+										  ALLOCSET_DEFAULT_SIZES);
+	captures = MemoryContextAlloc(TopMemoryContext,
+								  sizeof(SrPlanCapture) * sr_plan_capture_queue_length);
+	last_activity = GetCurrentTimestamp();
+
+	for (;;)
+	{
+		MemoryContext	oldctx;
+		int				ncaptures;
+		int				rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		oldctx = MemoryContextSwitchTo(batch_context);
+		ncaptures = capture_dequeue(captures);
+		MemoryContextSwitchTo(oldctx);
+
+		if (ncaptures > 0)
+		{
+			capture_save(captures, ncaptures);
+			MemoryContextReset(batch_context);
+			last_activity = GetCurrentTimestamp();
+			continue;
+		}
+
+		if (TimestampDifferenceExceeds(last_activity, GetCurrentTimestamp(),
+									   SR_PLAN_CAPTURE_IDLE_TIMEOUT))
+			capture_worker_try_exit();
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L, PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+#endif
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+}
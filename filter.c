@@ -0,0 +1,401 @@
+/*
+ * filter.c
+ *		Shared-memory filter of query hashes having an enabled plan.
+ *
+ * Every database gets its own Bloom filter. Bits are only ever set by
+ * backends which insert or enable rows in sr_plans, so the filter is always
+ * a superset of enabled plans and a miss means that sr_plans need not be
+ * looked at. Deleting or disabling rows only marks the filter as stale,
+ * it is rebuilt from sr_plans by the next backend planning a query.
+ *
+ * The rebuild doesn't block writers: bits are cleared before the scan, and
+ * the scan uses a dirty snapshot, which sees rows of transactions still in
+ * progress. A row inserted before the scan reaches its page is seen by the
+ * scan, and a row inserted after that sets its bits after they were cleared.
+ *
+ * A database takes a slot on first use and keeps it while it exists. When
+ * all slots are taken, a slot of a dropped database is taken over; if there
+ * is none, the database doesn't use the filter.
+ *
+ * On a standby the trigger never fires, so the filter is not used there.
+ */
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "commands/trigger.h"
+#include "port/atomics.h"
+#include "storage/lmgr.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "miscadmin.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "access/tableam.h"
+#endif
+
+PG_FUNCTION_INFO_V1(sr_plan_filter_add);
+
+typedef struct SrPlanFilterDb
+{
+	Oid					dbid;		/* InvalidOid if slot is free */
+	pg_atomic_uint32	ready;		/* bits cover all enabled plans */
+	pg_atomic_uint32	stale;		/* plans were removed since rebuild */
+	pg_atomic_uint32	building;	/* somebody is rebuilding bits */
+} SrPlanFilterDb;
+
+typedef struct SrPlanFilterState
+{
+	slock_t			mutex;		/* protects dbid of slots */
+	int				nwords;		/* number of words per database */
+	SrPlanFilterDb	dbs[FLEXIBLE_ARRAY_MEMBER];
+	/* followed by nwords of bits for each database */
+} SrPlanFilterState;
+
+int		sr_plan_filter_size = 8;
+int		sr_plan_filter_databases = 16;
+
+static SrPlanFilterState *filter_state = NULL;
+
+/* slot of MyDatabaseId: -2 if not looked for yet, -1 if there is none */
+static int	filter_slot = -2;
+
+#define FILTER_BITS(state, i) \
+	((pg_atomic_uint32 *) ((char *) (state) + \
+		MAXALIGN(offsetof(SrPlanFilterState, dbs) + \
+				 sizeof(SrPlanFilterDb) * sr_plan_filter_databases)) + \
+	 (Size) (i) * (state)->nwords)
+
+Size
+sr_plan_filter_shmem_size(void)
+{
+	Size		size;
+
+	size = MAXALIGN(offsetof(SrPlanFilterState, dbs) +
+					sizeof(SrPlanFilterDb) * sr_plan_filter_databases);
+	size = add_size(size, mul_size(sr_plan_filter_databases,
+								   (Size) sr_plan_filter_size * 1024));
+	return size;
+}
+
+void
+sr_plan_filter_shmem_init(void)
+{
+	bool		found;
+	int			i,
+				j;
+
+	filter_state = ShmemInitStruct("sr_plan filter",
+								   sr_plan_filter_shmem_size(), &found);
+	if (found)
+		return;
+
+	SpinLockInit(&filter_state->mutex);
+	filter_state->nwords = sr_plan_filter_size * 1024 / sizeof(uint32);
+
+	for (i = 0; i < sr_plan_filter_databases; i++)
+	{
+		pg_atomic_uint32   *bits = FILTER_BITS(filter_state, i);
+
+		filter_state->dbs[i].dbid = InvalidOid;
+		pg_atomic_init_u32(&filter_state->dbs[i].ready, 0);
+		pg_atomic_init_u32(&filter_state->dbs[i].stale, 0);
+		pg_atomic_init_u32(&filter_state->dbs[i].building, 0);
+
+		for (j = 0; j < filter_state->nwords; j++)
+			pg_atomic_init_u32(&bits[j], 0);
+	}
+}
+
+/*
+ * Find the slot of current database, taking a free one or the one of
+ * 'dropped_dbid' if there is none. Returns -1 if neither is found.
+ */
+static int
+claim_slot(Oid dropped_dbid)
+{
+	int		slot = -1;
+	int		i;
+
+	SpinLockAcquire(&filter_state->mutex);
+	for (i = 0; i < sr_plan_filter_databases; i++)
+	{
+		Oid		dbid = filter_state->dbs[i].dbid;
+
+		if (dbid == MyDatabaseId)
+		{
+			slot = i;
+			break;
+		}
+
+		if (slot < 0 &&
+			(dbid == InvalidOid || (OidIsValid(dropped_dbid) && dbid == dropped_dbid)))
+			slot = i;
+	}
+
+	if (slot >= 0 && filter_state->dbs[slot].dbid != MyDatabaseId)
+	{
+		SrPlanFilterDb *db = &filter_state->dbs[slot];
+
+		/* Backends of a dropped database are gone, bits are cleared by rebuild */
+		pg_atomic_write_u32(&db->ready, 0);
+		pg_atomic_write_u32(&db->stale, 0);
+		pg_atomic_write_u32(&db->building, 0);
+		db->dbid = MyDatabaseId;
+	}
+	SpinLockRelease(&filter_state->mutex);
+
+	return slot;
+}
+
+/*
+ * Take over a slot of a database which doesn't exist anymore.
+ */
+static int
+reclaim_slot(void)
+{
+	int		slot;
+	int		i;
+
+	for (i = 0; i < sr_plan_filter_databases; i++)
+	{
+		Oid		dbid;
+
+		SpinLockAcquire(&filter_state->mutex);
+		dbid = filter_state->dbs[i].dbid;
+		SpinLockRelease(&filter_state->mutex);
+
+		if (!OidIsValid(dbid) ||
+			SearchSysCacheExists1(DATABASEOID, ObjectIdGetDatum(dbid)))
+			continue;
+
+		slot = claim_slot(dbid);
+		if (slot >= 0)
+			return slot;
+	}
+
+	return -1;
+}
+
+/*
+ * Return filter slot of current database or NULL if the filter
+ * is not available.
+ */
+static SrPlanFilterDb *
+get_filter_db(void)
+{
+	if (filter_state == NULL || filter_state->nwords == 0)
+		return NULL;
+
+	if (filter_slot == -2)
+	{
+		filter_slot = claim_slot(InvalidOid);
+		if (filter_slot < 0)
+			filter_slot = reclaim_slot();
+	}
+
+	if (filter_slot < 0)
+		return NULL;
+
+	return &filter_state->dbs[filter_slot];
+}
+
+static void
+filter_positions(int32 query_hash, uint32 *pos1, uint32 *pos2)
+{
+	uint32		nbits = (uint32) filter_state->nwords * 32;
+	uint32		h1,
+				h2;
+
+	h1 = DatumGetUInt32(hash_uint32((uint32) query_hash));
+	h2 = DatumGetUInt32(hash_uint32(h1 ^ 0x9e3779b9));
+
+	*pos1 = h1 % nbits;
+	*pos2 = h2 % nbits;
+}
+
+static void
+filter_set(SrPlanFilterDb *db, int32 query_hash)
+{
+	pg_atomic_uint32   *bits = FILTER_BITS(filter_state, db - filter_state->dbs);
+	uint32				pos1,
+						pos2;
+
+	filter_positions(query_hash, &pos1, &pos2);
+	pg_atomic_fetch_or_u32(&bits[pos1 / 32], 1U << (pos1 % 32));
+	pg_atomic_fetch_or_u32(&bits[pos2 / 32], 1U << (pos2 % 32));
+}
+
+static bool
+filter_test(SrPlanFilterDb *db, int32 query_hash)
+{
+	pg_atomic_uint32   *bits = FILTER_BITS(filter_state, db - filter_state->dbs);
+	uint32				pos1,
+						pos2;
+
+	filter_positions(query_hash, &pos1, &pos2);
+	return (pg_atomic_read_u32(&bits[pos1 / 32]) & (1U << (pos1 % 32))) != 0 &&
+		(pg_atomic_read_u32(&bits[pos2 / 32]) & (1U << (pos2 % 32))) != 0;
+}
+
+/*
+ * Fill the filter of current database from scratch. Nothing is done if this
+ * transaction has changed something itself, since a dirty snapshot doesn't
+ * see rows it deleted and the deletion could be rolled back.
+ */
+static void
+filter_rebuild(SrPlanFilterDb *db, Oid sr_plans_oid)
+{
+	pg_atomic_uint32   *bits = FILTER_BITS(filter_state, db - filter_state->dbs);
+	uint32				expected = 0;
+	Relation			sr_plans_heap;
+	SnapshotData		snapshot;
+	HeapTuple			htup;
+	int					i;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc		scan;
+#else
+	HeapScanDesc		scan;
+#endif
+
+	if (GetTopTransactionIdIfAny() != InvalidTransactionId)
+		return;
+
+	if (!pg_atomic_compare_exchange_u32(&db->building, &expected, 1))
+		return;
+
+	/* Don't wait for DDL on sr_plans either */
+	if (!ConditionalLockRelationOid(sr_plans_oid, AccessShareLock))
+	{
+		pg_atomic_write_u32(&db->building, 0);
+		return;
+	}
+
+	PG_TRY();
+	{
+		pg_atomic_write_u32(&db->ready, 0);
+		pg_atomic_write_u32(&db->stale, 0);
+		pg_write_barrier();
+
+		for (i = 0; i < filter_state->nwords; i++)
+			pg_atomic_write_u32(&bits[i], 0);
+		pg_memory_barrier();
+
+#if PG_VERSION_NUM >= 130000
+		sr_plans_heap = table_open(sr_plans_oid, NoLock);
+#else
+		sr_plans_heap = heap_open(sr_plans_oid, NoLock);
+#endif
+		InitDirtySnapshot(snapshot);
+
+#if PG_VERSION_NUM >= 120000
+		scan = table_beginscan(sr_plans_heap, &snapshot, 0, NULL);
+#else
+		scan = heap_beginscan(sr_plans_heap, &snapshot, 0, NULL);
+#endif
+		while ((htup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+		{
+			TupleDesc	tupdesc = RelationGetDescr(sr_plans_heap);
+			Datum		value;
+			bool		isnull;
+
+			value = heap_getattr(htup, Anum_sr_enable, tupdesc, &isnull);
+			if (isnull || !DatumGetBool(value))
+				continue;
+
+			value = heap_getattr(htup, Anum_sr_query_hash, tupdesc, &isnull);
+			filter_set(db, DatumGetInt32(value));
+		}
+#if PG_VERSION_NUM >= 120000
+		table_endscan(scan);
+#else
+		heap_endscan(scan);
+#endif
+
+#if PG_VERSION_NUM >= 130000
+		table_close(sr_plans_heap, NoLock);
+#else
+		heap_close(sr_plans_heap, NoLock);
+#endif
+
+		pg_write_barrier();
+		pg_atomic_write_u32(&db->ready, 1);
+	}
+	PG_CATCH();
+	{
+		pg_atomic_write_u32(&db->building, 0);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pg_atomic_write_u32(&db->building, 0);
+}
+
+/*
+ * Return false if there is definitely no enabled plan for 'query_hash'
+ * in current database. Costs a couple of memory reads in common case.
+ */
+bool
+sr_plan_filter_lookup(Oid sr_plans_oid, int32 query_hash)
+{
+	SrPlanFilterDb *db = get_filter_db();
+
+	if (db == NULL || RecoveryInProgress())
+		return true;
+
+	if (!pg_atomic_read_u32(&db->ready) || pg_atomic_read_u32(&db->stale))
+		filter_rebuild(db, sr_plans_oid);
+
+	if (!pg_atomic_read_u32(&db->ready))
+		return true;
+
+	pg_read_barrier();
+	return filter_test(db, query_hash);
+}
+
+/*
+ * Plans were deleted or disabled in current database.
+ */
+void
+sr_plan_filter_invalidate(void)
+{
+	SrPlanFilterDb *db = get_filter_db();
+
+	if (db != NULL)
+		pg_atomic_write_u32(&db->stale, 1);
+}
+
+/*
+ * Row trigger on sr_plans, fired for enabled rows only.
+ */
+Datum
+sr_plan_filter_add(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = (TriggerData *) fcinfo->context;
+	SrPlanFilterDb *db;
+	HeapTuple		htup;
+	Datum			value;
+	bool			isnull;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "sr_plan_filter_add: not fired by trigger manager");
+
+	/* Fired only for enabled plans, unlike sr_plan_invalidate_cache() */
+	sr_plan_archive_invalidate();
+
+	db = get_filter_db();
+	if (db == NULL)
+		return PointerGetDatum(NULL);
+
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		htup = trigdata->tg_newtuple;
+	else
+		htup = trigdata->tg_trigtuple;
+
+	value = heap_getattr(htup, Anum_sr_query_hash,
+						 RelationGetDescr(trigdata->tg_relation), &isnull);
+	if (!isnull)
+		filter_set(db, DatumGetInt32(value));
+
+	return PointerGetDatum(NULL);
+}
@@ -0,0 +1,763 @@
+/*
+ * plan_archive.c
+ *		Enabled plans of all databases kept in a file of the data directory.
+ *
+ * With sr_plan.archive enabled plans of every database are written into the
+ * sr_plan_archive file, which is loaded into shared memory in one read when
+ * the server starts, so the planner finds them before any backend has read
+ * sr_plans. The file is an image of the shared memory area: a header, entries
+ * sorted by database and query_hash and nodeToString() texts of the plans.
+ *
+ * A transaction changing enabled plans rebuilds the image at pre-commit from
+ * sr_plans of its database and entries of other databases, writes it into a
+ * temporary file and renames it over the archive at commit, when the image is
+ * also copied into shared memory. Texts of plans already in the image are
+ * reused, only new plans are decoded. Rebuilds are serialized by a cluster
+ * wide advisory lock held until the end of transaction, so they always see
+ * each other's changes, while waiting for it can be interrupted.
+ *
+ * The file may be behind sr_plans: a crash could happen between commit and
+ * the rename, and a standby gets the file of its base backup while changes
+ * of sr_plans are replayed. So entries of a database are checked against
+ * its sr_plans before they are used, once after the file is loaded on a
+ * primary and once in every backend on a standby, since changes replayed
+ * while no backend of the database is connected are not seen otherwise.
+ * Entries of plans which are no longer enabled in sr_plans are not used.
+ */
+#include "sr_plan.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+#define SR_PLAN_ARCHIVE_FILE		"sr_plan_archive"
+#define SR_PLAN_ARCHIVE_TMP_FILE	SR_PLAN_ARCHIVE_FILE ".tmp"
+#define SR_PLAN_ARCHIVE_MAGIC		0x41505253	/* "SRPA" */
+#define SR_PLAN_ARCHIVE_VERSION		2
+
+/* entry flags */
+#define ARCHIVE_ENTRY_CHECKED		0x0001	/* checked against sr_plans */
+
+typedef struct SrPlanArchiveHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		pg_version;		/* major version, plan texts depend on it */
+	uint32		nentries;
+	uint32		size;			/* of texts following entries */
+} SrPlanArchiveHeader;
+
+typedef struct SrPlanArchiveEntry
+{
+	Oid			dbid;
+	Oid			sr_plans_oid;	/* InvalidOid if the plan is out of date */
+	int32		query_hash;
+	int32		plan_hash;
+	uint32		offset;			/* of the plan text */
+	uint32		len;
+	uint32		flags;
+} SrPlanArchiveEntry;
+
+/* Key of the advisory lock serializing rebuilds, in no database */
+#define SET_LOCKTAG_ARCHIVE(tag) \
+	SET_LOCKTAG_ADVISORY(tag, InvalidOid, SR_PLAN_ARCHIVE_MAGIC, 0, 1)
+
+typedef struct SrPlanArchiveShared
+{
+	LWLock	   *lock;			/* protects the image */
+	Size		capacity;		/* of the image */
+	SrPlanArchiveHeader image;	/* followed by entries and texts */
+} SrPlanArchiveShared;
+
+#define ARCHIVE_ENTRIES(header) \
+	((SrPlanArchiveEntry *) ((char *) (header) + sizeof(SrPlanArchiveHeader)))
+#define ARCHIVE_TEXTS(header) \
+	((char *) (ARCHIVE_ENTRIES(header) + (header)->nentries))
+#define ARCHIVE_IMAGE_SIZE(header) \
+	(sizeof(SrPlanArchiveHeader) + \
+	 (Size) (header)->nentries * sizeof(SrPlanArchiveEntry) + (header)->size)
+
+bool	sr_plan_archive = false;
+int		sr_plan_archive_size = 8;
+
+static SrPlanArchiveShared *archive_shared = NULL;
+
+/* entries of the current database are checked by this backend */
+static bool		archive_checked = false;
+
+/* enabled plans are changed by the current transaction */
+static bool		archive_changed = false;
+static bool		xact_callback_registered = false;
+
+/* image written at pre-commit, to be installed at commit */
+static SrPlanArchiveHeader *pending_image = NULL;
+
+static void archive_xact_callback(XactEvent event, void *arg);
+
+Size
+sr_plan_archive_shmem_size(void)
+{
+	if (!sr_plan_archive)
+		return 0;
+
+	return MAXALIGN(offsetof(SrPlanArchiveShared, image) +
+					(Size) sr_plan_archive_size * 1024 * 1024);
+}
+
+void
+sr_plan_archive_shmem_request(void)
+{
+	if (sr_plan_archive)
+		RequestNamedLWLockTranche("sr_plan archive", 1);
+}
+
+/*
+ * Read the file into shared memory, leaving the image empty if it's missing
+ * or doesn't fit.
+ */
+static void
+archive_load(void)
+{
+	SrPlanArchiveHeader *image = &archive_shared->image;
+	SrPlanArchiveHeader	header;
+	FILE			   *file;
+	Size				len;
+
+	file = AllocateFile(SR_PLAN_ARCHIVE_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							SR_PLAN_ARCHIVE_FILE)));
+		return;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != SR_PLAN_ARCHIVE_MAGIC ||
+		header.version != SR_PLAN_ARCHIVE_VERSION ||
+		header.pg_version != PG_VERSION_NUM / 100)
+	{
+		ereport(LOG,
+				(errmsg("sr_plan: ignoring invalid file \"%s\"",
+						SR_PLAN_ARCHIVE_FILE)));
+		FreeFile(file);
+		return;
+	}
+
+	len = ARCHIVE_IMAGE_SIZE(&header);
+	if (len > archive_shared->capacity)
+	{
+		ereport(LOG,
+				(errmsg("sr_plan: file \"%s\" doesn't fit into sr_plan.archive_size",
+						SR_PLAN_ARCHIVE_FILE)));
+		FreeFile(file);
+		return;
+	}
+
+	/* Header goes last, so a partially read image stays empty */
+	if (fread(ARCHIVE_ENTRIES(image), 1, len - sizeof(header), file) !=
+		len - sizeof(header))
+		ereport(LOG,
+				(errmsg("sr_plan: ignoring invalid file \"%s\"",
+						SR_PLAN_ARCHIVE_FILE)));
+	else
+	{
+		SrPlanArchiveEntry *entries = ARCHIVE_ENTRIES(image);
+		uint32				i;
+
+		/* The file could be behind sr_plans */
+		for (i = 0; i < header.nentries; i++)
+			entries[i].flags = 0;
+		*image = header;
+	}
+
+	FreeFile(file);
+}
+
+void
+sr_plan_archive_shmem_init(void)
+{
+	bool			found;
+
+	if (!sr_plan_archive)
+		return;
+
+	archive_shared = ShmemInitStruct("sr_plan archive",
+									 sr_plan_archive_shmem_size(), &found);
+	if (!found)
+	{
+		archive_shared->lock = &(GetNamedLWLockTranche("sr_plan archive"))->lock;
+		archive_shared->capacity = sr_plan_archive_shmem_size() -
+			offsetof(SrPlanArchiveShared, image);
+
+		MemSet(&archive_shared->image, 0, sizeof(SrPlanArchiveHeader));
+		archive_shared->image.magic = SR_PLAN_ARCHIVE_MAGIC;
+		archive_shared->image.version = SR_PLAN_ARCHIVE_VERSION;
+		archive_shared->image.pg_version = PG_VERSION_NUM / 100;
+		archive_load();
+	}
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const SrPlanArchiveEntry *ea = (const SrPlanArchiveEntry *) a;
+	const SrPlanArchiveEntry *eb = (const SrPlanArchiveEntry *) b;
+
+	if (ea->dbid != eb->dbid)
+		return ea->dbid < eb->dbid ? -1 : 1;
+	if (ea->query_hash != eb->query_hash)
+		return ea->query_hash < eb->query_hash ? -1 : 1;
+	return 0;
+}
+
+/* Same as entry_cmp(), but keeps the first of plans with the same key */
+static int
+entry_sort_cmp(const void *a, const void *b)
+{
+	const SrPlanArchiveEntry *ea = (const SrPlanArchiveEntry *) a;
+	const SrPlanArchiveEntry *eb = (const SrPlanArchiveEntry *) b;
+	int			res = entry_cmp(a, b);
+
+	if (res != 0 || ea->offset == eb->offset)
+		return res;
+	return ea->offset < eb->offset ? -1 : 1;
+}
+
+static int
+entry_plan_cmp(const void *a, const void *b)
+{
+	const SrPlanArchiveEntry *ea = (const SrPlanArchiveEntry *) a;
+	const SrPlanArchiveEntry *eb = (const SrPlanArchiveEntry *) b;
+
+	if (ea->query_hash != eb->query_hash)
+		return ea->query_hash < eb->query_hash ? -1 : 1;
+	if (ea->plan_hash != eb->plan_hash)
+		return ea->plan_hash < eb->plan_hash ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Enabled plans of sr_plans, sorted by entry_plan_cmp().
+ */
+static SrPlanArchiveEntry *
+archive_enabled_plans(Relation sr_plans_heap, int *nplans)
+{
+	TupleDesc			tupdesc = RelationGetDescr(sr_plans_heap);
+	SrPlanArchiveEntry *plans;
+	Snapshot			snapshot;
+	HeapTuple			htup;
+	int					maxplans = 64;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc		scan;
+#else
+	HeapScanDesc		scan;
+#endif
+
+	plans = palloc(sizeof(SrPlanArchiveEntry) * maxplans);
+	*nplans = 0;
+
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#else
+	scan = heap_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#endif
+	while ((htup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		SrPlanArchiveEntry *plan;
+		Datum		value;
+		bool		isnull;
+
+		value = heap_getattr(htup, Anum_sr_enable, tupdesc, &isnull);
+		if (isnull || !DatumGetBool(value))
+			continue;
+
+		if (*nplans >= maxplans)
+		{
+			maxplans *= 2;
+			plans = repalloc(plans, sizeof(SrPlanArchiveEntry) * maxplans);
+		}
+		plan = &plans[(*nplans)++];
+		value = heap_getattr(htup, Anum_sr_query_hash, tupdesc, &isnull);
+		plan->query_hash = DatumGetInt32(value);
+		value = heap_getattr(htup, Anum_sr_plan_hash, tupdesc, &isnull);
+		plan->plan_hash = DatumGetInt32(value);
+	}
+#if PG_VERSION_NUM >= 120000
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+	UnregisterSnapshot(snapshot);
+
+	qsort(plans, *nplans, sizeof(SrPlanArchiveEntry), entry_plan_cmp);
+	return plans;
+}
+
+/*
+ * Check entries of the current database against sr_plans, entries of plans
+ * not enabled there are not used anymore. Returns false if it can't be done
+ * now without waiting for locks.
+ */
+static bool
+archive_check(Oid sr_plans_oid)
+{
+	SrPlanArchiveHeader *image;
+	SrPlanArchiveEntry *entries;
+	SrPlanArchiveEntry *plans;
+	Relation			sr_plans_heap;
+	LOCKTAG				tag;
+	bool				recovery = RecoveryInProgress();
+	bool				checked = true;
+	int					nplans;
+	uint32				i;
+
+	SET_LOCKTAG_ARCHIVE(tag);
+
+	/* On a primary entries stay checked once they are, see archive_build() */
+	if (!recovery)
+	{
+		LWLockAcquire(archive_shared->lock, LW_SHARED);
+		image = &archive_shared->image;
+		entries = ARCHIVE_ENTRIES(image);
+		for (i = 0; i < image->nentries && checked; i++)
+		{
+			if (entries[i].dbid == MyDatabaseId &&
+				!(entries[i].flags & ARCHIVE_ENTRY_CHECKED))
+				checked = false;
+		}
+		LWLockRelease(archive_shared->lock);
+		if (checked)
+			return true;
+
+		/* A rebuild in progress would make the check out of date */
+		if (LockAcquire(&tag, ShareLock, false, true) == LOCKACQUIRE_NOT_AVAIL)
+			return false;
+	}
+
+	if (!ConditionalLockRelationOid(sr_plans_oid, AccessShareLock))
+	{
+		if (!recovery)
+			LockRelease(&tag, ShareLock, false);
+		return false;
+	}
+
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(sr_plans_oid, NoLock);
+#else
+	sr_plans_heap = heap_open(sr_plans_oid, NoLock);
+#endif
+	plans = archive_enabled_plans(sr_plans_heap, &nplans);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, AccessShareLock);
+#else
+	heap_close(sr_plans_heap, AccessShareLock);
+#endif
+
+	LWLockAcquire(archive_shared->lock, LW_EXCLUSIVE);
+	image = &archive_shared->image;
+	entries = ARCHIVE_ENTRIES(image);
+	for (i = 0; i < image->nentries; i++)
+	{
+		if (entries[i].dbid != MyDatabaseId)
+			continue;
+
+		if (entries[i].sr_plans_oid != sr_plans_oid ||
+			bsearch(&entries[i], plans, nplans, sizeof(SrPlanArchiveEntry),
+					entry_plan_cmp) == NULL)
+			entries[i].sr_plans_oid = InvalidOid;
+		entries[i].flags |= ARCHIVE_ENTRY_CHECKED;
+	}
+	LWLockRelease(archive_shared->lock);
+
+	if (!recovery)
+		LockRelease(&tag, ShareLock, false);
+	pfree(plans);
+
+	return true;
+}
+
+/*
+ * Plan of 'query_hash' in the current database or NULL.
+ */
+PlannedStmt *
+sr_plan_archive_lookup(Oid sr_plans_oid, int32 query_hash, int32 *plan_hash)
+{
+	SrPlanArchiveHeader *image;
+	SrPlanArchiveEntry	key;
+	SrPlanArchiveEntry *entry;
+	char			   *plan_text = NULL;
+
+	/* The image doesn't have our own changes yet */
+	if (archive_shared == NULL || archive_changed)
+		return NULL;
+
+	if (!archive_checked)
+	{
+		if (!archive_check(sr_plans_oid))
+			return NULL;
+		archive_checked = true;
+	}
+
+	key.dbid = MyDatabaseId;
+	key.query_hash = query_hash;
+
+	LWLockAcquire(archive_shared->lock, LW_SHARED);
+	image = &archive_shared->image;
+	entry = bsearch(&key, ARCHIVE_ENTRIES(image), image->nentries,
+					sizeof(SrPlanArchiveEntry), entry_cmp);
+	if (entry != NULL && entry->sr_plans_oid == sr_plans_oid &&
+		(Size) entry->offset + entry->len <= image->size)
+	{
+		plan_text = palloc(entry->len + 1);
+		memcpy(plan_text, ARCHIVE_TEXTS(image) + entry->offset, entry->len);
+		plan_text[entry->len] = '\0';
+		*plan_hash = entry->plan_hash;
+	}
+	LWLockRelease(archive_shared->lock);
+
+	if (plan_text == NULL)
+		return NULL;
+
+	return (PlannedStmt *) stringToNode(plan_text);
+}
+
+/*
+ * Enabled plans of the current database are changed by the current
+ * transaction.
+ */
+void
+sr_plan_archive_invalidate(void)
+{
+	if (archive_shared == NULL)
+		return;
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(archive_xact_callback, NULL);
+		xact_callback_registered = true;
+	}
+	archive_changed = true;
+}
+
+/*
+ * Relation 'relid' of the current database is changed.
+ */
+void
+sr_plan_archive_relcache(Oid relid, Oid sr_plans_oid)
+{
+	SrPlanArchiveHeader *image;
+	SrPlanArchiveEntry *entries;
+	uint32				i;
+
+	/* Changes made by the primary are never written on a standby */
+	if (archive_shared == NULL || !OidIsValid(relid) ||
+		relid != sr_plans_oid || !RecoveryInProgress())
+		return;
+
+	LWLockAcquire(archive_shared->lock, LW_EXCLUSIVE);
+	image = &archive_shared->image;
+	entries = ARCHIVE_ENTRIES(image);
+	for (i = 0; i < image->nentries; i++)
+	{
+		if (entries[i].dbid == MyDatabaseId)
+			entries[i].sr_plans_oid = InvalidOid;
+	}
+	LWLockRelease(archive_shared->lock);
+}
+
+/*
+ * Private copy of the image in shared memory.
+ */
+static SrPlanArchiveHeader *
+archive_copy(void)
+{
+	SrPlanArchiveHeader *image;
+	Size				len;
+
+	LWLockAcquire(archive_shared->lock, LW_SHARED);
+	len = ARCHIVE_IMAGE_SIZE(&archive_shared->image);
+	image = palloc(len);
+	memcpy(image, &archive_shared->image, len);
+	LWLockRelease(archive_shared->lock);
+
+	return image;
+}
+
+/*
+ * Build the image of enabled plans in sr_plans and of other databases in the
+ * current image. Called with the archive lock held, so the current image is
+ * not replaced meanwhile.
+ */
+static SrPlanArchiveHeader *
+archive_build(Relation sr_plans_heap)
+{
+	SrPlanArchiveHeader *image;
+	SrPlanArchiveHeader *result;
+	SrPlanArchiveEntry *entries;
+	SrPlanArchiveEntry *image_entries;
+	StringInfoData		texts;
+	int					nentries = 0;
+	int					maxentries = 64;
+	uint32				i;
+	int					j;
+	int					n;
+
+	entries = palloc(sizeof(SrPlanArchiveEntry) * maxentries);
+	initStringInfo(&texts);
+	image = archive_copy();
+	image_entries = ARCHIVE_ENTRIES(image);
+
+	if (sr_plans_heap != NULL)
+	{
+		TupleDesc		tupdesc = RelationGetDescr(sr_plans_heap);
+		Snapshot		snapshot;
+		HeapTuple		htup;
+		MemoryContext	tmpcontext;
+		MemoryContext	oldcontext;
+#if PG_VERSION_NUM >= 120000
+		TableScanDesc	scan;
+#else
+		HeapScanDesc	scan;
+#endif
+
+		tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+										   "sr_plan archive",
+										   ALLOCSET_DEFAULT_SIZES);
+		snapshot = RegisterSnapshot(GetLatestSnapshot());
+#if PG_VERSION_NUM >= 120000
+		scan = table_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#else
+		scan = heap_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#endif
+		while ((htup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+		{
+			SrPlanArchiveEntry *entry;
+			SrPlanArchiveEntry *found;
+			Datum		value;
+			bool		isnull;
+			char	   *plan_text;
+
+			value = heap_getattr(htup, Anum_sr_enable, tupdesc, &isnull);
+			if (isnull || !DatumGetBool(value))
+				continue;
+
+			if (nentries >= maxentries)
+			{
+				maxentries *= 2;
+				entries = repalloc(entries,
+								   sizeof(SrPlanArchiveEntry) * maxentries);
+			}
+			entry = &entries[nentries++];
+			entry->dbid = MyDatabaseId;
+			entry->sr_plans_oid = RelationGetRelid(sr_plans_heap);
+			value = heap_getattr(htup, Anum_sr_query_hash, tupdesc, &isnull);
+			entry->query_hash = DatumGetInt32(value);
+			value = heap_getattr(htup, Anum_sr_plan_hash, tupdesc, &isnull);
+			entry->plan_hash = DatumGetInt32(value);
+			entry->offset = texts.len;
+			entry->flags = ARCHIVE_ENTRY_CHECKED;
+
+			/* The plan may be in the image already */
+			found = bsearch(entry, image_entries, image->nentries,
+							sizeof(SrPlanArchiveEntry), entry_cmp);
+			if (found != NULL && found->sr_plans_oid == entry->sr_plans_oid &&
+				found->plan_hash == entry->plan_hash &&
+				(Size) found->offset + found->len <= image->size)
+			{
+				entry->len = found->len;
+				appendBinaryStringInfo(&texts,
+									   ARCHIVE_TEXTS(image) + found->offset,
+									   found->len);
+				continue;
+			}
+
+			oldcontext = MemoryContextSwitchTo(tmpcontext);
+			value = heap_getattr(htup, Anum_sr_plan, tupdesc, &isnull);
+			plan_text = TextDatumGetCString(value);
+			MemoryContextSwitchTo(oldcontext);
+
+			entry->len = strlen(plan_text);
+			appendBinaryStringInfo(&texts, plan_text, entry->len);
+			MemoryContextReset(tmpcontext);
+		}
+#if PG_VERSION_NUM >= 120000
+		table_endscan(scan);
+#else
+		heap_endscan(scan);
+#endif
+		UnregisterSnapshot(snapshot);
+		MemoryContextDelete(tmpcontext);
+	}
+
+	/* Plans of other databases are kept as they are */
+	for (i = 0; i < image->nentries; i++)
+	{
+		SrPlanArchiveEntry *entry;
+
+		if (image_entries[i].dbid == MyDatabaseId ||
+			!OidIsValid(image_entries[i].sr_plans_oid))
+			continue;
+
+		if (nentries >= maxentries)
+		{
+			maxentries *= 2;
+			entries = repalloc(entries,
+							   sizeof(SrPlanArchiveEntry) * maxentries);
+		}
+		entry = &entries[nentries++];
+		*entry = image_entries[i];
+		entry->offset = texts.len;
+		appendBinaryStringInfo(&texts,
+							   ARCHIVE_TEXTS(image) + image_entries[i].offset,
+							   image_entries[i].len);
+	}
+	pfree(image);
+
+	/* Only the first of enabled plans of a query is used, like in sr_plans */
+	qsort(entries, nentries, sizeof(SrPlanArchiveEntry), entry_sort_cmp);
+	n = 0;
+	for (j = 0; j < nentries; j++)
+	{
+		if (n > 0 && entry_cmp(&entries[n - 1], &entries[j]) == 0)
+			continue;
+		entries[n++] = entries[j];
+	}
+
+	result = MemoryContextAlloc(TopMemoryContext,
+								sizeof(SrPlanArchiveHeader) +
+								sizeof(SrPlanArchiveEntry) * n + texts.len);
+	result->magic = SR_PLAN_ARCHIVE_MAGIC;
+	result->version = SR_PLAN_ARCHIVE_VERSION;
+	result->pg_version = PG_VERSION_NUM / 100;
+	result->nentries = n;
+	result->size = texts.len;
+	memcpy(ARCHIVE_ENTRIES(result), entries, sizeof(SrPlanArchiveEntry) * n);
+	memcpy(ARCHIVE_TEXTS(result), texts.data, texts.len);
+
+	pfree(entries);
+	pfree(texts.data);
+
+	return result;
+}
+
+/*
+ * Write the new image into the temporary file, it's renamed at commit.
+ */
+static void
+archive_prepare(void)
+{
+	Oid				sr_plans_oid = sr_plan_plans_relid();
+	Relation		sr_plans_heap = NULL;
+	LOCKTAG			tag;
+	FILE		   *file;
+	Size			len;
+
+	/* Our own changes have to be visible to the scan */
+	CommandCounterIncrement();
+
+	/* Lock sr_plans before the archive, it may be locked by a rebuilder */
+	if (OidIsValid(sr_plans_oid))
+#if PG_VERSION_NUM >= 130000
+		sr_plans_heap = table_open(sr_plans_oid, AccessShareLock);
+#else
+		sr_plans_heap = heap_open(sr_plans_oid, AccessShareLock);
+#endif
+
+	/* Released at the end of transaction, after the image is installed */
+	SET_LOCKTAG_ARCHIVE(tag);
+	(void) LockAcquire(&tag, ExclusiveLock, false, false);
+	pending_image = archive_build(sr_plans_heap);
+
+	if (sr_plans_heap != NULL)
+#if PG_VERSION_NUM >= 130000
+		table_close(sr_plans_heap, AccessShareLock);
+#else
+		heap_close(sr_plans_heap, AccessShareLock);
+#endif
+
+	len = ARCHIVE_IMAGE_SIZE(pending_image);
+	if (len > archive_shared->capacity)
+		ereport(WARNING,
+				(errmsg("sr_plan: enabled plans don't fit into sr_plan.archive_size"),
+				 errdetail("Plans of the archive are not used until restart.")));
+
+	file = AllocateFile(SR_PLAN_ARCHIVE_TMP_FILE, PG_BINARY_W);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m",
+						SR_PLAN_ARCHIVE_TMP_FILE)));
+
+	if (fwrite(pending_image, 1, len, file) != len ||
+		ferror(file) || FreeFile(file))
+	{
+		unlink(SR_PLAN_ARCHIVE_TMP_FILE);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						SR_PLAN_ARCHIVE_TMP_FILE)));
+	}
+}
+
+/*
+ * Replace the file and the image in shared memory with the pending one.
+ */
+static void
+archive_install(void)
+{
+	SrPlanArchiveHeader *image = &archive_shared->image;
+	Size		len = ARCHIVE_IMAGE_SIZE(pending_image);
+
+	(void) durable_rename(SR_PLAN_ARCHIVE_TMP_FILE, SR_PLAN_ARCHIVE_FILE, LOG);
+
+	LWLockAcquire(archive_shared->lock, LW_EXCLUSIVE);
+	if (len <= archive_shared->capacity)
+		memcpy(image, pending_image, len);
+	else
+		image->nentries = image->size = 0;
+	LWLockRelease(archive_shared->lock);
+}
+
+static void
+archive_xact_callback(XactEvent event, void *arg)
+{
+	if (!archive_changed)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			archive_prepare();
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot PREPARE a transaction that has changed enabled plans with sr_plan.archive")));
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+			/* The archive lock is still held, it's released after this */
+			if (pending_image != NULL)
+			{
+				if (event == XACT_EVENT_COMMIT)
+					archive_install();
+				else
+					unlink(SR_PLAN_ARCHIVE_TMP_FILE);
+				pfree(pending_image);
+				pending_image = NULL;
+			}
+			archive_changed = false;
+			break;
+		default:
+			break;
+	}
+}
@@ -0,0 +1,562 @@
+/*
+ * plan_cache.c
+ *		Backend-local cache of frozen plans.
+ *
+ * _p() calls of a cached plan are replaced by executor parameters (see
+ * plan_params.c), so the cached tree is read-only and a hit just shares it.
+ * Memory of the plan is pinned by the memory context the statement was
+ * planned in, so an evicted plan is only freed when nobody uses it.
+ * Plans which can't be converted are kept as they were read from sr_plans,
+ * with their _p() calls found once, and are copied by every hit.
+ *
+ * Besides, (query_hash, plan_hash) pairs found in sr_plans by write_mode are
+ * remembered, so capturing the same plan again doesn't need to look at the
+ * table. Everything is dropped on any relcache invalidation of sr_plans.
+ *
+ * Plans are also listed by relations and indexes they use, the same ones as
+ * in reloids and index_reloids of sr_plans, so a relcache invalidation of one
+ * of them evicts only the plans depending on it.
+ *
+ * sr_plan_prewarm() fills the cache with enabled plans in one sequential
+ * scan of sr_plans, so first executions of queries don't pay for lookups.
+ */
+#include "sr_plan.h"
+#include "storage/lmgr.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_prewarm);
+
+#define SR_PLAN_PREWARM_COLS	3
+
+typedef struct SrPlanCacheTree
+{
+	MemoryContext	context;		/* holds the plan and this struct */
+	int				refcount;		/* statements using the plan */
+	bool			evicted;		/* removed from the cache */
+} SrPlanCacheTree;
+
+typedef struct SrPlanKnownKey
+{
+	int32			query_hash;
+	int32			plan_hash;
+} SrPlanKnownKey;
+
+/* Plans using a relation */
+typedef struct SrPlanCacheRel
+{
+	Oid				relid;			/* hash key, must be first */
+	dlist_head		deps;			/* SrPlanCacheDep */
+} SrPlanCacheRel;
+
+typedef struct SrPlanCacheDep
+{
+	dlist_node		node;
+	Oid				relid;
+	SrPlanCacheEntry *entry;
+} SrPlanCacheDep;
+
+/* limit on remembered pairs, that's about 1MB of memory */
+#define SR_PLAN_KNOWN_PLANS_MAX		65536
+
+int		sr_plan_cache_size = 256;
+
+static HTAB		   *plan_cache = NULL;
+static HTAB		   *known_plans = NULL;
+static HTAB		   *plan_cache_rels = NULL;
+static MemoryContext plan_cache_context = NULL;
+static dlist_head	plan_cache_lru = DLIST_STATIC_INIT(plan_cache_lru);
+
+static void
+plan_cache_init(void)
+{
+	HASHCTL		ctl;
+
+	plan_cache_context = AllocSetContextCreate(CacheMemoryContext,
+											   "sr_plan plan cache",
+											   ALLOCSET_DEFAULT_SIZES);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int32);
+	ctl.entrysize = sizeof(SrPlanCacheEntry);
+	ctl.hcxt = plan_cache_context;
+
+	plan_cache = hash_create("sr_plan plan cache", 64, &ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	dlist_init(&plan_cache_lru);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SrPlanKnownKey);
+	ctl.entrysize = sizeof(SrPlanKnownKey);
+	ctl.hcxt = plan_cache_context;
+
+	known_plans = hash_create("sr_plan known plans", 256, &ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(SrPlanCacheRel);
+	ctl.hcxt = plan_cache_context;
+
+	plan_cache_rels = hash_create("sr_plan plan cache relations", 64, &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+static void
+plan_cache_release(SrPlanCacheTree *tree)
+{
+	if (tree->refcount > 0)
+	{
+		/* Keep the plan until the last statement using it is freed */
+		tree->evicted = true;
+		MemoryContextSetParent(tree->context, TopMemoryContext);
+	}
+	else
+		MemoryContextDelete(tree->context);
+}
+
+static void
+plan_cache_unpin(void *arg)
+{
+	SrPlanCacheTree *tree = (SrPlanCacheTree *) arg;
+
+	Assert(tree->refcount > 0);
+	tree->refcount--;
+	if (tree->refcount == 0 && tree->evicted)
+		MemoryContextDelete(tree->context);
+}
+
+/*
+ * List the entry by relations and indexes used by its plan.
+ */
+static void
+plan_cache_add_deps(SrPlanCacheEntry *entry)
+{
+	List	   *relids;
+	List	   *index_oids;
+	ListCell   *lc;
+
+	index_oids = sr_plan_index_oids(entry->pl_stmt);
+	relids = list_concat_unique_oid(list_copy(entry->pl_stmt->relationOids),
+									index_oids);
+	entry->ndeps = 0;
+	entry->deps = MemoryContextAlloc(plan_cache_context,
+									 sizeof(SrPlanCacheDep) *
+									 (list_length(relids) + 1));
+	foreach(lc, relids)
+	{
+		SrPlanCacheDep *dep = &entry->deps[entry->ndeps];
+		SrPlanCacheRel *rel;
+		bool			found;
+
+		dep->relid = lfirst_oid(lc);
+		dep->entry = entry;
+		rel = (SrPlanCacheRel *) hash_search(plan_cache_rels, &dep->relid,
+											 HASH_ENTER, &found);
+		if (!found)
+			dlist_init(&rel->deps);
+		dlist_push_tail(&rel->deps, &dep->node);
+		entry->ndeps++;
+	}
+	list_free(relids);
+	list_free(index_oids);
+}
+
+static void
+plan_cache_remove_deps(SrPlanCacheEntry *entry)
+{
+	int			i;
+
+	for (i = 0; i < entry->ndeps; i++)
+	{
+		SrPlanCacheDep *dep = &entry->deps[i];
+		SrPlanCacheRel *rel;
+
+		dlist_delete(&dep->node);
+		rel = (SrPlanCacheRel *) hash_search(plan_cache_rels, &dep->relid,
+											 HASH_FIND, NULL);
+		Assert(rel != NULL);
+		if (dlist_is_empty(&rel->deps))
+			hash_search(plan_cache_rels, &dep->relid, HASH_REMOVE, NULL);
+	}
+	if (entry->deps)
+		pfree(entry->deps);
+}
+
+static void
+plan_cache_remove(SrPlanCacheEntry *entry)
+{
+	plan_cache_remove_deps(entry);
+	dlist_delete(&entry->lru_node);
+	plan_cache_release(entry->tree);
+	hash_search(plan_cache, &entry->query_hash, HASH_REMOVE, NULL);
+}
+
+/*
+ * Return cached plan for 'query_hash' or NULL. The plan belongs to the cache,
+ * see sr_plan_cache_pin().
+ */
+SrPlanCacheEntry *
+sr_plan_cache_lookup(int32 query_hash)
+{
+	SrPlanCacheEntry   *entry;
+
+	if (plan_cache == NULL)
+		return NULL;
+
+	entry = (SrPlanCacheEntry *) hash_search(plan_cache, &query_hash,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	dlist_move_head(&plan_cache_lru, &entry->lru_node);
+	return entry;
+}
+
+/*
+ * Keep memory of the cached plan until the current memory context is reset,
+ * even if the plan is evicted from the cache meanwhile.
+ */
+void
+sr_plan_cache_pin(SrPlanCacheEntry *entry)
+{
+	MemoryContextCallback *cb;
+
+	cb = (MemoryContextCallback *) palloc(sizeof(MemoryContextCallback));
+	cb->func = plan_cache_unpin;
+	cb->arg = entry->tree;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, cb);
+	entry->tree->refcount++;
+}
+
+/*
+ * Put a copy of 'pl_stmt' to the cache, evicting least recently used
+ * plans if sr_plan.plan_cache_size is exceeded. Returns the new entry or
+ * NULL if the cache is disabled.
+ */
+SrPlanCacheEntry *
+sr_plan_cache_store(int32 query_hash, int32 plan_hash, PlannedStmt *pl_stmt,
+					Oid fake_func)
+{
+	SrPlanCacheEntry   *entry;
+	SrPlanCacheTree	   *tree;
+	MemoryContext		plan_context,
+						oldctx;
+	PlannedStmt		   *copy;
+	SrPlanParamSlot	   *slots;
+	int					nslots;
+	int					nsites = 0;
+	FuncExpr		  **site_array = NULL;
+	bool				found;
+
+	if (sr_plan_cache_size <= 0)
+		return NULL;
+
+	if (plan_cache == NULL)
+		plan_cache_init();
+
+	/*
+	 * Copy the plan into a context of its own first, so nothing is left
+	 * behind in the cache if copying fails.
+	 */
+	plan_context = AllocSetContextCreate(CurrentMemoryContext,
+										 "sr_plan cached plan",
+										 ALLOCSET_START_SMALL_SIZES);
+	oldctx = MemoryContextSwitchTo(plan_context);
+	copy = copyObject(pl_stmt);
+	if (!sr_plan_params_convert(copy, fake_func, &slots, &nslots))
+	{
+		List	   *sites = sr_plan_param_sites(copy);
+		ListCell   *lc;
+
+		site_array = palloc(sizeof(FuncExpr *) * (list_length(sites) + 1));
+		foreach(lc, sites)
+			site_array[nsites++] = (FuncExpr *) lfirst(lc);
+		list_free(sites);
+
+		slots = NULL;
+		nslots = -1;
+	}
+	tree = (SrPlanCacheTree *) palloc(sizeof(SrPlanCacheTree));
+	tree->context = plan_context;
+	tree->refcount = 0;
+	tree->evicted = false;
+	MemoryContextSwitchTo(oldctx);
+	MemoryContextSetParent(plan_context, plan_cache_context);
+
+	entry = (SrPlanCacheEntry *) hash_search(plan_cache, &query_hash,
+											 HASH_FIND, NULL);
+	if (entry != NULL)
+		plan_cache_remove(entry);
+
+	while (hash_get_num_entries(plan_cache) >= sr_plan_cache_size)
+	{
+		dlist_node *tail = dlist_tail_node(&plan_cache_lru);
+
+		plan_cache_remove(dlist_container(SrPlanCacheEntry, lru_node, tail));
+	}
+
+	entry = (SrPlanCacheEntry *) hash_search(plan_cache, &query_hash,
+											 HASH_ENTER, &found);
+	Assert(!found);
+	entry->plan_hash = plan_hash;
+	entry->pl_stmt = copy;
+	entry->nslots = nslots;
+	entry->slots = slots;
+	entry->nsites = nsites;
+	entry->sites = site_array;
+	entry->tree = tree;
+	entry->ndeps = 0;
+	entry->deps = NULL;
+	dlist_push_head(&plan_cache_lru, &entry->lru_node);
+	plan_cache_add_deps(entry);
+
+	return entry;
+}
+
+/*
+ * Return true if the plan is known to be saved in sr_plans.
+ */
+bool
+sr_plan_known_plan(int32 query_hash, int32 plan_hash)
+{
+	SrPlanKnownKey	key;
+
+	if (known_plans == NULL)
+		return false;
+
+	key.query_hash = query_hash;
+	key.plan_hash = plan_hash;
+
+	return hash_search(known_plans, &key, HASH_FIND, NULL) != NULL;
+}
+
+/*
+ * Remember that the plan is saved in sr_plans.
+ */
+void
+sr_plan_remember_plan(int32 query_hash, int32 plan_hash)
+{
+	SrPlanKnownKey	key;
+
+	if (known_plans == NULL)
+		plan_cache_init();
+
+	if (hash_get_num_entries(known_plans) >= SR_PLAN_KNOWN_PLANS_MAX)
+		return;
+
+	key.query_hash = query_hash;
+	key.plan_hash = plan_hash;
+
+	(void) hash_search(known_plans, &key, HASH_ENTER, NULL);
+}
+
+/*
+ * Forget all plans known to be saved, some of them could be deleted.
+ */
+void
+sr_plan_forget_plans(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	SrPlanKnownKey *key;
+
+	sr_plan_capture_forget();
+	if (known_plans == NULL)
+		return;
+
+	hash_seq_init(&hash_seq, known_plans);
+	while ((key = (SrPlanKnownKey *) hash_seq_search(&hash_seq)) != NULL)
+		(void) hash_search(known_plans, key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Forget all cached and known plans.
+ */
+void
+sr_plan_cache_reset(void)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	SrPlanCacheEntry   *entry;
+
+	sr_plan_capture_forget();
+	if (plan_cache_context == NULL)
+		return;
+
+	/* Plans still in use are moved out of plan_cache_context */
+	hash_seq_init(&hash_seq, plan_cache);
+	while ((entry = (SrPlanCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+		plan_cache_release(entry->tree);
+
+	MemoryContextDelete(plan_cache_context);
+	plan_cache_context = NULL;
+	plan_cache = NULL;
+	plan_cache_rels = NULL;
+	known_plans = NULL;
+	dlist_init(&plan_cache_lru);
+}
+
+/*
+ * Evict plans using relation or index 'relid'.
+ */
+void
+sr_plan_cache_relcache(Oid relid)
+{
+	SrPlanCacheRel *rel;
+	SrPlanCacheDep *dep;
+
+	if (plan_cache_rels == NULL)
+		return;
+
+	/* The last removed plan removes 'rel' as well */
+	while ((rel = (SrPlanCacheRel *) hash_search(plan_cache_rels, &relid,
+												 HASH_FIND, NULL)) != NULL)
+	{
+		dep = dlist_head_element(SrPlanCacheDep, node, &rel->deps);
+		plan_cache_remove(dep->entry);
+	}
+}
+
+/*
+ * Load enabled plans of sr_plans into the cache in one sequential scan, up to
+ * sr_plan.plan_cache_size of them. Plans already cached are kept. Returns
+ * false if 'nowait' is set and sr_plans is locked.
+ */
+bool
+sr_plan_cache_prewarm(Oid sr_plans_oid, Oid fake_func, bool nowait,
+					  SrPlanPrewarmStats *stats)
+{
+	Relation		sr_plans_heap;
+	TupleDesc		tupdesc;
+	Snapshot		snapshot;
+	HeapTuple		htup;
+	MemoryContext	tmpcontext;
+	MemoryContext	oldcontext;
+	instr_time		start,
+					duration;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc	scan;
+#else
+	HeapScanDesc	scan;
+#endif
+
+	MemSet(stats, 0, sizeof(SrPlanPrewarmStats));
+	if (sr_plan_cache_size <= 0)
+		return true;
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (nowait)
+	{
+		if (!ConditionalLockRelationOid(sr_plans_oid, AccessShareLock))
+			return false;
+	}
+	else
+		LockRelationOid(sr_plans_oid, AccessShareLock);
+
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(sr_plans_oid, NoLock);
+#else
+	sr_plans_heap = heap_open(sr_plans_oid, NoLock);
+#endif
+	tupdesc = RelationGetDescr(sr_plans_heap);
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "sr_plan prewarm",
+									   ALLOCSET_DEFAULT_SIZES);
+
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#else
+	scan = heap_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#endif
+	while ((htup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum		value;
+		bool		isnull;
+		int32		query_hash;
+		int32		plan_hash;
+		text	   *plan_data;
+		PlannedStmt *pl_stmt;
+
+		value = heap_getattr(htup, Anum_sr_enable, tupdesc, &isnull);
+		if (isnull || !DatumGetBool(value))
+			continue;
+
+		/* Don't evict plans already in use */
+		if (plan_cache != NULL &&
+			hash_get_num_entries(plan_cache) >= sr_plan_cache_size)
+			break;
+
+		value = heap_getattr(htup, Anum_sr_query_hash, tupdesc, &isnull);
+		query_hash = DatumGetInt32(value);
+		if (plan_cache != NULL &&
+			hash_search(plan_cache, &query_hash, HASH_FIND, NULL) != NULL)
+			continue;
+
+		value = heap_getattr(htup, Anum_sr_plan_hash, tupdesc, &isnull);
+		plan_hash = DatumGetInt32(value);
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+		value = heap_getattr(htup, Anum_sr_plan, tupdesc, &isnull);
+		plan_data = DatumGetTextP(value);
+		pl_stmt = sr_plan_partitions_refresh(stringToNode(text_to_cstring(plan_data)));
+
+		/* Count only plans which got into the cache */
+		if (pl_stmt != NULL &&
+			sr_plan_cache_store(query_hash, plan_hash, pl_stmt, fake_func) != NULL)
+		{
+			stats->plans++;
+			stats->bytes += VARSIZE(plan_data);
+		}
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(tmpcontext);
+	}
+#if PG_VERSION_NUM >= 120000
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+
+	MemoryContextDelete(tmpcontext);
+	UnregisterSnapshot(snapshot);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, AccessShareLock);
+#else
+	heap_close(sr_plans_heap, AccessShareLock);
+#endif
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	stats->time = INSTR_TIME_GET_MILLISEC(duration);
+
+	return true;
+}
+
+/*
+ * sr_plan_prewarm() RETURNS record
+ */
+Datum
+sr_plan_prewarm(PG_FUNCTION_ARGS)
+{
+	Oid					sr_plans_oid = sr_plan_plans_relid();
+	SrPlanPrewarmStats	stats;
+	TupleDesc			tupdesc;
+	Datum				values[SR_PLAN_PREWARM_COLS];
+	bool				nulls[SR_PLAN_PREWARM_COLS];
+
+	if (!OidIsValid(sr_plans_oid))
+		elog(ERROR, "sr_plan extension installed incorrectly");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	(void) sr_plan_cache_prewarm(sr_plans_oid, sr_plan_fake_func(), false,
+								 &stats);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(stats.plans);
+	values[1] = Int64GetDatum(stats.bytes);
+	values[2] = Float8GetDatum(stats.time);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
+}
@@ -0,0 +1,751 @@
+/*
+ * plan_export.c
+ *		Export and import of frozen plans between clusters.
+ *
+ * Plans refer to relations, types, functions, operators, operator families
+ * and collations by Oid, and Oids of objects created by users differ from
+ * one cluster to another. So each exported plan comes with a list of such objects it uses,
+ * as "<kind> <oid> <qualified name>" strings. Import resolves the names to
+ * local Oids, once per object for the whole statement, and replaces Oids in
+ * the text of the plan. Built-in objects have the same Oids everywhere and
+ * are not listed.
+ *
+ * Oids are found by names of fields of nodeToString() output known to hold
+ * them, which is much cheaper than reading the plan and walking it. Values
+ * of constants, like regclass ones, are not changed. query_hash depends on
+ * Oids too, so it's computed again from the text of the query.
+ */
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "access/transam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_opfamily.h"
+#include "commands/defrem.h"
+#include "utils/array.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
+
+PG_FUNCTION_INFO_V1(sr_plan_export_objects);
+PG_FUNCTION_INFO_V1(sr_plan_import_plan);
+
+#define SR_PLAN_IMPORT_COLS		6
+#define SR_OBJECT_NAME_LEN		1024
+
+typedef enum
+{
+	SR_OBJECT_RELATION = 'r',
+	SR_OBJECT_TYPE = 't',
+	SR_OBJECT_FUNCTION = 'f',
+	SR_OBJECT_OPERATOR = 'o',
+	SR_OBJECT_COLLATION = 'c',
+	SR_OBJECT_OPFAMILY = 'p'
+} SrObjectKind;
+
+typedef struct SrOidField
+{
+	const char	   *name;
+	SrObjectKind	kind;
+} SrOidField;
+
+/* Sorted by name for bsearch() */
+static const SrOidField oid_fields[] = {
+	{"aggargtypes", SR_OBJECT_TYPE},
+	{"aggcollid", SR_OBJECT_COLLATION},
+	{"aggfnoid", SR_OBJECT_FUNCTION},
+	{"aggtranstype", SR_OBJECT_TYPE},
+	{"aggtype", SR_OBJECT_TYPE},
+	{"array_collid", SR_OBJECT_COLLATION},
+	{"array_typeid", SR_OBJECT_TYPE},
+	{"casecollid", SR_OBJECT_COLLATION},
+	{"casetype", SR_OBJECT_TYPE},
+	{"coalescecollid", SR_OBJECT_COLLATION},
+	{"coalescetype", SR_OBJECT_TYPE},
+	{"colCollations", SR_OBJECT_COLLATION},
+	{"colTypes", SR_OBJECT_TYPE},
+	{"collOid", SR_OBJECT_COLLATION},
+	{"collation", SR_OBJECT_COLLATION},
+	{"collations", SR_OBJECT_COLLATION},
+	{"constcollid", SR_OBJECT_COLLATION},
+	{"consttype", SR_OBJECT_TYPE},
+	{"dupCollations", SR_OBJECT_COLLATION},
+	{"dupOperators", SR_OBJECT_OPERATOR},
+	{"element_typeid", SR_OBJECT_TYPE},
+	{"elemfuncid", SR_OBJECT_FUNCTION},
+	{"endInRangeFunc", SR_OBJECT_FUNCTION},
+	{"eqop", SR_OBJECT_OPERATOR},
+	{"firstColCollation", SR_OBJECT_COLLATION},
+	{"firstColType", SR_OBJECT_TYPE},
+	{"funccolcollations", SR_OBJECT_COLLATION},
+	{"funccollid", SR_OBJECT_COLLATION},
+	{"funccoltypes", SR_OBJECT_TYPE},
+	{"funcid", SR_OBJECT_FUNCTION},
+	{"funcresulttype", SR_OBJECT_TYPE},
+	{"grpCollations", SR_OBJECT_COLLATION},
+	{"grpOperators", SR_OBJECT_OPERATOR},
+	{"hashOperators", SR_OBJECT_OPERATOR},
+	{"hashcollations", SR_OBJECT_COLLATION},
+	{"hashfuncid", SR_OBJECT_FUNCTION},
+	{"hashoperators", SR_OBJECT_OPERATOR},
+	{"inRangeColl", SR_OBJECT_COLLATION},
+	{"indexid", SR_OBJECT_RELATION},
+	{"inputcollid", SR_OBJECT_COLLATION},
+	{"inputcollids", SR_OBJECT_COLLATION},
+	{"mergeCollations", SR_OBJECT_COLLATION},
+	{"mergeFamilies", SR_OBJECT_OPFAMILY},
+	{"minmaxcollid", SR_OBJECT_COLLATION},
+	{"minmaxtype", SR_OBJECT_TYPE},
+	{"negfuncid", SR_OBJECT_FUNCTION},
+	{"opcollid", SR_OBJECT_COLLATION},
+	{"opfamilies", SR_OBJECT_OPFAMILY},
+	{"opfuncid", SR_OBJECT_FUNCTION},
+	{"opno", SR_OBJECT_OPERATOR},
+	{"opnos", SR_OBJECT_OPERATOR},
+	{"opresulttype", SR_OBJECT_TYPE},
+	{"ordCollations", SR_OBJECT_COLLATION},
+	{"ordOperators", SR_OBJECT_OPERATOR},
+	{"paramExecTypes", SR_OBJECT_TYPE},
+	{"paramcollid", SR_OBJECT_COLLATION},
+	{"paramtype", SR_OBJECT_TYPE},
+	{"partCollations", SR_OBJECT_COLLATION},
+	{"partOperators", SR_OBJECT_OPERATOR},
+	{"refarraytype", SR_OBJECT_TYPE},
+	{"refcollid", SR_OBJECT_COLLATION},
+	{"refcontainertype", SR_OBJECT_TYPE},
+	{"refelemtype", SR_OBJECT_TYPE},
+	{"refrestype", SR_OBJECT_TYPE},
+	{"relationOids", SR_OBJECT_RELATION},
+	{"relid", SR_OBJECT_RELATION},
+	{"relid_map", SR_OBJECT_RELATION},
+	{"resorigtbl", SR_OBJECT_RELATION},
+	{"resultcollid", SR_OBJECT_COLLATION},
+	{"resulttype", SR_OBJECT_TYPE},
+	{"row_typeid", SR_OBJECT_TYPE},
+	{"seqid", SR_OBJECT_RELATION},
+	{"sortOperators", SR_OBJECT_OPERATOR},
+	{"sortop", SR_OBJECT_OPERATOR},
+	{"startInRangeFunc", SR_OBJECT_FUNCTION},
+	{"typeId", SR_OBJECT_TYPE},
+	{"uniqCollations", SR_OBJECT_COLLATION},
+	{"uniqOperators", SR_OBJECT_OPERATOR},
+	{"varcollid", SR_OBJECT_COLLATION},
+	{"vartype", SR_OBJECT_TYPE},
+	{"wincollid", SR_OBJECT_COLLATION},
+	{"winfnoid", SR_OBJECT_FUNCTION},
+	{"wintype", SR_OBJECT_TYPE},
+};
+
+/* Oid of the plan and the local one */
+typedef struct SrObjectMapping
+{
+	SrObjectKind	kind;
+	Oid				oid;
+	Oid				local_oid;
+} SrObjectMapping;
+
+typedef struct SrObjectMap
+{
+	SrObjectMapping *mappings;
+	int			nmappings;
+	List	   *names;			/* of exported objects */
+} SrObjectMap;
+
+/* Local Oids of objects by kind and name, for the whole import */
+typedef struct SrObjectCacheEntry
+{
+	char		key[SR_OBJECT_NAME_LEN];	/* "<kind> <name>" */
+	Oid			local_oid;
+} SrObjectCacheEntry;
+
+typedef struct SrImportState
+{
+	HTAB	   *objects;		/* SrObjectCacheEntry */
+	TupleDesc	tupdesc;
+} SrImportState;
+
+/* Reports Oids of the plan text by kind, returns true to replace them */
+typedef bool (*oid_callback) (SrObjectKind kind, Oid *oid, void *context);
+
+#if PG_VERSION_NUM >= 160000
+#define stringToQualifiedNameListCompat(str) \
+	stringToQualifiedNameList(str, NULL)
+#else
+#define stringToQualifiedNameListCompat(str) \
+	stringToQualifiedNameList(str)
+#endif
+
+#if PG_VERSION_NUM >= 140000
+#define HASH_STRINGS_COMPAT		HASH_STRINGS
+#else
+#define HASH_STRINGS_COMPAT		0
+#endif
+
+/*
+ * Same as pg_strtok(), which works only inside stringToNode().
+ */
+static const char *
+next_token(const char **str, int *length)
+{
+	const char *s = *str;
+	const char *token;
+
+	while (*s == ' ' || *s == '\n' || *s == '\t')
+		s++;
+
+	if (*s == '\0')
+	{
+		*length = 0;
+		*str = s;
+		return NULL;
+	}
+
+	token = s;
+	if (*s == '(' || *s == ')' || *s == '{' || *s == '}')
+		s++;
+	else
+	{
+		while (*s != '\0' && *s != ' ' && *s != '\n' && *s != '\t' &&
+			   *s != '(' && *s != ')' && *s != '{' && *s != '}')
+		{
+			if (*s == '\\' && s[1] != '\0')
+				s += 2;
+			else
+				s++;
+		}
+	}
+
+	*length = s - token;
+	*str = s;
+	return token;
+}
+
+static bool
+token_is_oid(const char *token, int length)
+{
+	int			i;
+
+	for (i = 0; i < length; i++)
+		if (token[i] < '0' || token[i] > '9')
+			return false;
+
+	return length > 0;
+}
+
+static int
+oid_field_cmp(const void *a, const void *b)
+{
+	return strcmp(((const SrOidField *) a)->name,
+				  ((const SrOidField *) b)->name);
+}
+
+static const SrOidField *
+find_oid_field(const char *token, int length)
+{
+	SrOidField	key;
+	char		name[NAMEDATALEN];
+
+	/* field names are ":name" */
+	if (length < 2 || length > NAMEDATALEN || token[0] != ':')
+		return NULL;
+
+	memcpy(name, token + 1, length - 1);
+	name[length - 1] = '\0';
+	key.name = name;
+
+	return bsearch(&key, oid_fields, lengthof(oid_fields), sizeof(SrOidField),
+				   oid_field_cmp);
+}
+
+/*
+ * Call 'callback' for Oids of user objects in 'plan_text'. If 'result' is
+ * given, it gets the text with Oids replaced by the callback. 'fake_func' is
+ * Oid of _p() in the plan, its funccollid is a location of the call.
+ */
+static void
+process_plan_oids(const char *plan_text, Oid fake_func, oid_callback callback,
+				  void *context, StringInfo result)
+{
+	const char *s = plan_text;
+	const char *copied = plan_text;
+	const char *token;
+	int			length;
+	Oid			funcid = InvalidOid;
+
+	while ((token = next_token(&s, &length)) != NULL)
+	{
+		const SrOidField *field = find_oid_field(token, length);
+		bool		in_list = false;
+
+		if (field == NULL)
+			continue;
+
+		/* FuncExpr has funcid before funccollid */
+		if (strcmp(field->name, "funcid") == 0)
+		{
+			const char *next = s;
+
+			token = next_token(&next, &length);
+			funcid = (token && token_is_oid(token, length)) ?
+				(Oid) strtoul(token, NULL, 10) : InvalidOid;
+		}
+		else if (strcmp(field->name, "funccollid") == 0 &&
+				 OidIsValid(fake_func) && funcid == fake_func)
+			continue;
+
+		/* Either a single Oid, an array of them or an OidList */
+		for (;;)
+		{
+			const char *next = s;
+			Oid			oid;
+
+			token = next_token(&next, &length);
+			if (token == NULL)
+				break;
+
+			if (!in_list && length == 1 && *token == '(')
+			{
+				token = next_token(&next, &length);
+				if (token == NULL || length != 1 || *token != 'o')
+					break;
+				in_list = true;
+				s = next;
+				continue;
+			}
+
+			if (in_list && length == 1 && *token == ')')
+			{
+				s = next;
+				break;
+			}
+
+			if (!token_is_oid(token, length))
+				break;
+			s = next;
+
+			oid = (Oid) strtoul(token, NULL, 10);
+			if (oid < FirstNormalObjectId || !callback(field->kind, &oid, context))
+				continue;
+
+			if (result)
+			{
+				appendBinaryStringInfo(result, copied, token - copied);
+				appendStringInfo(result, "%u", oid);
+				copied = token + length;
+			}
+		}
+	}
+
+	if (result)
+		appendStringInfoString(result, copied);
+}
+
+static char *
+object_name(SrObjectKind kind, Oid oid)
+{
+	HeapTuple	tuple;
+	char	   *result;
+
+	switch (kind)
+	{
+		case SR_OBJECT_RELATION:
+			if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(oid)))
+				return NULL;
+			return quote_qualified_identifier(get_namespace_name(get_rel_namespace(oid)),
+											  get_rel_name(oid));
+
+		case SR_OBJECT_TYPE:
+			if (!SearchSysCacheExists1(TYPEOID, ObjectIdGetDatum(oid)))
+				return NULL;
+			return format_type_be_qualified(oid);
+
+		case SR_OBJECT_FUNCTION:
+			if (!SearchSysCacheExists1(PROCOID, ObjectIdGetDatum(oid)))
+				return NULL;
+			return format_procedure_qualified(oid);
+
+		case SR_OBJECT_OPERATOR:
+			if (!SearchSysCacheExists1(OPEROID, ObjectIdGetDatum(oid)))
+				return NULL;
+			return format_operator_qualified(oid);
+
+		case SR_OBJECT_COLLATION:
+			tuple = SearchSysCache1(COLLOID, ObjectIdGetDatum(oid));
+			if (!HeapTupleIsValid(tuple))
+				return NULL;
+			result = quote_qualified_identifier(
+				get_namespace_name(((Form_pg_collation) GETSTRUCT(tuple))->collnamespace),
+				NameStr(((Form_pg_collation) GETSTRUCT(tuple))->collname));
+			ReleaseSysCache(tuple);
+			return result;
+
+		case SR_OBJECT_OPFAMILY:
+			/* "<access method> <qualified name>", see lookup_opfamily() */
+			tuple = SearchSysCache1(OPFAMILYOID, ObjectIdGetDatum(oid));
+			if (!HeapTupleIsValid(tuple))
+				return NULL;
+			result = psprintf("%s %s",
+				get_am_name(((Form_pg_opfamily) GETSTRUCT(tuple))->opfmethod),
+				quote_qualified_identifier(
+					get_namespace_name(((Form_pg_opfamily) GETSTRUCT(tuple))->opfnamespace),
+					NameStr(((Form_pg_opfamily) GETSTRUCT(tuple))->opfname)));
+			ReleaseSysCache(tuple);
+			return result;
+	}
+
+	return NULL;
+}
+
+static bool
+export_object(SrObjectKind kind, Oid *oid, void *context)
+{
+	SrObjectMap *map = context;
+	char	   *name;
+	int			i;
+
+	for (i = 0; i < map->nmappings; i++)
+		if (map->mappings[i].kind == kind && map->mappings[i].oid == *oid)
+			return false;
+
+	map->mappings = repalloc(map->mappings,
+							 sizeof(SrObjectMapping) * (map->nmappings + 1));
+	map->mappings[map->nmappings].kind = kind;
+	map->mappings[map->nmappings].oid = *oid;
+	map->nmappings++;
+
+	/* Missing objects are exported without name, so they block import */
+	name = object_name(kind, *oid);
+	map->names = lappend(map->names,
+						 psprintf("%c %u %s", kind, *oid, name ? name : ""));
+
+	return false;
+}
+
+/*
+ * Names of user objects 'plan_text' refers to, as "<kind> <oid> <name>".
+ */
+List *
+sr_plan_export_names(const char *plan_text)
+{
+	SrObjectMap map;
+
+	map.mappings = palloc(sizeof(SrObjectMapping));
+	map.nmappings = 0;
+	map.names = NIL;
+	process_plan_oids(plan_text, sr_plan_fake_func(), export_object, &map,
+					  NULL);
+	pfree(map.mappings);
+
+	return map.names;
+}
+
+/*
+ * sr_plan_export_objects(plan text) RETURNS text[]
+ *
+ * User objects the plan refers to, see sr_plan_export().
+ */
+Datum
+sr_plan_export_objects(PG_FUNCTION_ARGS)
+{
+	char	   *plan_text = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	List	   *names = sr_plan_export_names(plan_text);
+	Datum	   *values;
+	ListCell   *lc;
+	int			i;
+
+	values = palloc(sizeof(Datum) * (list_length(names) + 1));
+	i = 0;
+	foreach(lc, names)
+		values[i++] = CStringGetTextDatum((char *) lfirst(lc));
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, i, TEXTOID, -1, false, 'i'));
+}
+
+/*
+ * Call to_regclass() and friends, which return NULL for missing objects.
+ */
+static Oid
+call_to_reg(PGFunction func, const char *name)
+{
+#if PG_VERSION_NUM >= 120000
+	LOCAL_FCINFO(fcinfo, 1);
+#else
+	FunctionCallInfoData fcinfo_data;
+	FunctionCallInfo fcinfo = &fcinfo_data;
+#endif
+	Datum		result;
+
+	InitFunctionCallInfoData(*fcinfo, NULL, 1, InvalidOid, NULL, NULL);
+#if PG_VERSION_NUM >= 120000
+	fcinfo->args[0].value = CStringGetTextDatum(name);
+	fcinfo->args[0].isnull = false;
+#else
+	fcinfo->arg[0] = CStringGetTextDatum(name);
+	fcinfo->argnull[0] = false;
+#endif
+
+	result = (*func) (fcinfo);
+	if (fcinfo->isnull)
+		return InvalidOid;
+
+	return DatumGetObjectId(result);
+}
+
+static Oid
+lookup_opfamily(const char *name)
+{
+	const char *space = strchr(name, ' ');
+	Oid			amoid;
+
+	if (space == NULL)
+		return InvalidOid;
+
+	amoid = get_am_oid(pnstrdup(name, space - name), true);
+	if (!OidIsValid(amoid))
+		return InvalidOid;
+
+	return get_opfamily_oid(amoid, stringToQualifiedNameListCompat(space + 1),
+							true);
+}
+
+static Oid
+lookup_object(SrObjectKind kind, const char *name)
+{
+	switch (kind)
+	{
+		case SR_OBJECT_RELATION:
+			return call_to_reg(to_regclass, name);
+		case SR_OBJECT_TYPE:
+			return call_to_reg(to_regtype, name);
+		case SR_OBJECT_FUNCTION:
+			return call_to_reg(to_regprocedure, name);
+		case SR_OBJECT_OPERATOR:
+			return call_to_reg(to_regoperator, name);
+		case SR_OBJECT_COLLATION:
+			return get_collation_oid(stringToQualifiedNameListCompat(name), true);
+		case SR_OBJECT_OPFAMILY:
+			return lookup_opfamily(name);
+	}
+
+	return InvalidOid;
+}
+
+static Oid
+resolve_object(HTAB *cache, SrObjectKind kind, const char *name)
+{
+	SrObjectCacheEntry *entry;
+	char		key[SR_OBJECT_NAME_LEN];
+	bool		found;
+
+	if (*name == '\0')
+		return InvalidOid;
+
+	/* Really long names are just not cached */
+	if (cache == NULL || strlen(name) + 2 >= SR_OBJECT_NAME_LEN)
+		return lookup_object(kind, name);
+
+	MemSet(key, 0, sizeof(key));
+	snprintf(key, sizeof(key), "%c %s", kind, name);
+	entry = (SrObjectCacheEntry *) hash_search(cache, key, HASH_ENTER, &found);
+	if (!found)
+		entry->local_oid = lookup_object(kind, name);
+
+	return entry->local_oid;
+}
+
+static bool
+import_object(SrObjectKind kind, Oid *oid, void *context)
+{
+	SrObjectMap *map = context;
+	int			i;
+
+	for (i = 0; i < map->nmappings; i++)
+	{
+		if (map->mappings[i].kind == kind && map->mappings[i].oid == *oid)
+		{
+			*oid = map->mappings[i].local_oid;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Make a cache of local Oids of objects by name for sr_plan_remap_plan().
+ */
+HTAB *
+sr_plan_object_cache_create(const char *name, MemoryContext mcxt)
+{
+	HASHCTL		info;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = SR_OBJECT_NAME_LEN;
+	info.entrysize = sizeof(SrObjectCacheEntry);
+	info.hcxt = mcxt;
+
+	return hash_create(name, 256, &info,
+					   HASH_ELEM | HASH_CONTEXT | HASH_STRINGS_COMPAT);
+}
+
+/*
+ * Replace Oids of 'objects' (made by sr_plan_export_names() elsewhere) in
+ * 'plan_text' with Oids of the same objects here. Returns NULL and sets
+ * 'missing' if some object doesn't exist. Local Oids of relations are added
+ * to 'relations' if it's given.
+ */
+char *
+sr_plan_remap_plan(const char *plan_text, char **objects, int nobjects,
+				   HTAB *cache, const char **missing, List **relations)
+{
+	SrObjectMap		map;
+	StringInfoData	buf;
+	Oid				local_fake_func = sr_plan_fake_func();
+	Oid				fake_func = InvalidOid;
+	int				i;
+
+	map.mappings = palloc(sizeof(SrObjectMapping) * (nobjects + 1));
+	map.nmappings = 0;
+	map.names = NIL;
+	for (i = 0; i < nobjects; i++)
+	{
+		char	   *name;
+		SrObjectMapping *mapping = &map.mappings[map.nmappings++];
+
+		mapping->kind = (SrObjectKind) objects[i][0];
+		mapping->oid = (Oid) strtoul(objects[i] + 1, &name, 10);
+		if (*name == ' ')
+			name++;
+
+		mapping->local_oid = resolve_object(cache, mapping->kind, name);
+		if (!OidIsValid(mapping->local_oid))
+		{
+			*missing = objects[i];
+			pfree(map.mappings);
+			return NULL;
+		}
+
+		if (relations && mapping->kind == SR_OBJECT_RELATION)
+			*relations = lappend_oid(*relations, mapping->local_oid);
+
+		/* Oid of _p() in the plan is the one mapped to the local _p() */
+		if (mapping->kind == SR_OBJECT_FUNCTION &&
+			mapping->local_oid == local_fake_func)
+			fake_func = mapping->oid;
+	}
+
+	initStringInfo(&buf);
+	process_plan_oids(plan_text, fake_func, import_object, &map, &buf);
+	pfree(map.mappings);
+
+	return buf.data;
+}
+
+static SrImportState *
+import_state(FunctionCallInfo fcinfo)
+{
+	SrImportState *state = fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+
+	if (state != NULL)
+		return state;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	state = palloc(sizeof(SrImportState));
+	state->tupdesc = BlessTupleDesc(CreateTupleDescCopy(tupdesc));
+	state->objects = sr_plan_object_cache_create("sr_plan imported objects",
+												 fcinfo->flinfo->fn_mcxt);
+	MemoryContextSwitchTo(oldcontext);
+
+	fcinfo->flinfo->fn_extra = state;
+	return state;
+}
+
+/*
+ * sr_plan_import_plan(query text, plan text, objects text[]) RETURNS record
+ *
+ * Make a row of sr_plans from a plan exported by sr_plan_export(). Returns
+ * NULL with a warning if it can't be used here.
+ */
+Datum
+sr_plan_import_plan(PG_FUNCTION_ARGS)
+{
+	char		   *query_text = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char		   *plan_text = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	ArrayType	   *objects = PG_GETARG_ARRAYTYPE_P(2);
+	SrImportState  *state = import_state(fcinfo);
+	Datum		   *elems;
+	char		  **names;
+	int				nelems;
+	const char	   *missing;
+	Query		   *query;
+	int32			query_hash;
+	int32			plan_hash;
+	PlannedStmt	   *pl_stmt;
+	SrPlanCapture	capture;
+	Datum			values[SR_PLAN_IMPORT_COLS];
+	bool			nulls[SR_PLAN_IMPORT_COLS];
+	int				i;
+
+	deconstruct_array(objects, TEXTOID, -1, false, 'i', &elems, NULL, &nelems);
+	names = palloc(sizeof(char *) * (nelems + 1));
+	for (i = 0; i < nelems; i++)
+		names[i] = TextDatumGetCString(elems[i]);
+
+	plan_text = sr_plan_remap_plan(plan_text, names, nelems, state->objects,
+								   &missing, NULL);
+	if (plan_text == NULL)
+	{
+		ereport(WARNING,
+				(errmsg("sr_plan: plan of query \"%s\" is not imported",
+						query_text),
+				 errdetail("Object \"%s\" does not exist.", missing)));
+		PG_RETURN_NULL();
+	}
+
+	if (!sr_plan_hash_query_text(query_text, &query, &query_hash))
+	{
+		ereport(WARNING,
+				(errmsg("sr_plan: plan of query \"%s\" is not imported",
+						query_text),
+				 errdetail("Query must have exactly one statement with a plan.")));
+		PG_RETURN_NULL();
+	}
+
+	plan_hash = DatumGetInt32(hash_any((unsigned char *) plan_text,
+									   strlen(plan_text)));
+	pl_stmt = (PlannedStmt *) stringToNode(plan_text);
+	if (!IsA(pl_stmt, PlannedStmt))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sr_plan: invalid plan of query \"%s\"", query_text)));
+
+	sr_plan_make_capture(&capture, query, query_text, query_hash, plan_hash,
+						 plan_text, pl_stmt);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(capture.query_hash);
+	values[1] = Int64GetDatum(capture.query_id);
+	values[2] = Int32GetDatum(capture.plan_hash);
+	values[3] = PointerGetDatum(capture.plan);
+	if (capture.nreloids > 0)
+		values[4] = PointerGetDatum(sr_plan_oid_array(capture.reloids,
+													  capture.nreloids));
+	else
+		nulls[4] = true;
+	if (capture.nindex_reloids > 0)
+		values[5] = PointerGetDatum(sr_plan_oid_array(capture.index_reloids,
+													  capture.nindex_reloids));
+	else
+		nulls[5] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(state->tupdesc,
+													  values, nulls)));
+}
@@ -0,0 +1,462 @@
+/*
+ * plan_params.c
+ *		Executor parameters in place of _p() calls of cached plans.
+ *
+ * When a frozen plan is put into the backend cache, every _p() call in it is
+ * replaced by a PARAM_EXEC Param, so that the cached tree is never modified
+ * afterwards and is shared by all executions of the query. Arguments of _p()
+ * of the planned query are passed by a CustomScan node appended to subplans
+ * of the statement. Nothing refers to it, it's just initialized along with
+ * other subplans before any node is executed, and stores the arguments into
+ * the parameters.
+ *
+ * Parallel workers get the values as Gather's initplan parameters, which
+ * don't exist before 11, so plans with Gather are not converted there.
+ *
+ * Literals of queries in sr_plan.auto_parameterize mode are $n parameters of
+ * a generic plan instead, they could be anywhere in the plan. Their values
+ * are kept by another CustomScan, which does nothing in the executor, and
+ * are passed to it as parameters of the query.
+ */
+#include "sr_plan.h"
+#include "executor/executor.h"
+#include "nodes/extensible.h"
+#include "utils/lsyscache.h"
+
+typedef struct ParamsConvertContext
+{
+	Oid			fake_func;
+	int			next_paramid;
+	List	   *slots;			/* SrPlanParamSlot */
+	bool		has_gather;
+} ParamsConvertContext;
+
+static CustomScanMethods params_scan_methods;
+static CustomExecMethods params_exec_methods;
+static CustomScanMethods literals_scan_methods;
+static CustomExecMethods literals_exec_methods;
+
+static ExecutorStart_hook_type srplan_executor_start_hook_next = NULL;
+
+static void sr_plan_executor_start(QueryDesc *queryDesc, int eflags);
+
+#if PG_VERSION_NUM >= 100000
+#define ExecEvalExprSwitchContextCompat(state, econtext, isnull) \
+	ExecEvalExprSwitchContext(state, econtext, isnull)
+#else
+#define ExecEvalExprSwitchContextCompat(state, econtext, isnull) \
+	ExecEvalExprSwitchContext(state, econtext, isnull, NULL)
+#endif
+
+static Node *
+params_create_state(CustomScan *cscan)
+{
+	CustomScanState *css;
+
+	css = (CustomScanState *) newNode(sizeof(CustomScanState),
+									  T_CustomScanState);
+	css->methods = (cscan->methods == &literals_scan_methods) ?
+		&literals_exec_methods : &params_exec_methods;
+
+	return (Node *) css;
+}
+
+/*
+ * Evaluate arguments of _p() and store them into parameters of the plan.
+ */
+static void
+params_begin(CustomScanState *node, EState *estate, int eflags)
+{
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+	ListCell   *lc_id,
+			   *lc_arg;
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	forboth(lc_id, cscan->custom_private, lc_arg, cscan->custom_exprs)
+	{
+		ParamExecData  *prm = &estate->es_param_exec_vals[lfirst_int(lc_id)];
+		Expr		   *arg = (Expr *) lfirst(lc_arg);
+		ExprState	   *state;
+		Datum			value;
+		bool			isnull;
+		int16			typlen;
+		bool			typbyval;
+
+		state = ExecInitExpr(arg, &node->ss.ps);
+		value = ExecEvalExprSwitchContextCompat(state,
+												node->ss.ps.ps_ExprContext,
+												&isnull);
+
+		/* Parameters live as long as the query */
+		get_typlenbyval(exprType((Node *) arg), &typlen, &typbyval);
+		prm->value = isnull ? (Datum) 0 : datumCopy(value, typbyval, typlen);
+		prm->isnull = isnull;
+		prm->execPlan = NULL;
+	}
+}
+
+static TupleTableSlot *
+params_exec(CustomScanState *node)
+{
+	/* never referenced by the plan */
+	elog(ERROR, "sr_plan: parameters node must not be executed");
+	return NULL;
+}
+
+static void
+params_end(CustomScanState *node)
+{
+	/* nothing to do */
+}
+
+static void
+literals_begin(CustomScanState *node, EState *estate, int eflags)
+{
+	/* values are passed by sr_plan_executor_start() */
+}
+
+static void
+params_rescan(CustomScanState *node)
+{
+	/* nothing to do */
+}
+
+void
+sr_plan_params_init(void)
+{
+	params_scan_methods.CustomName = "sr_plan parameters";
+	params_scan_methods.CreateCustomScanState = params_create_state;
+
+	params_exec_methods.CustomName = "sr_plan parameters";
+	params_exec_methods.BeginCustomScan = params_begin;
+	params_exec_methods.ExecCustomScan = params_exec;
+	params_exec_methods.EndCustomScan = params_end;
+	params_exec_methods.ReScanCustomScan = params_rescan;
+
+	literals_scan_methods.CustomName = "sr_plan literals";
+	literals_scan_methods.CreateCustomScanState = params_create_state;
+
+	literals_exec_methods = params_exec_methods;
+	literals_exec_methods.CustomName = "sr_plan literals";
+	literals_exec_methods.BeginCustomScan = literals_begin;
+
+	/* Copies of plans could be serialized */
+	RegisterCustomScanMethods(&params_scan_methods);
+	RegisterCustomScanMethods(&literals_scan_methods);
+
+	srplan_executor_start_hook_next = ExecutorStart_hook;
+	ExecutorStart_hook = sr_plan_executor_start;
+}
+
+/*
+ * Make parameters of the query from literals kept by sr_plan_literals_bind().
+ * Such queries have no parameters of their own.
+ */
+static void
+sr_plan_executor_start(QueryDesc *queryDesc, int eflags)
+{
+	ListCell   *lc;
+
+	foreach(lc, queryDesc->plannedstmt->subplans)
+	{
+		CustomScan	   *cscan = (CustomScan *) lfirst(lc);
+		ParamListInfo	params;
+		ListCell	   *lc_value;
+		int				nvalues;
+		int				i;
+
+		if (cscan == NULL || !IsA(cscan, CustomScan) ||
+			cscan->methods != &literals_scan_methods)
+			continue;
+
+		nvalues = list_length(cscan->custom_exprs);
+#if PG_VERSION_NUM >= 110000
+		params = makeParamList(nvalues);
+#else
+		params = (ParamListInfo) palloc0(offsetof(ParamListInfoData, params) +
+										 nvalues * sizeof(ParamExternData));
+		params->numParams = nvalues;
+#endif
+
+		i = 0;
+		foreach(lc_value, cscan->custom_exprs)
+		{
+			Const		   *value = (Const *) lfirst(lc_value);
+			ParamExternData *prm = &params->params[i++];
+
+			prm->value = value->constvalue;
+			prm->isnull = value->constisnull;
+			prm->pflags = PARAM_FLAG_CONST;
+			prm->ptype = value->consttype;
+		}
+
+		queryDesc->params = params;
+		break;
+	}
+
+	if (srplan_executor_start_hook_next)
+		srplan_executor_start_hook_next(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+}
+
+static Node *
+params_convert_mutator(Node *node, void *context)
+{
+	ParamsConvertContext *ctx = context;
+
+	if (node == NULL)
+		return NULL;
+
+	if (IsA(node, FuncExpr) && ((FuncExpr *) node)->funcid == ctx->fake_func)
+	{
+		FuncExpr		*fexpr = (FuncExpr *) node;
+		Node			*arg = (Node *) linitial(fexpr->args);
+		SrPlanParamSlot	*slot = NULL;
+		Param			*param;
+		ListCell		*lc;
+
+		/*
+		 * HACK: location of _p() is kept in funccollid, see
+		 * sr_query_expr_walker. _p() calls which were not collected have
+		 * their real collation there, so the argument must match too.
+		 */
+		foreach(lc, ctx->slots)
+		{
+			SrPlanParamSlot *other = (SrPlanParamSlot *) lfirst(lc);
+
+			if (other->location == fexpr->funccollid && equal(other->arg, arg))
+			{
+				slot = other;
+				break;
+			}
+		}
+
+		if (slot == NULL)
+		{
+			slot = (SrPlanParamSlot *) palloc(sizeof(SrPlanParamSlot));
+			slot->location = fexpr->funccollid;
+			slot->paramid = ctx->next_paramid++;
+			slot->paramtype = fexpr->funcresulttype;
+			slot->arg = arg;
+			ctx->slots = lappend(ctx->slots, slot);
+		}
+
+		param = makeNode(Param);
+		param->paramkind = PARAM_EXEC;
+		param->paramid = slot->paramid;
+		param->paramtype = slot->paramtype;
+		param->paramtypmod = exprTypmod(arg);
+		param->paramcollid = exprCollation(arg);
+		param->location = -1;
+
+		return (Node *) param;
+	}
+
+	return expression_tree_mutator(node, params_convert_mutator, context);
+}
+
+/* Same expressions as restore_params() visits */
+static void
+params_convert_visitor(Plan *plan, void *context)
+{
+	plan->qual = (List *) params_convert_mutator((Node *) plan->qual, context);
+	plan->targetlist = (List *) params_convert_mutator((Node *) plan->targetlist,
+													   context);
+
+	if (IsA(plan, ModifyTable))
+	{
+		ModifyTable *mt = (ModifyTable *) plan;
+
+		mt->returningLists = (List *)
+			params_convert_mutator((Node *) mt->returningLists, context);
+		mt->onConflictSet = (List *)
+			params_convert_mutator((Node *) mt->onConflictSet, context);
+		mt->onConflictWhere =
+			params_convert_mutator(mt->onConflictWhere, context);
+	}
+}
+
+static void
+params_convert(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, params_convert_visitor, context);
+}
+
+#if PG_VERSION_NUM < 110000
+static void
+find_gather_visitor(Plan *plan, void *context)
+{
+	ParamsConvertContext *ctx = context;
+
+	if (IsA(plan, Gather))
+		ctx->has_gather = true;
+#if PG_VERSION_NUM >= 100000
+	if (IsA(plan, GatherMerge))
+		ctx->has_gather = true;
+#endif
+}
+
+static void
+find_gather(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, find_gather_visitor, context);
+}
+#else
+static void
+gather_params_visitor(Plan *plan, void *context)
+{
+	Bitmapset  *params = context;
+
+	if (IsA(plan, Gather))
+		((Gather *) plan)->initParam =
+			bms_add_members(((Gather *) plan)->initParam, params);
+	else if (IsA(plan, GatherMerge))
+		((GatherMerge *) plan)->initParam =
+			bms_add_members(((GatherMerge *) plan)->initParam, params);
+}
+
+static void
+gather_params(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, gather_params_visitor, context);
+}
+#endif
+
+static int
+param_slot_cmp(const void *a, const void *b)
+{
+	const SrPlanParamSlot *sa = (const SrPlanParamSlot *) a;
+	const SrPlanParamSlot *sb = (const SrPlanParamSlot *) b;
+
+	if (sa->location != sb->location)
+		return (sa->location < sb->location) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Replace _p() calls of 'pl_stmt' by PARAM_EXEC parameters in place.
+ * Parameters are returned in 'slots' sorted by location of _p() in the
+ * query. Returns false if the plan can't be converted, it's not changed
+ * then.
+ */
+bool
+sr_plan_params_convert(PlannedStmt *pl_stmt, Oid fake_func,
+					   SrPlanParamSlot **slots, int *nslots)
+{
+	ParamsConvertContext context;
+#if PG_VERSION_NUM >= 110000
+	Bitmapset  *params = NULL;
+#endif
+	ListCell   *lc;
+	int			i;
+
+	context.fake_func = fake_func;
+	context.slots = NIL;
+	context.has_gather = false;
+#if PG_VERSION_NUM >= 110000
+	context.next_paramid = list_length(pl_stmt->paramExecTypes);
+#else
+	execute_for_plantree(pl_stmt, find_gather, &context);
+	if (context.has_gather)
+		return false;
+
+	context.next_paramid = pl_stmt->nParamExec;
+#endif
+
+	execute_for_plantree(pl_stmt, params_convert, &context);
+
+	*nslots = list_length(context.slots);
+	*slots = (SrPlanParamSlot *) palloc(sizeof(SrPlanParamSlot) * (*nslots + 1));
+	i = 0;
+	foreach(lc, context.slots)
+	{
+		SrPlanParamSlot *slot = (SrPlanParamSlot *) lfirst(lc);
+
+		(*slots)[i++] = *slot;
+#if PG_VERSION_NUM >= 110000
+		params = bms_add_member(params, slot->paramid);
+		/* slots were appended in order of paramid */
+		pl_stmt->paramExecTypes = lappend_oid(pl_stmt->paramExecTypes,
+											  slot->paramtype);
+#endif
+	}
+	qsort(*slots, *nslots, sizeof(SrPlanParamSlot), param_slot_cmp);
+
+#if PG_VERSION_NUM >= 110000
+	if (params != NULL)
+		execute_for_plantree(pl_stmt, gather_params, params);
+#else
+	pl_stmt->nParamExec = context.next_paramid;
+#endif
+
+	return true;
+}
+
+/*
+ * Make a statement executing 'pl_stmt', converted by sr_plan_params_convert(),
+ * with 'args' as arguments of _p() calls, one per slot. NULL argument means
+ * the one the plan was captured with. The tree of 'pl_stmt' is shared by the
+ * result, so it must stay intact while the result is used.
+ */
+PlannedStmt *
+sr_plan_params_bind(PlannedStmt *pl_stmt, SrPlanParamSlot *slots, int nslots,
+					List *args)
+{
+	PlannedStmt *result;
+	CustomScan *cscan;
+	ListCell   *lc;
+	int			i;
+
+	result = (PlannedStmt *) palloc(sizeof(PlannedStmt));
+	memcpy(result, pl_stmt, sizeof(PlannedStmt));
+
+	if (nslots == 0)
+		return result;
+
+	cscan = makeNode(CustomScan);
+	cscan->methods = &params_scan_methods;
+
+	i = 0;
+	foreach(lc, args)
+	{
+		Node	   *arg = (Node *) lfirst(lc);
+
+		Assert(i < nslots);
+		cscan->custom_private = lappend_int(cscan->custom_private,
+											slots[i].paramid);
+		cscan->custom_exprs = lappend(cscan->custom_exprs,
+									  arg ? arg : slots[i].arg);
+		i++;
+	}
+
+	result->subplans = lappend(list_copy(pl_stmt->subplans), cscan);
+
+	return result;
+}
+
+/*
+ * Make a statement executing 'pl_stmt', planned with literals of the query
+ * replaced by $n parameters, with 'values' as these parameters, in order.
+ */
+PlannedStmt *
+sr_plan_literals_bind(PlannedStmt *pl_stmt, List *values)
+{
+	PlannedStmt *result;
+	CustomScan *cscan;
+
+	if (values == NIL)
+		return pl_stmt;
+
+	cscan = makeNode(CustomScan);
+	cscan->methods = &literals_scan_methods;
+	cscan->custom_exprs = values;
+
+	result = (PlannedStmt *) palloc(sizeof(PlannedStmt));
+	memcpy(result, pl_stmt, sizeof(PlannedStmt));
+	result->subplans = lappend(list_copy(pl_stmt->subplans), cscan);
+
+	return result;
+}
@@ -0,0 +1,841 @@
+/*
+ * plan_partitions.c
+ *		Frozen plans over partitioned tables following their partitions.
+ *
+ * A frozen plan scans the partitions existing when it was captured. To keep
+ * it across attaching and dropping of partitions, a SELECT plan is saved
+ * with dependencies on partitioned tables and their indexes instead of the
+ * partitions and indexes of partitions, and it's brought up to date when
+ * loaded. Each Append or MergeAppend scanning partitions of one table loses
+ * subplans of partitions gone, and a new partition gets a copy of the
+ * subplan of the last partition, with the same scan method and the
+ * partition of the same index. Runtime pruning info of the node is rebuilt
+ * for the current partitions, so new partitions are pruned like others.
+ * Without runtime pruning new partitions are added only if subplans have no
+ * conditions on the partition key, otherwise the planner could have pruned
+ * partitions for values the plan was made for, and partitions it doesn't
+ * scan can't be told from new ones.
+ *
+ * A plan is not used when it can't be brought up to date: a partition has
+ * no subplan and can't get one, no subplan is left, a new partition has
+ * another layout of columns or lacks the index, subplans are not simple
+ * scans, the node is parallel or prunes subpartitions. Other nodes scanning
+ * partitions are used as captured, as long as the partitions are still
+ * there. Supported since PostgreSQL 12 until 18, which keeps pruning info
+ * apart from the plan nodes.
+ */
+#include "sr_plan.h"
+
+#if PG_VERSION_NUM >= 120000 && PG_VERSION_NUM < 180000
+#include "access/sysattr.h"
+#include "access/table.h"
+#include "catalog/partition.h"
+#include "catalog/pg_class.h"
+#include "miscadmin.h"
+#include "nodes/pathnodes.h"
+#include "optimizer/optimizer.h"
+#include "parser/parsetree.h"
+#include "partitioning/partdesc.h"
+#include "rewrite/rewriteManip.h"
+#include "storage/lmgr.h"
+#include "utils/lsyscache.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+
+#if PG_VERSION_NUM >= 140000
+#define RelationGetPartitionDescCompat(rel) RelationGetPartitionDesc(rel, true)
+#else
+#define RelationGetPartitionDescCompat(rel) RelationGetPartitionDesc(rel)
+#endif
+
+typedef struct RefreshContext
+{
+	PlannedStmt	   *stmt;
+	int				next_plan_node_id;
+	Bitmapset	   *removed;		/* rtindexes of partitions gone */
+	bool			failed;
+} RefreshContext;
+
+/*
+ * Only plans of SELECT without row marks are refreshed, other ones have
+ * partitions in result relations and row marks too.
+ */
+static bool
+refreshable(PlannedStmt *stmt)
+{
+	return stmt->commandType == CMD_SELECT && stmt->rowMarks == NIL &&
+		stmt->appendRelations != NIL;
+}
+
+/*
+ * AppendRelInfo of 'rti' if it's a partition of a partitioned table.
+ */
+static AppendRelInfo *
+partition_appinfo(PlannedStmt *stmt, Index rti)
+{
+	ListCell	   *lc;
+
+	foreach(lc, stmt->appendRelations)
+	{
+		AppendRelInfo  *appinfo = lfirst(lc);
+
+		if (appinfo->child_relid == rti)
+		{
+			RangeTblEntry  *parent = rt_fetch(appinfo->parent_relid,
+											  stmt->rtable);
+
+			if (parent->rtekind == RTE_RELATION &&
+				parent->relkind == RELKIND_PARTITIONED_TABLE)
+				return appinfo;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Range table index of the relation scanned by a subplan of Append, or 0
+ * if it's not a simple scan.
+ */
+static Index
+subplan_scanrelid(Plan *plan)
+{
+	while (plan != NULL)
+	{
+		switch (nodeTag(plan))
+		{
+			case T_SeqScan:
+			case T_IndexScan:
+			case T_IndexOnlyScan:
+			case T_BitmapHeapScan:
+				return ((Scan *) plan)->scanrelid;
+
+			case T_Sort:
+#if PG_VERSION_NUM >= 130000
+			case T_IncrementalSort:
+#endif
+			case T_Result:
+				plan = plan->lefttree;
+				break;
+
+			default:
+				return 0;
+		}
+	}
+
+	return 0;
+}
+
+static bool
+partition_present(PartitionDesc partdesc, Oid relid)
+{
+	int			i;
+
+	for (i = 0; i < partdesc->nparts; i++)
+		if (partdesc->oids[i] == relid)
+			return true;
+
+	return false;
+}
+
+/*
+ * Add attribute numbers of 'rti' used by conditions of a subplan, see
+ * pull_varattnos().
+ */
+static void
+subplan_qual_attnos(Plan *plan, Index rti, Bitmapset **attnos, bool *has_quals)
+{
+	for (; plan != NULL; plan = plan->lefttree)
+	{
+		List	   *quals = NIL;
+
+		switch (nodeTag(plan))
+		{
+			case T_IndexScan:
+				quals = ((IndexScan *) plan)->indexqualorig;
+				break;
+
+			case T_BitmapHeapScan:
+				quals = ((BitmapHeapScan *) plan)->bitmapqualorig;
+				break;
+
+			case T_IndexOnlyScan:
+				{
+					IndexOnlyScan  *scan = (IndexOnlyScan *) plan;
+					Bitmapset	   *index_attnos = NULL;
+					int				attno = -1;
+
+					/* Conditions refer to index columns */
+					pull_varattnos((Node *) scan->indexqual, INDEX_VAR,
+								   &index_attnos);
+					pull_varattnos((Node *) plan->qual, INDEX_VAR,
+								   &index_attnos);
+					while ((attno = bms_next_member(index_attnos, attno)) >= 0)
+					{
+						int				colno = attno + FirstLowInvalidHeapAttributeNumber;
+						TargetEntry	   *tle;
+
+						if (colno <= 0 || colno > list_length(scan->indextlist))
+							continue;
+						tle = list_nth(scan->indextlist, colno - 1);
+						pull_varattnos((Node *) tle->expr, rti, attnos);
+					}
+					*has_quals |= scan->indexqual != NIL;
+				}
+				break;
+
+			default:
+				break;
+		}
+
+		*has_quals |= plan->qual != NIL || quals != NIL;
+		pull_varattnos((Node *) plan->qual, rti, attnos);
+		pull_varattnos((Node *) quals, rti, attnos);
+	}
+}
+
+/*
+ * Could the planner have pruned partitions for conditions of 'plan', which
+ * scans partition 'rti' of 'parent'?
+ */
+static bool
+partition_key_used(PlannedStmt *stmt, Plan *plan, Index rti, Relation parent)
+{
+	PartitionKey	key = RelationGetPartitionKey(parent);
+	AppendRelInfo  *appinfo = partition_appinfo(stmt, rti);
+	Bitmapset	   *attnos = NULL;
+	bool			has_quals = false;
+	int				i;
+
+	subplan_qual_attnos(plan, rti, &attnos, &has_quals);
+	if (!has_quals)
+		return false;
+
+	for (i = 0; i < key->partnatts; i++)
+	{
+		AttrNumber	attno = key->partattrs[i];
+		Var		   *var;
+
+		/* Expressions are not looked into */
+		if (attno == 0 || attno > list_length(appinfo->translated_vars))
+			return true;
+
+		var = list_nth(appinfo->translated_vars, attno - 1);
+		if (var == NULL || !IsA(var, Var) ||
+			bms_is_member(var->varattno - FirstLowInvalidHeapAttributeNumber,
+						  attnos))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Both relations have the same attribute numbers and types of columns.
+ */
+static bool
+same_layout(TupleDesc desc1, TupleDesc desc2)
+{
+	int			i;
+
+	if (desc1->natts != desc2->natts)
+		return false;
+
+	for (i = 0; i < desc1->natts; i++)
+	{
+		Form_pg_attribute	att1 = TupleDescAttr(desc1, i);
+		Form_pg_attribute	att2 = TupleDescAttr(desc2, i);
+
+		if (att1->attisdropped != att2->attisdropped)
+			return false;
+		if (att1->attisdropped)
+			continue;
+		if (att1->atttypid != att2->atttypid ||
+			att1->atttypmod != att2->atttypmod ||
+			att1->attcollation != att2->attcollation ||
+			strcmp(NameStr(att1->attname), NameStr(att2->attname)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Index of partition 'rel' matching 'indexid' of another partition.
+ */
+static Oid
+partition_index(Oid indexid, Relation rel)
+{
+	List	   *ancestors = get_partition_ancestors(indexid);
+
+	if (ancestors == NIL)
+		return InvalidOid;
+
+	return index_get_partition(rel, linitial_oid(ancestors));
+}
+
+/*
+ * Make 'exprs' refer to 'new_rti' instead of 'old_rti'. Whole-row Vars have
+ * the type of a partition and subplans can't be shared, so these are not
+ * supported.
+ */
+static bool
+change_vars(Node *exprs, Index old_rti, Index new_rti)
+{
+	Bitmapset	   *attnos = NULL;
+
+	if (exprs == NULL)
+		return true;
+
+	pull_varattnos(exprs, old_rti, &attnos);
+	if (bms_is_member(InvalidAttrNumber - FirstLowInvalidHeapAttributeNumber,
+					  attnos) || contain_subplans(exprs))
+		return false;
+
+	ChangeVarNodes(exprs, old_rti, new_rti, 0);
+	return true;
+}
+
+/*
+ * Turn a copy of subplan of partition 'old_rti' into one of partition
+ * 'new_rti'.
+ */
+static bool
+change_subplan(RefreshContext *context, Plan *plan, Index old_rti,
+			   Index new_rti, Relation rel)
+{
+	ListCell   *lc;
+
+	if (plan == NULL)
+		return true;
+
+	check_stack_depth();
+
+	if (plan->initPlan != NIL ||
+		!change_vars((Node *) plan->targetlist, old_rti, new_rti) ||
+		!change_vars((Node *) plan->qual, old_rti, new_rti))
+		return false;
+	plan->plan_node_id = context->next_plan_node_id++;
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_BitmapIndexScan:
+			if (((Scan *) plan)->scanrelid != old_rti)
+				return false;
+			((Scan *) plan)->scanrelid = new_rti;
+			break;
+
+		case T_BitmapAnd:
+			foreach(lc, ((BitmapAnd *) plan)->bitmapplans)
+				if (!change_subplan(context, lfirst(lc), old_rti, new_rti, rel))
+					return false;
+			break;
+
+		case T_BitmapOr:
+			foreach(lc, ((BitmapOr *) plan)->bitmapplans)
+				if (!change_subplan(context, lfirst(lc), old_rti, new_rti, rel))
+					return false;
+			break;
+
+		case T_Sort:
+#if PG_VERSION_NUM >= 130000
+		case T_IncrementalSort:
+#endif
+			break;
+
+		case T_Result:
+			if (!change_vars(((Result *) plan)->resconstantqual,
+							 old_rti, new_rti))
+				return false;
+			break;
+
+		default:
+			return false;
+	}
+
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			{
+				IndexScan  *scan = (IndexScan *) plan;
+
+				scan->indexid = partition_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid) ||
+					!change_vars((Node *) scan->indexqualorig, old_rti, new_rti) ||
+					!change_vars((Node *) scan->indexorderbyorig, old_rti, new_rti))
+					return false;
+			}
+			break;
+
+		case T_IndexOnlyScan:
+			{
+				IndexOnlyScan  *scan = (IndexOnlyScan *) plan;
+
+				scan->indexid = partition_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid) ||
+					!change_vars((Node *) scan->indextlist, old_rti, new_rti))
+					return false;
+			}
+			break;
+
+		case T_BitmapIndexScan:
+			{
+				BitmapIndexScan *scan = (BitmapIndexScan *) plan;
+
+				scan->indexid = partition_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid) ||
+					!change_vars((Node *) scan->indexqualorig, old_rti, new_rti))
+					return false;
+			}
+			break;
+
+		case T_BitmapHeapScan:
+			if (!change_vars((Node *) ((BitmapHeapScan *) plan)->bitmapqualorig,
+							 old_rti, new_rti))
+				return false;
+			break;
+
+		default:
+			break;
+	}
+
+	return change_subplan(context, plan->lefttree, old_rti, new_rti, rel) &&
+		change_subplan(context, plan->righttree, old_rti, new_rti, rel);
+}
+
+/*
+ * Subplan of partition 'relid' made of 'template' scanning partition
+ * 'template_rti', or NULL if it can't be made.
+ */
+static Plan *
+clone_subplan(RefreshContext *context, Plan *template, Index template_rti,
+			  Oid relid)
+{
+	PlannedStmt	   *stmt = context->stmt;
+	RangeTblEntry  *rte = rt_fetch(template_rti, stmt->rtable);
+	AppendRelInfo  *appinfo = partition_appinfo(stmt, template_rti);
+	Relation		template_rel;
+	Relation		rel;
+	Plan		   *plan = NULL;
+	Index			rti;
+	bool			same;
+
+	if (rte->relkind != RELKIND_RELATION ||
+		get_rel_relkind(relid) != RELKIND_RELATION)
+		return NULL;
+
+	/* The planner locks partitions it scans, so do we */
+	LockRelationOid(relid, rte->rellockmode);
+	rel = table_open(relid, NoLock);
+	template_rel = table_open(rte->relid, AccessShareLock);
+	same = same_layout(RelationGetDescr(template_rel), RelationGetDescr(rel));
+	table_close(template_rel, NoLock);
+	if (!same)
+	{
+		table_close(rel, NoLock);
+		return NULL;
+	}
+
+	rte = copyObject(rte);
+	rte->relid = relid;
+	stmt->rtable = lappend(stmt->rtable, rte);
+	rti = list_length(stmt->rtable);
+
+	plan = copyObject(template);
+	if (!change_subplan(context, plan, template_rti, rti, rel))
+	{
+		table_close(rel, NoLock);
+		return NULL;
+	}
+
+	appinfo = copyObject(appinfo);
+	appinfo->child_relid = rti;
+	appinfo->child_reltype = rel->rd_rel->reltype;
+	ChangeVarNodes((Node *) appinfo->translated_vars, template_rti, rti, 0);
+	stmt->appendRelations = lappend(stmt->appendRelations, appinfo);
+	stmt->relationOids = list_append_unique_oid(stmt->relationOids, relid);
+	table_close(rel, NoLock);
+
+	return plan;
+}
+
+/*
+ * Set runtime pruning info of partitioned table 'parent_rti' for subplans
+ * scanning 'relids' of its partitions.
+ */
+static bool
+refresh_pruneinfo(PartitionPruneInfo *pruneinfo, Index parent_rti,
+				  PartitionDesc partdesc, Oid *relids, int nrelids)
+{
+	PartitionedRelPruneInfo *pinfo;
+	List	   *pinfos;
+	int			i;
+	int			j;
+
+	if (list_length(pruneinfo->prune_infos) != 1 ||
+		!bms_is_empty(pruneinfo->other_subplans))
+		return false;
+
+	pinfos = linitial(pruneinfo->prune_infos);
+	if (list_length(pinfos) != 1)
+		return false;
+
+	pinfo = linitial(pinfos);
+	if (pinfo->rtindex != parent_rti)
+		return false;
+
+	pinfo->nparts = partdesc->nparts;
+	pinfo->subplan_map = palloc(sizeof(int) * partdesc->nparts);
+	pinfo->subpart_map = palloc(sizeof(int) * partdesc->nparts);
+	pinfo->relid_map = palloc(sizeof(Oid) * partdesc->nparts);
+	pinfo->present_parts = NULL;
+	for (i = 0; i < partdesc->nparts; i++)
+	{
+		pinfo->subplan_map[i] = -1;
+		pinfo->subpart_map[i] = -1;
+		pinfo->relid_map[i] = partdesc->oids[i];
+		for (j = 0; j < nrelids; j++)
+		{
+			if (relids[j] == partdesc->oids[i])
+			{
+				pinfo->subplan_map[i] = j;
+				pinfo->present_parts = bms_add_member(pinfo->present_parts, i);
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Bring subplans of an Append or MergeAppend up to date with partitions.
+ */
+static void
+refresh_append(RefreshContext *context, Plan *plan)
+{
+	PlannedStmt	   *stmt = context->stmt;
+	List		  **subplans;
+	PartitionPruneInfo *pruneinfo;
+	AppendRelInfo  *appinfo;
+	Index			parent_rti = 0;
+	Relation		parent;
+	PartitionDesc	partdesc;
+	Plan		   *template = NULL;
+	Index			template_rti = 0;
+	List		   *result = NIL;
+	Oid			   *relids;
+	int				nrelids = 0;
+	bool			add;
+	bool			changed = false;
+	ListCell	   *lc;
+	int				i;
+
+	if (IsA(plan, Append))
+	{
+		subplans = &((Append *) plan)->appendplans;
+		pruneinfo = ((Append *) plan)->part_prune_info;
+	}
+	else
+	{
+		subplans = &((MergeAppend *) plan)->mergeplans;
+		pruneinfo = ((MergeAppend *) plan)->part_prune_info;
+	}
+
+	/* All subplans should scan partitions of the same table */
+	foreach(lc, *subplans)
+	{
+		Index		rti = subplan_scanrelid(lfirst(lc));
+
+		appinfo = rti ? partition_appinfo(stmt, rti) : NULL;
+		if (appinfo == NULL ||
+			(parent_rti != 0 && appinfo->parent_relid != parent_rti))
+			return;
+		parent_rti = appinfo->parent_relid;
+	}
+	if (parent_rti == 0)
+		return;
+
+	parent = table_open(rt_fetch(parent_rti, stmt->rtable)->relid,
+						AccessShareLock);
+	partdesc = RelationGetPartitionDescCompat(parent);
+	relids = palloc(sizeof(Oid) * (partdesc->nparts + list_length(*subplans)));
+
+	/* Subplans of partitions still there, the last one is a template */
+	foreach(lc, *subplans)
+	{
+		Index		rti = subplan_scanrelid(lfirst(lc));
+		Oid			relid = rt_fetch(rti, stmt->rtable)->relid;
+
+		if (partition_present(partdesc, relid))
+		{
+			template = lfirst(lc);
+			template_rti = rti;
+			result = lappend(result, template);
+			relids[nrelids++] = relid;
+		}
+		else
+		{
+			context->removed = bms_add_member(context->removed, rti);
+			changed = true;
+		}
+	}
+
+	add = template != NULL &&
+		(pruneinfo != NULL ||
+		 !partition_key_used(stmt, template, template_rti, parent));
+
+	/* Add subplans of new partitions in the order of partitions */
+	if (add)
+	{
+		result = NIL;
+		nrelids = 0;
+		for (i = 0; i < partdesc->nparts && !context->failed; i++)
+		{
+			Oid			relid = partdesc->oids[i];
+			Plan	   *subplan = NULL;
+
+			foreach(lc, *subplans)
+			{
+				Index		rti = subplan_scanrelid(lfirst(lc));
+
+				if (rt_fetch(rti, stmt->rtable)->relid == relid)
+				{
+					subplan = lfirst(lc);
+					break;
+				}
+			}
+
+			if (subplan == NULL)
+			{
+				subplan = clone_subplan(context, template, template_rti, relid);
+				if (subplan == NULL)
+					context->failed = true;
+				changed = true;
+			}
+			result = lappend(result, subplan);
+			relids[nrelids++] = relid;
+		}
+	}
+	table_close(parent, NoLock);
+
+	/* A partition without subplan could be a new one, don't miss its rows */
+	if (template == NULL || nrelids < partdesc->nparts)
+		context->failed = true;
+
+	if (!changed || context->failed)
+		return;
+
+	if (plan->parallel_aware ||
+		(IsA(plan, Append) &&
+		 (((Append *) plan)->first_partial_plan < list_length(*subplans)
+#if PG_VERSION_NUM >= 140000
+		  || ((Append *) plan)->nasyncplans > 0
+#endif
+		  )) ||
+		(pruneinfo != NULL &&
+		 !refresh_pruneinfo(pruneinfo, parent_rti, partdesc, relids, nrelids)))
+	{
+		context->failed = true;
+		return;
+	}
+
+	*subplans = result;
+	if (IsA(plan, Append))
+		((Append *) plan)->first_partial_plan = list_length(result);
+}
+
+static void
+refresh_visitor(Plan *plan, void *context)
+{
+	if (((RefreshContext *) context)->failed)
+		return;
+
+	if (IsA(plan, Append) || IsA(plan, MergeAppend))
+		refresh_append(context, plan);
+}
+
+static void
+refresh_plan(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, refresh_visitor, context);
+}
+
+static void
+max_plan_node_id_visitor(Plan *plan, void *context)
+{
+	int		   *max_id = context;
+
+	*max_id = Max(*max_id, plan->plan_node_id);
+}
+
+static void
+max_plan_node_id(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, max_plan_node_id_visitor, context);
+}
+
+/*
+ * Partitions scanned by 'stmt' and not removed are still there.
+ */
+static bool
+partitions_present(RefreshContext *context)
+{
+	PlannedStmt	   *stmt = context->stmt;
+	ListCell	   *lc;
+
+	foreach(lc, stmt->appendRelations)
+	{
+		AppendRelInfo  *appinfo = lfirst(lc);
+		RangeTblEntry  *parent_rte = rt_fetch(appinfo->parent_relid,
+											  stmt->rtable);
+		Relation		parent;
+		bool			present;
+
+		if (parent_rte->rtekind != RTE_RELATION ||
+			parent_rte->relkind != RELKIND_PARTITIONED_TABLE ||
+			bms_is_member(appinfo->child_relid, context->removed))
+			continue;
+
+		parent = table_open(parent_rte->relid, AccessShareLock);
+		present = partition_present(RelationGetPartitionDescCompat(parent),
+									rt_fetch(appinfo->child_relid,
+											 stmt->rtable)->relid);
+		table_close(parent, NoLock);
+		if (!present)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Return 'pl_stmt' scanning the current partitions of partitioned tables,
+ * or NULL if it can't be used. The plan is changed in place.
+ */
+PlannedStmt *
+sr_plan_partitions_refresh(PlannedStmt *pl_stmt)
+{
+	RefreshContext	context;
+	ListCell	   *lc;
+	bool			partitioned = false;
+
+	foreach(lc, pl_stmt->rtable)
+	{
+		RangeTblEntry  *rte = lfirst(lc);
+
+		if (rte->rtekind == RTE_RELATION &&
+			rte->relkind == RELKIND_PARTITIONED_TABLE)
+			partitioned = true;
+	}
+	if (!partitioned || !refreshable(pl_stmt))
+		return pl_stmt;
+
+	context.stmt = pl_stmt;
+	context.next_plan_node_id = 0;
+	context.removed = NULL;
+	context.failed = false;
+
+	execute_for_plantree(pl_stmt, max_plan_node_id, &context.next_plan_node_id);
+	context.next_plan_node_id++;
+	execute_for_plantree(pl_stmt, refresh_plan, &context);
+
+	if (context.failed || !partitions_present(&context))
+		return NULL;
+
+	return pl_stmt;
+}
+
+/*
+ * relationOids of 'pl_stmt' without partitions to be refreshed.
+ */
+List *
+sr_plan_partitions_reloids(PlannedStmt *pl_stmt)
+{
+	List		   *partitions = NIL;
+	List		   *others = NIL;
+	List		   *result = NIL;
+	ListCell	   *lc;
+	Index			rti = 0;
+
+	if (!refreshable(pl_stmt))
+		return list_copy(pl_stmt->relationOids);
+
+	/* A partition could be used by itself as well */
+	foreach(lc, pl_stmt->rtable)
+	{
+		RangeTblEntry  *rte = lfirst(lc);
+
+		rti++;
+		if (rte->rtekind != RTE_RELATION)
+			continue;
+		if (partition_appinfo(pl_stmt, rti) != NULL)
+			partitions = lappend_oid(partitions, rte->relid);
+		else
+			others = lappend_oid(others, rte->relid);
+	}
+
+	foreach(lc, pl_stmt->relationOids)
+	{
+		Oid			relid = lfirst_oid(lc);
+
+		if (!list_member_oid(partitions, relid) ||
+			list_member_oid(others, relid))
+			result = lappend_oid(result, relid);
+	}
+
+	return result;
+}
+
+/*
+ * 'index_oids' of 'pl_stmt' with indexes of partitions replaced by indexes
+ * of partitioned tables.
+ */
+List *
+sr_plan_partitions_index_oids(PlannedStmt *pl_stmt, List *index_oids)
+{
+	List	   *result = NIL;
+	ListCell   *lc;
+
+	if (!refreshable(pl_stmt))
+		return index_oids;
+
+	foreach(lc, index_oids)
+	{
+		List	   *ancestors = get_partition_ancestors(lfirst_oid(lc));
+
+		if (ancestors != NIL)
+			result = list_append_unique_oid(result, llast_oid(ancestors));
+		else
+			result = list_append_unique_oid(result, lfirst_oid(lc));
+	}
+
+	return result;
+}
+
+#else							/* PG_VERSION_NUM < 120000 || >= 180000 */
+
+PlannedStmt *
+sr_plan_partitions_refresh(PlannedStmt *pl_stmt)
+{
+	return pl_stmt;
+}
+
+List *
+sr_plan_partitions_reloids(PlannedStmt *pl_stmt)
+{
+	return list_copy(pl_stmt->relationOids);
+}
+
+List *
+sr_plan_partitions_index_oids(PlannedStmt *pl_stmt, List *index_oids)
+{
+	return index_oids;
+}
+
+#endif
@@ -0,0 +1,467 @@
+/*
+ * plan_store.c
+ *		Enabled plans shared by all backends in dynamic shared memory.
+ *
+ * With sr_plan.shared_store a plan found in sr_plans by one backend is put
+ * into a dshash table keyed by (database, query_hash), so other backends get
+ * it without opening sr_plans. Plans are kept as nodeToString() text, which
+ * is copied out of the shared area in one piece and read by stringToNode().
+ *
+ * Any change of sr_plans bumps the generation of its database, both when it
+ * is made and when its transaction ends, and entries of older generations
+ * are ignored. A backend puts a plan with the generation it saw before
+ * reading sr_plans, so a plan read just before a concurrent commit never
+ * looks fresh, and a transaction which changed sr_plans puts nothing, since
+ * it could read its own uncommitted rows. Plans take up to
+ * sr_plan.shared_store_size, entries of older generations are removed when
+ * it's exhausted (since PostgreSQL 15) or when they are looked up. The area
+ * itself is limited to half as much again: dshash can't fail softly, so its
+ * buckets and entries are allocated from that headroom, and a plan that
+ * doesn't fit is not shared.
+ *
+ * dshash is available since PostgreSQL 11, the store is never used before.
+ */
+#include "sr_plan.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+#if PG_VERSION_NUM >= 110000
+#include "lib/dshash.h"
+#include "utils/dsa.h"
+#endif
+
+bool	sr_plan_shared_store = false;
+int		sr_plan_shared_store_size = 64;
+
+#if PG_VERSION_NUM >= 110000
+
+typedef struct SrPlanStoreShared
+{
+	LWLock		   *lock;			/* protects fields below */
+	bool			initialized;
+	int				tranche_id;
+	dsa_handle		area;
+	dshash_table_handle plans;
+	dshash_table_handle databases;
+	pg_atomic_uint64 plan_bytes;	/* space taken by plan texts */
+} SrPlanStoreShared;
+
+typedef struct SrPlanStoreKey
+{
+	Oid			dbid;
+	int32		query_hash;
+} SrPlanStoreKey;
+
+typedef struct SrPlanStoreEntry
+{
+	SrPlanStoreKey	key;		/* hash key, must be first */
+	Oid				sr_plans_oid;	/* not to mix up with a dropped one */
+	int32			plan_hash;
+	uint64			generation;
+	dsa_pointer		plan;		/* nodeToString() of PlannedStmt */
+	Size			len;
+} SrPlanStoreEntry;
+
+typedef struct SrPlanStoreDb
+{
+	Oid			dbid;			/* hash key, must be first */
+	uint64		generation;
+} SrPlanStoreDb;
+
+static SrPlanStoreShared *store_shared = NULL;
+
+static dsa_area	   *store_area = NULL;
+static dshash_table *store_plans = NULL;
+static dshash_table *store_databases = NULL;
+
+/* sr_plans is changed by the current transaction */
+static bool			bump_at_commit = false;
+static bool			xact_callback_registered = false;
+
+static dshash_parameters plans_params = {
+	sizeof(SrPlanStoreKey),
+	sizeof(SrPlanStoreEntry),
+	dshash_memcmp,
+	dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	0							/* tranche_id is set on attach */
+};
+
+static dshash_parameters databases_params = {
+	sizeof(Oid),
+	sizeof(SrPlanStoreDb),
+	dshash_memcmp,
+	dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	0
+};
+
+Size
+sr_plan_store_shmem_size(void)
+{
+	return MAXALIGN(sizeof(SrPlanStoreShared));
+}
+
+void
+sr_plan_store_shmem_request(void)
+{
+	RequestNamedLWLockTranche("sr_plan store", 1);
+}
+
+void
+sr_plan_store_shmem_init(void)
+{
+	bool		found;
+
+	store_shared = ShmemInitStruct("sr_plan store",
+								   sizeof(SrPlanStoreShared), &found);
+	if (!found)
+	{
+		store_shared->lock = &(GetNamedLWLockTranche("sr_plan store"))->lock;
+		store_shared->initialized = false;
+		pg_atomic_init_u64(&store_shared->plan_bytes, 0);
+	}
+}
+
+static size_t
+store_plan_limit(void)
+{
+	return (size_t) sr_plan_shared_store_size * 1024 * 1024;
+}
+
+/*
+ * Free plan text of the entry.
+ */
+static void
+store_free_plan(SrPlanStoreEntry *entry)
+{
+	dsa_free(store_area, entry->plan);
+	pg_atomic_sub_fetch_u64(&store_shared->plan_bytes, entry->len);
+}
+
+/*
+ * Attach to the shared area, creating it if needed. Returns false if the
+ * store is not used.
+ */
+static bool
+store_attach(void)
+{
+	MemoryContext	oldcontext;
+
+	if (store_plans != NULL)
+		return true;
+
+	if (!sr_plan_shared_store || store_shared == NULL)
+		return false;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(store_shared->lock, LW_EXCLUSIVE);
+	if (!store_shared->initialized)
+	{
+		store_shared->tranche_id = LWLockNewTrancheId();
+		LWLockRegisterTranche(store_shared->tranche_id, "sr_plan store");
+		plans_params.tranche_id = store_shared->tranche_id;
+		databases_params.tranche_id = store_shared->tranche_id;
+
+		store_area = dsa_create(store_shared->tranche_id);
+		dsa_set_size_limit(store_area, store_plan_limit() * 3 / 2);
+		dsa_pin(store_area);
+		dsa_pin_mapping(store_area);
+		store_plans = dshash_create(store_area, &plans_params, NULL);
+		store_databases = dshash_create(store_area, &databases_params, NULL);
+
+		store_shared->area = dsa_get_handle(store_area);
+		store_shared->plans = dshash_get_hash_table_handle(store_plans);
+		store_shared->databases = dshash_get_hash_table_handle(store_databases);
+		store_shared->initialized = true;
+	}
+	else
+	{
+		LWLockRegisterTranche(store_shared->tranche_id, "sr_plan store");
+		plans_params.tranche_id = store_shared->tranche_id;
+		databases_params.tranche_id = store_shared->tranche_id;
+
+		store_area = dsa_attach(store_shared->area);
+		dsa_pin_mapping(store_area);
+		store_plans = dshash_attach(store_area, &plans_params,
+									store_shared->plans, NULL);
+		store_databases = dshash_attach(store_area, &databases_params,
+										store_shared->databases, NULL);
+	}
+	LWLockRelease(store_shared->lock);
+	MemoryContextSwitchTo(oldcontext);
+
+	return true;
+}
+
+static uint64
+db_generation(void)
+{
+	SrPlanStoreDb  *db;
+	uint64			generation;
+
+	db = dshash_find(store_databases, &MyDatabaseId, false);
+	if (db == NULL)
+		return 0;
+
+	generation = db->generation;
+	dshash_release_lock(store_databases, db);
+
+	return generation;
+}
+
+/*
+ * Bump generation of the current database, unless it's not there and
+ * 'insert' is not set.
+ */
+static void
+db_bump_generation(bool insert)
+{
+	SrPlanStoreDb  *db;
+	bool			found;
+
+	if (insert)
+	{
+		db = dshash_find_or_insert(store_databases, &MyDatabaseId, &found);
+		if (!found)
+			db->generation = 0;
+	}
+	else
+	{
+		db = dshash_find(store_databases, &MyDatabaseId, true);
+		if (db == NULL)
+			return;
+	}
+
+	db->generation++;
+	dshash_release_lock(store_databases, db);
+}
+
+/*
+ * Remove entries of older generations.
+ */
+static void
+store_sweep(void)
+{
+#if PG_VERSION_NUM >= 150000
+	dshash_seq_status	status;
+	SrPlanStoreEntry   *entry;
+	Oid					dbid = InvalidOid;
+	uint64				generation = 0;
+
+	dshash_seq_init(&status, store_plans, true);
+	while ((entry = dshash_seq_next(&status)) != NULL)
+	{
+		if (entry->key.dbid != dbid)
+		{
+			SrPlanStoreDb  *db;
+
+			/* Locks of store_plans are never taken after these ones */
+			dbid = entry->key.dbid;
+			db = dshash_find(store_databases, &dbid, false);
+			generation = db ? db->generation : 0;
+			if (db)
+				dshash_release_lock(store_databases, db);
+		}
+
+		if (entry->generation != generation)
+		{
+			store_free_plan(entry);
+			dshash_delete_current(&status);
+		}
+	}
+	dshash_seq_term(&status);
+#endif
+}
+
+/*
+ * Plan of 'query_hash' in the current database or NULL. 'generation' gets
+ * the generation to pass to sr_plan_store_put() if the plan is read from
+ * sr_plans after that.
+ */
+PlannedStmt *
+sr_plan_store_lookup(Oid sr_plans_oid, int32 query_hash, int32 *plan_hash,
+					 uint64 *generation)
+{
+	SrPlanStoreKey		key;
+	SrPlanStoreEntry   *entry;
+	char			   *plan_text;
+
+	*generation = 0;
+	if (!store_attach())
+		return NULL;
+
+	*generation = db_generation();
+
+	MemSet(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.query_hash = query_hash;
+	entry = dshash_find(store_plans, &key, false);
+	if (entry == NULL)
+		return NULL;
+
+	if (entry->generation != *generation || entry->sr_plans_oid != sr_plans_oid)
+	{
+		dshash_release_lock(store_plans, entry);
+
+		/* Get rid of it, unless somebody has just put a fresh one */
+		entry = dshash_find(store_plans, &key, true);
+		if (entry == NULL)
+			return NULL;
+		if (entry->generation != *generation ||
+			entry->sr_plans_oid != sr_plans_oid)
+		{
+			store_free_plan(entry);
+			dshash_delete_entry(store_plans, entry);
+		}
+		else
+			dshash_release_lock(store_plans, entry);
+		return NULL;
+	}
+
+	plan_text = palloc(entry->len + 1);
+	memcpy(plan_text, dsa_get_address(store_area, entry->plan), entry->len);
+	plan_text[entry->len] = '\0';
+	*plan_hash = entry->plan_hash;
+	dshash_release_lock(store_plans, entry);
+
+	return (PlannedStmt *) stringToNode(plan_text);
+}
+
+/*
+ * Share the plan read from sr_plans by sr_plan_store_lookup() caller, unless
+ * this transaction has changed sr_plans.
+ */
+void
+sr_plan_store_put(Oid sr_plans_oid, int32 query_hash, int32 plan_hash,
+				  uint64 generation, PlannedStmt *pl_stmt)
+{
+	SrPlanStoreKey		key;
+	SrPlanStoreEntry   *entry;
+	char			   *plan_text;
+	Size				len;
+	dsa_pointer			plan;
+	bool				found;
+
+	if (bump_at_commit || !store_attach())
+		return;
+
+	plan_text = nodeToString(pl_stmt);
+	len = strlen(plan_text);
+
+	/* Leave the rest of the area to dshash */
+	if (pg_atomic_add_fetch_u64(&store_shared->plan_bytes, len) >
+		store_plan_limit())
+		plan = InvalidDsaPointer;
+	else
+		plan = dsa_allocate_extended(store_area, len, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(plan))
+	{
+		pg_atomic_sub_fetch_u64(&store_shared->plan_bytes, len);
+
+		/* Make room for the next time */
+		store_sweep();
+		pfree(plan_text);
+		return;
+	}
+	memcpy(dsa_get_address(store_area, plan), plan_text, len);
+	pfree(plan_text);
+
+	MemSet(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.query_hash = query_hash;
+	entry = dshash_find_or_insert(store_plans, &key, &found);
+	if (found)
+		store_free_plan(entry);
+	entry->sr_plans_oid = sr_plans_oid;
+	entry->plan_hash = plan_hash;
+	entry->generation = generation;
+	entry->plan = plan;
+	entry->len = len;
+	dshash_release_lock(store_plans, entry);
+}
+
+static void
+store_xact_callback(XactEvent event, void *arg)
+{
+	if (!bump_at_commit)
+		return;
+
+	/*
+	 * Plans read before the commit are out of date. Bump after an abort too,
+	 * so nothing put while the transaction was in progress is trusted.
+	 */
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_PARALLEL_COMMIT ||
+		event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT ||
+		event == XACT_EVENT_PREPARE)
+	{
+		db_bump_generation(false);
+		bump_at_commit = false;
+	}
+}
+
+/*
+ * sr_plans of the current database is changed.
+ */
+void
+sr_plan_store_invalidate(void)
+{
+	if (!store_attach())
+		return;
+
+	/* Plans already shared are out of date for this transaction */
+	db_bump_generation(true);
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(store_xact_callback, NULL);
+		xact_callback_registered = true;
+	}
+	bump_at_commit = true;
+}
+
+#else							/* PG_VERSION_NUM < 110000 */
+
+Size
+sr_plan_store_shmem_size(void)
+{
+	return 0;
+}
+
+void
+sr_plan_store_shmem_request(void)
+{
+}
+
+void
+sr_plan_store_shmem_init(void)
+{
+}
+
+PlannedStmt *
+sr_plan_store_lookup(Oid sr_plans_oid, int32 query_hash, int32 *plan_hash,
+					 uint64 *generation)
+{
+	*generation = 0;
+	return NULL;
+}
+
+void
+sr_plan_store_put(Oid sr_plans_oid, int32 query_hash, int32 plan_hash,
+				  uint64 generation, PlannedStmt *pl_stmt)
+{
+}
+
+void
+sr_plan_store_invalidate(void)
+{
+}
+
+#endif							/* PG_VERSION_NUM >= 110000 */
@@ -0,0 +1,511 @@
+/*
+ * plan_template.c
+ *		Frozen plans shared by databases of the same schema.
+ *
+ * sr_plan_template_save() writes enabled plans of the current database into
+ * a file of the data directory, with objects referred to by name like in
+ * sr_plan_export(). With sr_plan.use_templates every database having sr_plan
+ * installed uses these plans as if they were enabled in its sr_plans, unless
+ * sr_plans has its own plan for the query.
+ *
+ * On first use a backend reads the file, resolves names of objects to local
+ * Oids and computes query_hash of each template for its database, keeping
+ * only positions of templates in the file. A plan is read again and remapped
+ * when it's used, then it stays in the backend plan cache like plans of
+ * sr_plans do. Templates are read again when the file is saved or relations
+ * they use are changed.
+ */
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_template_save);
+
+#define SR_PLAN_TEMPLATES_FILE		"sr_plan_templates"
+#define SR_PLAN_TEMPLATES_TMP_FILE	SR_PLAN_TEMPLATES_FILE ".tmp"
+#define SR_PLAN_TEMPLATES_MAGIC		0x54505253	/* "SRPT" */
+#define SR_PLAN_TEMPLATES_VERSION	1
+
+/* Key of the advisory lock serializing saves, in no database */
+#define SET_LOCKTAG_TEMPLATES(tag) \
+	SET_LOCKTAG_ADVISORY(tag, InvalidOid, SR_PLAN_TEMPLATES_MAGIC, 0, 1)
+
+/* Template usable in the current database */
+typedef struct SrPlanTemplate
+{
+	int32		query_hash;		/* hash key, must be first */
+	int32		plan_hash;		/* of the remapped plan */
+	long		offset;			/* of the template in the file */
+} SrPlanTemplate;
+
+/* Template as it is in the file */
+typedef struct SrPlanTemplateRecord
+{
+	char	   *query;
+	char	   *plan;
+	uint32		nobjects;
+	char	  **objects;		/* see sr_plan_export_names() */
+} SrPlanTemplateRecord;
+
+typedef struct SrPlanTemplatesShared
+{
+	pg_atomic_uint32	generation;		/* bumped when the file is saved */
+} SrPlanTemplatesShared;
+
+bool	sr_plan_use_templates = false;
+
+static SrPlanTemplatesShared *templates_shared = NULL;
+
+static MemoryContext templates_context = NULL;
+static HTAB	   *templates = NULL;			/* SrPlanTemplate */
+static HTAB	   *template_objects = NULL;	/* local Oids by name */
+static Oid	   *template_relations = NULL;	/* sorted */
+static int		ntemplate_relations = 0;
+static bool		templates_valid = false;
+
+/* Everything query_hash of templates depends on */
+static uint32	templates_generation = 0;
+static Oid		templates_fake_func = InvalidOid;
+static bool		templates_auto_parameterize = false;
+static bool		templates_use_query_id = false;
+
+Size
+sr_plan_template_shmem_size(void)
+{
+	return MAXALIGN(sizeof(SrPlanTemplatesShared));
+}
+
+void
+sr_plan_template_shmem_init(void)
+{
+	bool		found;
+
+	templates_shared = ShmemInitStruct("sr_plan templates",
+									   sizeof(SrPlanTemplatesShared), &found);
+	if (!found)
+		pg_atomic_init_u32(&templates_shared->generation, 0);
+}
+
+static void
+write_string(FILE *file, const char *str)
+{
+	uint32		len = strlen(str);
+
+	fwrite(&len, sizeof(len), 1, file);
+	fwrite(str, 1, len, file);
+}
+
+static char *
+read_string(FILE *file)
+{
+	uint32		len;
+	char	   *str;
+
+	if (fread(&len, sizeof(len), 1, file) != 1 || len >= MaxAllocSize)
+		return NULL;
+
+	str = palloc(len + 1);
+	if (fread(str, 1, len, file) != len)
+	{
+		pfree(str);
+		return NULL;
+	}
+	str[len] = '\0';
+
+	return str;
+}
+
+static bool
+read_record(FILE *file, SrPlanTemplateRecord *record)
+{
+	uint32		i;
+
+	record->query = read_string(file);
+	if (record->query == NULL)
+		return false;
+
+	record->plan = read_string(file);
+	if (record->plan == NULL ||
+		fread(&record->nobjects, sizeof(uint32), 1, file) != 1 ||
+		record->nobjects >= MaxAllocSize / sizeof(char *))
+		return false;
+
+	record->objects = palloc(sizeof(char *) * (record->nobjects + 1));
+	for (i = 0; i < record->nobjects; i++)
+	{
+		record->objects[i] = read_string(file);
+		if (record->objects[i] == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+static FILE *
+open_templates(void)
+{
+	FILE	   *file;
+	uint32		header[2];
+
+	file = AllocateFile(SR_PLAN_TEMPLATES_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							SR_PLAN_TEMPLATES_FILE)));
+		return NULL;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1 ||
+		header[0] != SR_PLAN_TEMPLATES_MAGIC ||
+		header[1] != SR_PLAN_TEMPLATES_VERSION)
+	{
+		ereport(LOG,
+				(errmsg("sr_plan: ignoring invalid file \"%s\"",
+						SR_PLAN_TEMPLATES_FILE)));
+		FreeFile(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+/*
+ * Find templates usable in the current database.
+ */
+static void
+templates_build(void)
+{
+	MemoryContext	record_context;
+	MemoryContext	oldcontext;
+	HASHCTL			info;
+	FILE		   *file;
+	List		   *relations = NIL;
+	ListCell	   *lc;
+
+	if (templates_context == NULL)
+		templates_context = AllocSetContextCreate(TopMemoryContext,
+												  "sr_plan templates",
+												  ALLOCSET_DEFAULT_SIZES);
+	else
+		MemoryContextReset(templates_context);
+
+	templates = NULL;
+	template_relations = NULL;
+	ntemplate_relations = 0;
+
+	/* Read the file again if it's saved while we are reading it */
+	if (templates_shared)
+		templates_generation = pg_atomic_read_u32(&templates_shared->generation);
+	templates_fake_func = sr_plan_fake_func();
+	templates_auto_parameterize = sr_plan_auto_parameterize;
+	templates_use_query_id = sr_plan_use_query_id;
+
+	/* Don't retry on every query if something goes wrong */
+	templates_valid = true;
+
+	if (!OidIsValid(templates_fake_func))
+		return;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(int32);
+	info.entrysize = sizeof(SrPlanTemplate);
+	info.hcxt = templates_context;
+	templates = hash_create("sr_plan templates", 256, &info,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	template_objects = sr_plan_object_cache_create("sr_plan template objects",
+												   templates_context);
+
+	file = open_templates();
+	if (file == NULL)
+		return;
+
+	record_context = AllocSetContextCreate(CurrentMemoryContext,
+										   "sr_plan template record",
+										   ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(record_context);
+	for (;;)
+	{
+		SrPlanTemplateRecord record;
+		SrPlanTemplate *entry;
+		long		offset = ftell(file);
+		char	   *plan_text;
+		const char *missing;
+		List	   *record_relations = NIL;
+		Query	   *query;
+		int32		query_hash;
+		bool		found;
+
+		MemoryContextReset(record_context);
+		if (!read_record(file, &record))
+			break;
+
+		plan_text = sr_plan_remap_plan(record.plan, record.objects,
+									   record.nobjects, template_objects,
+									   &missing, &record_relations);
+		if (plan_text == NULL)
+		{
+			elog(DEBUG1, "sr_plan: template of query \"%s\" is skipped, object \"%s\" does not exist",
+				 record.query, missing);
+			continue;
+		}
+
+		if (!sr_plan_hash_query_text(record.query, &query, &query_hash))
+			continue;
+
+		entry = (SrPlanTemplate *) hash_search(templates, &query_hash,
+											   HASH_ENTER, &found);
+		if (found)
+			continue;
+
+		entry->plan_hash = DatumGetInt32(hash_any((unsigned char *) plan_text,
+												  strlen(plan_text)));
+		entry->offset = offset;
+
+		MemoryContextSwitchTo(templates_context);
+		relations = list_concat(relations, list_copy(record_relations));
+		MemoryContextSwitchTo(record_context);
+	}
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(record_context);
+	FreeFile(file);
+
+	if (relations != NIL)
+	{
+		template_relations = MemoryContextAlloc(templates_context,
+												sizeof(Oid) * list_length(relations));
+		foreach(lc, relations)
+			template_relations[ntemplate_relations++] = lfirst_oid(lc);
+		qsort(template_relations, ntemplate_relations, sizeof(Oid), oid_cmp);
+	}
+}
+
+/*
+ * Forget templates and their plans in the backend cache if they don't suit
+ * the current state of things. Called before the cache is looked up.
+ */
+void
+sr_plan_template_check(void)
+{
+	if (!templates_valid)
+		return;
+
+	if ((templates_shared &&
+		 pg_atomic_read_u32(&templates_shared->generation) != templates_generation) ||
+		templates_fake_func != sr_plan_fake_func() ||
+		templates_auto_parameterize != sr_plan_auto_parameterize ||
+		templates_use_query_id != sr_plan_use_query_id)
+	{
+		templates_valid = false;
+		sr_plan_cache_reset();
+	}
+}
+
+/*
+ * Plan of the template for 'query_hash', if there is one.
+ */
+PlannedStmt *
+sr_plan_template_lookup(int32 query_hash, int32 *plan_hash)
+{
+	SrPlanTemplate *entry;
+	SrPlanTemplateRecord record;
+	FILE		   *file;
+	char		   *plan_text = NULL;
+	const char	   *missing;
+	bool			ok;
+
+	sr_plan_template_check();
+	if (!templates_valid)
+		templates_build();
+
+	if (templates == NULL)
+		return NULL;
+
+	entry = (SrPlanTemplate *) hash_search(templates, &query_hash,
+										   HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	file = open_templates();
+	if (file == NULL)
+	{
+		templates_valid = false;
+		return NULL;
+	}
+	ok = fseek(file, entry->offset, SEEK_SET) == 0 && read_record(file, &record);
+	FreeFile(file);
+
+	if (ok)
+	{
+		plan_text = sr_plan_remap_plan(record.plan, record.objects,
+									   record.nobjects, template_objects,
+									   &missing, NULL);
+
+		/* The file could be saved again by a backend of another database */
+		ok = plan_text != NULL &&
+			DatumGetInt32(hash_any((unsigned char *) plan_text,
+								   strlen(plan_text))) == entry->plan_hash;
+	}
+
+	if (!ok)
+	{
+		templates_valid = false;
+		return NULL;
+	}
+
+	*plan_hash = entry->plan_hash;
+	return (PlannedStmt *) stringToNode(plan_text);
+}
+
+/*
+ * Forget templates if 'relid' used by them is changed. Cached plans using it
+ * are evicted by the plan cache itself, all of them only if every relation
+ * could be changed.
+ */
+void
+sr_plan_template_relcache(Oid relid)
+{
+	if (!templates_valid)
+		return;
+
+	if (relid == InvalidOid)
+	{
+		templates_valid = false;
+		sr_plan_cache_reset();
+	}
+	else if (bsearch(&relid, template_relations, ntemplate_relations,
+					 sizeof(Oid), oid_cmp) != NULL)
+		templates_valid = false;
+}
+
+/*
+ * sr_plan_template_save() RETURNS bigint
+ *
+ * Replace templates with enabled plans of the current database.
+ */
+Datum
+sr_plan_template_save(PG_FUNCTION_ARGS)
+{
+	Oid				sr_plans_oid = sr_plan_plans_relid();
+	uint32			header[2] = {SR_PLAN_TEMPLATES_MAGIC,
+								 SR_PLAN_TEMPLATES_VERSION};
+	Relation		sr_plans_heap;
+	TupleDesc		tupdesc;
+	Snapshot		snapshot;
+	HeapTuple		htup;
+	MemoryContext	tmpcontext;
+	MemoryContext	oldcontext;
+	LOCKTAG			tag;
+	FILE		   *file;
+	int64			count = 0;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc	scan;
+#else
+	HeapScanDesc	scan;
+#endif
+
+	if (!OidIsValid(sr_plans_oid))
+		elog(ERROR, "sr_plan extension installed incorrectly");
+
+	/* Saves of all databases share the temporary file */
+	SET_LOCKTAG_TEMPLATES(tag);
+	(void) LockAcquire(&tag, ExclusiveLock, false, false);
+
+	file = AllocateFile(SR_PLAN_TEMPLATES_TMP_FILE, PG_BINARY_W);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m",
+						SR_PLAN_TEMPLATES_TMP_FILE)));
+	fwrite(header, sizeof(header), 1, file);
+
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "sr_plan template save",
+									   ALLOCSET_DEFAULT_SIZES);
+
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(sr_plans_oid, AccessShareLock);
+#else
+	sr_plans_heap = heap_open(sr_plans_oid, AccessShareLock);
+#endif
+	tupdesc = RelationGetDescr(sr_plans_heap);
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#else
+	scan = heap_beginscan(sr_plans_heap, snapshot, 0, NULL);
+#endif
+	while ((htup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum		value;
+		bool		isnull;
+		char	   *plan_text;
+		List	   *names;
+		uint32		nnames;
+		ListCell   *lc;
+
+		value = heap_getattr(htup, Anum_sr_enable, tupdesc, &isnull);
+		if (isnull || !DatumGetBool(value))
+			continue;
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+
+		value = heap_getattr(htup, Anum_sr_query, tupdesc, &isnull);
+		write_string(file, TextDatumGetCString(value));
+
+		value = heap_getattr(htup, Anum_sr_plan, tupdesc, &isnull);
+		plan_text = TextDatumGetCString(value);
+		write_string(file, plan_text);
+
+		names = sr_plan_export_names(plan_text);
+		nnames = list_length(names);
+		fwrite(&nnames, sizeof(nnames), 1, file);
+		foreach(lc, names)
+			write_string(file, (char *) lfirst(lc));
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(tmpcontext);
+		count++;
+	}
+#if PG_VERSION_NUM >= 120000
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+
+	UnregisterSnapshot(snapshot);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, AccessShareLock);
+#else
+	heap_close(sr_plans_heap, AccessShareLock);
+#endif
+	MemoryContextDelete(tmpcontext);
+
+	if (ferror(file) || FreeFile(file))
+	{
+		unlink(SR_PLAN_TEMPLATES_TMP_FILE);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						SR_PLAN_TEMPLATES_TMP_FILE)));
+	}
+
+	(void) durable_rename(SR_PLAN_TEMPLATES_TMP_FILE, SR_PLAN_TEMPLATES_FILE,
+						  ERROR);
+
+	if (templates_shared)
+		pg_atomic_fetch_add_u32(&templates_shared->generation, 1);
+	templates_valid = false;
+	sr_plan_cache_reset();
+
+	PG_RETURN_INT64(count);
+}
@@ -0,0 +1,840 @@
+/*
+ * query_hash.c
+ *		Computation of query_hash.
+ *
+ * Query tree is walked directly and its fields are fed into a small buffer
+ * which is hashed each time it is filled up, much like pg_stat_statements
+ * jumbles queries. Arguments of _p() inside FROM and WHERE clauses are
+ * replaced by a placeholder, locations are ignored except the ones of _p()
+ * since parameters are restored by them. In sr_plan.auto_parameterize mode
+ * constant operands of operators in these clauses are hashed by location too,
+ * they are replaced by parameters of the frozen plan. Node types not known
+ * here make us fall back to hashing of nodeToString() output.
+ */
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "utils/memutils.h"
+#include "miscadmin.h"
+#if PG_VERSION_NUM >= 160000
+#include "parser/parse_relation.h"
+#endif
+
+#define QUERY_HASH_BUFFER_SIZE	1024
+
+bool	sr_plan_use_query_id = false;
+bool	sr_plan_auto_parameterize = false;
+
+typedef struct QueryHashState
+{
+	Oid				fake_func;
+	bool			in_jointree;	/* _p() arguments are placeholders */
+	bool			literals;		/* and literals in operators too */
+	bool			consts_only;	/* only values and placeholders matter */
+	Size			len;
+	unsigned char	buffer[QUERY_HASH_BUFFER_SIZE];
+} QueryHashState;
+
+static bool hash_node(QueryHashState *st, Node *node);
+static bool hash_query(QueryHashState *st, Query *query, bool with_params);
+
+static void
+hash_append(QueryHashState *st, const unsigned char *item, Size size)
+{
+	while (size > 0)
+	{
+		Size		part;
+
+		if (st->len >= QUERY_HASH_BUFFER_SIZE)
+		{
+			uint32		start_hash;
+
+			start_hash = DatumGetUInt32(hash_any(st->buffer,
+												 QUERY_HASH_BUFFER_SIZE));
+			memcpy(st->buffer, &start_hash, sizeof(start_hash));
+			st->len = sizeof(start_hash);
+		}
+
+		part = Min(size, QUERY_HASH_BUFFER_SIZE - st->len);
+		memcpy(st->buffer + st->len, item, part);
+		st->len += part;
+		item += part;
+		size -= part;
+	}
+}
+
+/* Values always take part in the hash */
+#define APP_VALUE(item) \
+	hash_append(st, (const unsigned char *) &(item), sizeof(item))
+
+/* Structure of the query is skipped if it's known by queryId */
+#define APP_HASH(item) \
+	do { \
+		if (!st->consts_only) \
+			APP_VALUE(item); \
+	} while (0)
+
+#define APP_HASH_STRING(str) \
+	do { \
+		if (!st->consts_only && (str) != NULL) \
+			hash_append(st, (const unsigned char *) (str), strlen(str) + 1); \
+	} while (0)
+
+#define HASH_NODE(node) \
+	do { \
+		if (hash_node(st, (Node *) (node))) \
+			return true; \
+	} while (0)
+
+static void
+hash_const(QueryHashState *st, Const *c)
+{
+	APP_VALUE(c->consttype);
+	APP_VALUE(c->consttypmod);
+	APP_VALUE(c->constcollid);
+	APP_VALUE(c->constisnull);
+
+	if (c->constisnull)
+		return;
+
+	if (c->constbyval)
+		APP_VALUE(c->constvalue);
+	else
+		hash_append(st, (const unsigned char *) DatumGetPointer(c->constvalue),
+					datumGetSize(c->constvalue, false, c->constlen));
+}
+
+/*
+ * Hash arguments of an operator, literals of FROM and WHERE clauses are
+ * restored by location. Elements of an array compared by ANY or ALL are
+ * operands as well.
+ */
+static bool
+hash_operands(QueryHashState *st, List *args, bool in_array)
+{
+	NodeTag		tag = T_List;
+	ListCell   *lc;
+
+	if (!st->literals || !st->in_jointree)
+		return hash_node(st, (Node *) args);
+
+	APP_HASH(tag);
+	foreach(lc, args)
+	{
+		Node	   *arg = (Node *) lfirst(lc);
+
+		if (sr_plan_is_literal(arg))
+		{
+			Const	   *c = (Const *) arg;
+
+			tag = T_Const;
+			APP_HASH(tag);
+			APP_VALUE(c->consttype);
+			APP_VALUE(c->consttypmod);
+			APP_VALUE(c->constcollid);
+			APP_VALUE(c->location);
+		}
+		else if (in_array && IsA(arg, ArrayExpr))
+		{
+			ArrayExpr  *arr = (ArrayExpr *) arg;
+
+			tag = T_ArrayExpr;
+			APP_HASH(tag);
+			APP_HASH(arr->array_typeid);
+			APP_HASH(arr->array_collid);
+			APP_HASH(arr->element_typeid);
+			APP_HASH(arr->multidims);
+			if (hash_operands(st, arr->elements, false))
+				return true;
+		}
+		else
+			HASH_NODE(arg);
+	}
+
+	return false;
+}
+
+static bool
+hash_range_table(QueryHashState *st, Query *query, bool with_params)
+{
+	ListCell   *lc;
+
+	foreach(lc, query->rtable)
+	{
+		RangeTblEntry  *rte = (RangeTblEntry *) lfirst(lc);
+
+		APP_HASH(rte->rtekind);
+		APP_HASH(rte->lateral);
+		APP_HASH(rte->inh);
+#if PG_VERSION_NUM >= 160000
+		/* permissions are kept apart from range table since 16 */
+		APP_HASH(rte->perminfoindex);
+		if (rte->perminfoindex != 0)
+		{
+			RTEPermissionInfo *perminfo = getRTEPermissionInfo(query->rteperminfos,
+															   rte);
+
+			APP_HASH(perminfo->requiredPerms);
+			APP_HASH(perminfo->checkAsUser);
+		}
+#else
+		APP_HASH(rte->requiredPerms);
+		APP_HASH(rte->checkAsUser);
+#endif
+		HASH_NODE(rte->securityQuals);
+
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+				if (rte->tablesample)
+					return true;
+				APP_HASH(rte->relid);
+				APP_HASH(rte->relkind);
+				break;
+
+			case RTE_SUBQUERY:
+				APP_HASH(rte->security_barrier);
+				/* _p() are collected in subqueries of FROM clause too */
+				if (hash_query(st, rte->subquery, with_params))
+					return true;
+				break;
+
+			case RTE_JOIN:
+				APP_HASH(rte->jointype);
+				HASH_NODE(rte->joinaliasvars);
+				break;
+
+			case RTE_FUNCTION:
+				HASH_NODE(rte->functions);
+				APP_HASH(rte->funcordinality);
+				break;
+
+			case RTE_VALUES:
+				HASH_NODE(rte->values_lists);
+				break;
+
+			case RTE_CTE:
+				APP_HASH_STRING(rte->ctename);
+				APP_HASH(rte->ctelevelsup);
+				APP_HASH(rte->self_reference);
+				break;
+
+			default:
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * 'with_params' is true for queries which _p() are collected from,
+ * that is for the top level query and subqueries in its FROM clause.
+ */
+static bool
+hash_query(QueryHashState *st, Query *query, bool with_params)
+{
+	bool	saved_in_jointree = st->in_jointree;
+
+	if (query->utilityStmt || query->onConflict || query->groupingSets ||
+		query->withCheckOptions)
+		return true;
+
+	APP_HASH(query->commandType);
+	APP_HASH(query->resultRelation);
+	APP_HASH(query->hasAggs);
+	APP_HASH(query->hasWindowFuncs);
+	APP_HASH(query->hasSubLinks);
+	APP_HASH(query->hasDistinctOn);
+	APP_HASH(query->hasRecursive);
+	APP_HASH(query->hasModifyingCTE);
+	APP_HASH(query->hasForUpdate);
+#if PG_VERSION_NUM >= 100000
+	APP_HASH(query->hasTargetSRFs);
+#endif
+#if PG_VERSION_NUM >= 130000
+	APP_HASH(query->limitOption);
+#endif
+
+	st->in_jointree = false;
+	HASH_NODE(query->cteList);
+	if (hash_range_table(st, query, with_params))
+		return true;
+
+	st->in_jointree = with_params;
+	HASH_NODE(query->jointree);
+	st->in_jointree = false;
+
+	HASH_NODE(query->targetList);
+	HASH_NODE(query->returningList);
+	HASH_NODE(query->groupClause);
+	HASH_NODE(query->havingQual);
+	HASH_NODE(query->windowClause);
+	HASH_NODE(query->distinctClause);
+	HASH_NODE(query->sortClause);
+	HASH_NODE(query->limitOffset);
+	HASH_NODE(query->limitCount);
+	HASH_NODE(query->rowMarks);
+	HASH_NODE(query->setOperations);
+	HASH_NODE(query->constraintDeps);
+
+	st->in_jointree = saved_in_jointree;
+	return false;
+}
+
+/*
+ * Returns true if 'node' contains something we don't know how to hash.
+ */
+static bool
+hash_node(QueryHashState *st, Node *node)
+{
+	NodeTag		tag;
+	ListCell   *lc;
+
+	if (node == NULL)
+	{
+		tag = T_Invalid;
+		APP_HASH(tag);
+		return false;
+	}
+
+	check_stack_depth();
+
+	tag = nodeTag(node);
+	APP_HASH(tag);
+
+	switch (tag)
+	{
+		case T_List:
+			foreach(lc, (List *) node)
+				HASH_NODE(lfirst(lc));
+			break;
+
+		case T_IntList:
+			foreach(lc, (List *) node)
+			{
+				int		value = lfirst_int(lc);
+
+				APP_HASH(value);
+			}
+			break;
+
+		case T_OidList:
+			foreach(lc, (List *) node)
+			{
+				Oid		value = lfirst_oid(lc);
+
+				APP_HASH(value);
+			}
+			break;
+
+		case T_String:
+			APP_HASH_STRING(strVal(node));
+			break;
+
+		case T_Query:
+			{
+				bool	saved_in_jointree = st->in_jointree;
+
+				/* _p() are not collected in sublinks and CTEs */
+				st->in_jointree = false;
+				if (hash_query(st, (Query *) node, false))
+					return true;
+				st->in_jointree = saved_in_jointree;
+			}
+			break;
+
+		case T_RangeTblRef:
+			APP_HASH(((RangeTblRef *) node)->rtindex);
+			break;
+
+		case T_FromExpr:
+			{
+				FromExpr   *from = (FromExpr *) node;
+
+				HASH_NODE(from->fromlist);
+				HASH_NODE(from->quals);
+			}
+			break;
+
+		case T_JoinExpr:
+			{
+				JoinExpr   *join = (JoinExpr *) node;
+
+				APP_HASH(join->jointype);
+				APP_HASH(join->isNatural);
+				APP_HASH(join->rtindex);
+				HASH_NODE(join->larg);
+				HASH_NODE(join->rarg);
+				HASH_NODE(join->quals);
+			}
+			break;
+
+		case T_RangeTblFunction:
+			{
+				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+
+				APP_HASH(rtfunc->funccolcount);
+				HASH_NODE(rtfunc->funcexpr);
+				HASH_NODE(rtfunc->funccoltypes);
+				HASH_NODE(rtfunc->funccoltypmods);
+				HASH_NODE(rtfunc->funccolcollations);
+			}
+			break;
+
+		case T_TargetEntry:
+			{
+				TargetEntry *tle = (TargetEntry *) node;
+
+				APP_HASH(tle->resno);
+				APP_HASH(tle->ressortgroupref);
+				APP_HASH(tle->resjunk);
+				APP_HASH_STRING(tle->resname);
+				HASH_NODE(tle->expr);
+			}
+			break;
+
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				APP_HASH(var->varno);
+				APP_HASH(var->varattno);
+				APP_HASH(var->vartype);
+				APP_HASH(var->vartypmod);
+				APP_HASH(var->varcollid);
+				APP_HASH(var->varlevelsup);
+			}
+			break;
+
+		case T_Const:
+			hash_const(st, (Const *) node);
+			break;
+
+		case T_Param:
+			{
+				Param	   *param = (Param *) node;
+
+				APP_HASH(param->paramkind);
+				APP_HASH(param->paramid);
+				APP_HASH(param->paramtype);
+				APP_HASH(param->paramtypmod);
+				APP_HASH(param->paramcollid);
+			}
+			break;
+
+		case T_Aggref:
+			{
+				Aggref	   *agg = (Aggref *) node;
+
+				APP_HASH(agg->aggfnoid);
+				APP_HASH(agg->aggtype);
+				APP_HASH(agg->aggcollid);
+				APP_HASH(agg->inputcollid);
+				APP_HASH(agg->aggstar);
+				APP_HASH(agg->aggvariadic);
+				APP_HASH(agg->aggkind);
+				APP_HASH(agg->agglevelsup);
+				APP_HASH(agg->aggsplit);
+				HASH_NODE(agg->aggdirectargs);
+				HASH_NODE(agg->args);
+				HASH_NODE(agg->aggorder);
+				HASH_NODE(agg->aggdistinct);
+				HASH_NODE(agg->aggfilter);
+			}
+			break;
+
+		case T_WindowFunc:
+			{
+				WindowFunc *wfunc = (WindowFunc *) node;
+
+				APP_HASH(wfunc->winfnoid);
+				APP_HASH(wfunc->wintype);
+				APP_HASH(wfunc->wincollid);
+				APP_HASH(wfunc->inputcollid);
+				APP_HASH(wfunc->winref);
+				APP_HASH(wfunc->winstar);
+				APP_HASH(wfunc->winagg);
+				HASH_NODE(wfunc->args);
+				HASH_NODE(wfunc->aggfilter);
+			}
+			break;
+
+		case T_FuncExpr:
+			{
+				FuncExpr   *func = (FuncExpr *) node;
+
+				APP_HASH(func->funcid);
+				APP_HASH(func->funcresulttype);
+
+				if (func->funcid == st->fake_func && st->in_jointree)
+				{
+					/* argument is restored by location of _p() */
+					APP_VALUE(func->location);
+					break;
+				}
+
+				APP_HASH(func->funcretset);
+				APP_HASH(func->funcvariadic);
+				APP_HASH(func->funcformat);
+				APP_HASH(func->funccollid);
+				APP_HASH(func->inputcollid);
+				HASH_NODE(func->args);
+			}
+			break;
+
+		case T_NamedArgExpr:
+			{
+				NamedArgExpr *na = (NamedArgExpr *) node;
+
+				APP_HASH(na->argnumber);
+				HASH_NODE(na->arg);
+			}
+			break;
+
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			{
+				OpExpr	   *op = (OpExpr *) node;
+
+				APP_HASH(op->opno);
+				APP_HASH(op->opresulttype);
+				APP_HASH(op->opretset);
+				APP_HASH(op->opcollid);
+				APP_HASH(op->inputcollid);
+				if (hash_operands(st, op->args, false))
+					return true;
+			}
+			break;
+
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) node;
+
+				APP_HASH(saop->opno);
+				APP_HASH(saop->useOr);
+				APP_HASH(saop->inputcollid);
+				if (hash_operands(st, saop->args, true))
+					return true;
+			}
+			break;
+
+		case T_BoolExpr:
+			APP_HASH(((BoolExpr *) node)->boolop);
+			HASH_NODE(((BoolExpr *) node)->args);
+			break;
+
+		case T_SubLink:
+			{
+				SubLink    *sublink = (SubLink *) node;
+
+				APP_HASH(sublink->subLinkType);
+				APP_HASH(sublink->subLinkId);
+				HASH_NODE(sublink->testexpr);
+				HASH_NODE(sublink->subselect);
+			}
+			break;
+
+		case T_FieldSelect:
+			{
+				FieldSelect *fs = (FieldSelect *) node;
+
+				APP_HASH(fs->fieldnum);
+				APP_HASH(fs->resulttype);
+				APP_HASH(fs->resulttypmod);
+				APP_HASH(fs->resultcollid);
+				HASH_NODE(fs->arg);
+			}
+			break;
+
+		case T_RelabelType:
+			{
+				RelabelType *rt = (RelabelType *) node;
+
+				APP_HASH(rt->resulttype);
+				APP_HASH(rt->resulttypmod);
+				APP_HASH(rt->resultcollid);
+				APP_HASH(rt->relabelformat);
+				HASH_NODE(rt->arg);
+			}
+			break;
+
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *cio = (CoerceViaIO *) node;
+
+				APP_HASH(cio->resulttype);
+				APP_HASH(cio->resultcollid);
+				APP_HASH(cio->coerceformat);
+				HASH_NODE(cio->arg);
+			}
+			break;
+
+		case T_CollateExpr:
+			APP_HASH(((CollateExpr *) node)->collOid);
+			HASH_NODE(((CollateExpr *) node)->arg);
+			break;
+
+		case T_CaseExpr:
+			{
+				CaseExpr   *caseexpr = (CaseExpr *) node;
+
+				APP_HASH(caseexpr->casetype);
+				APP_HASH(caseexpr->casecollid);
+				HASH_NODE(caseexpr->arg);
+				HASH_NODE(caseexpr->args);
+				HASH_NODE(caseexpr->defresult);
+			}
+			break;
+
+		case T_CaseWhen:
+			HASH_NODE(((CaseWhen *) node)->expr);
+			HASH_NODE(((CaseWhen *) node)->result);
+			break;
+
+		case T_CaseTestExpr:
+			{
+				CaseTestExpr *ct = (CaseTestExpr *) node;
+
+				APP_HASH(ct->typeId);
+				APP_HASH(ct->typeMod);
+				APP_HASH(ct->collation);
+			}
+			break;
+
+		case T_ArrayExpr:
+			{
+				ArrayExpr  *arr = (ArrayExpr *) node;
+
+				APP_HASH(arr->array_typeid);
+				APP_HASH(arr->array_collid);
+				APP_HASH(arr->element_typeid);
+				APP_HASH(arr->multidims);
+				HASH_NODE(arr->elements);
+			}
+			break;
+
+		case T_RowExpr:
+			{
+				RowExpr    *row = (RowExpr *) node;
+
+				APP_HASH(row->row_typeid);
+				APP_HASH(row->row_format);
+				HASH_NODE(row->args);
+				HASH_NODE(row->colnames);
+			}
+			break;
+
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rc = (RowCompareExpr *) node;
+
+				APP_HASH(rc->rctype);
+				HASH_NODE(rc->opnos);
+				HASH_NODE(rc->opfamilies);
+				HASH_NODE(rc->inputcollids);
+				HASH_NODE(rc->largs);
+				HASH_NODE(rc->rargs);
+			}
+			break;
+
+		case T_CoalesceExpr:
+			APP_HASH(((CoalesceExpr *) node)->coalescetype);
+			APP_HASH(((CoalesceExpr *) node)->coalescecollid);
+			HASH_NODE(((CoalesceExpr *) node)->args);
+			break;
+
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mm = (MinMaxExpr *) node;
+
+				APP_HASH(mm->minmaxtype);
+				APP_HASH(mm->minmaxcollid);
+				APP_HASH(mm->inputcollid);
+				APP_HASH(mm->op);
+				HASH_NODE(mm->args);
+			}
+			break;
+
+		case T_NullTest:
+			APP_HASH(((NullTest *) node)->nulltesttype);
+			APP_HASH(((NullTest *) node)->argisrow);
+			HASH_NODE(((NullTest *) node)->arg);
+			break;
+
+		case T_BooleanTest:
+			APP_HASH(((BooleanTest *) node)->booltesttype);
+			HASH_NODE(((BooleanTest *) node)->arg);
+			break;
+
+		case T_SortGroupClause:
+			{
+				SortGroupClause *sgc = (SortGroupClause *) node;
+
+				APP_HASH(sgc->tleSortGroupRef);
+				APP_HASH(sgc->eqop);
+				APP_HASH(sgc->sortop);
+				APP_HASH(sgc->nulls_first);
+				APP_HASH(sgc->hashable);
+			}
+			break;
+
+		case T_WindowClause:
+			{
+				WindowClause *wc = (WindowClause *) node;
+
+				APP_HASH(wc->winref);
+				APP_HASH(wc->frameOptions);
+				APP_HASH(wc->copiedOrder);
+				HASH_NODE(wc->partitionClause);
+				HASH_NODE(wc->orderClause);
+				HASH_NODE(wc->startOffset);
+				HASH_NODE(wc->endOffset);
+			}
+			break;
+
+		case T_CommonTableExpr:
+			{
+				CommonTableExpr *cte = (CommonTableExpr *) node;
+
+				APP_HASH_STRING(cte->ctename);
+				APP_HASH(cte->cterecursive);
+#if PG_VERSION_NUM >= 120000
+				APP_HASH(cte->ctematerialized);
+#endif
+				HASH_NODE(cte->ctequery);
+			}
+			break;
+
+		case T_SetOperationStmt:
+			{
+				SetOperationStmt *setop = (SetOperationStmt *) node;
+
+				APP_HASH(setop->op);
+				APP_HASH(setop->all);
+				HASH_NODE(setop->larg);
+				HASH_NODE(setop->rarg);
+				HASH_NODE(setop->colTypes);
+				HASH_NODE(setop->colTypmods);
+				HASH_NODE(setop->colCollations);
+				HASH_NODE(setop->groupClauses);
+			}
+			break;
+
+		case T_RowMarkClause:
+			{
+				RowMarkClause *rmc = (RowMarkClause *) node;
+
+				APP_HASH(rmc->rti);
+				APP_HASH(rmc->strength);
+				APP_HASH(rmc->waitPolicy);
+				APP_HASH(rmc->pushedDown);
+			}
+			break;
+
+		default:
+			return true;
+	}
+
+	return false;
+}
+
+static bool
+sr_query_fake_const_expr_walker(Node *node, void *context)
+{
+	FuncExpr   *fexpr = (FuncExpr *) node;
+	Oid			fake_func = *(Oid *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, FuncExpr) && fexpr->funcid == fake_func)
+	{
+		Const		   *fakeconst;
+
+		fakeconst = makeConst(23, -1,  0, 4, (Datum) 0, false, true);
+		fexpr->args = list_make1(fakeconst);
+	}
+
+	return expression_tree_walker(node, sr_query_fake_const_expr_walker, context);
+}
+
+static bool
+sr_query_fake_const_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	// check for nodes that special work is required for, eg:
+	if (IsA(node, FromExpr))
+		return sr_query_fake_const_expr_walker(node, context);
+
+	// for any node type not specially processed, do:
+	if (IsA(node, Query))
+	{
+		Query	*q = (Query *) node;
+		return query_tree_walker(q, sr_query_fake_const_walker, context, 0);
+	}
+
+	return false;
+}
+
+/*
+ * Slow path: hash the text representation of the query.
+ */
+static Datum
+get_query_hash_by_text(Query *node, Oid fake_func)
+{
+	Datum			result;
+	Node		   *copy;
+	MemoryContext	tmpctx,
+					oldctx;
+	char		   *temp;
+
+	tmpctx = AllocSetContextCreate(CurrentMemoryContext,
+									  "temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	oldctx = MemoryContextSwitchTo(tmpctx);
+	copy = copyObject((Node *) node);
+	sr_query_fake_const_walker(copy, &fake_func);
+	temp = nodeToString(copy);
+	result = hash_any((unsigned char *) temp, strlen(temp));
+	MemoryContextSwitchTo(oldctx);
+	MemoryContextDelete(tmpctx);
+
+	return result;
+}
+
+/*
+ * Compute query_hash of 'query', 'fake_func' is Oid of _p(). With 'literals'
+ * values of constants returned by sr_plan_is_literal() don't matter.
+ */
+Datum
+sr_query_hash(Query *query, Oid fake_func, bool literals)
+{
+	QueryHashState	st;
+
+	st.fake_func = fake_func;
+	st.in_jointree = false;
+	st.literals = literals;
+	st.consts_only = false;
+	st.len = 0;
+
+	/*
+	 * queryId computed by a jumbler already describes structure of the query,
+	 * but not its constants, which still have to be hashed by us.
+	 */
+	if (sr_plan_use_query_id && query->queryId != UINT64CONST(0))
+	{
+		uint64		query_id = query->queryId;
+
+		APP_VALUE(query_id);
+		st.consts_only = true;
+	}
+
+	if (hash_query(&st, query, true))
+		return get_query_hash_by_text(query, fake_func);
+
+	return hash_any(st.buffer, st.len);
+}
@@ -0,0 +1,37 @@
+CREATE EXTENSION sr_plan;
+
+CREATE TABLE test_table(test_attr1 int, test_attr2 int);
+INSERT INTO test_table SELECT i, i + 1 FROM generate_series(1, 20) i;
+
+SET sr_plan.write_mode = true;
+SELECT * FROM test_table WHERE test_attr1 = _p(10);
+SELECT * FROM test_table WHERE test_attr1 = 10;
+SELECT * FROM test_table WHERE test_attr1 = 15;
+SELECT test_attr1 AS a FROM test_table WHERE test_attr1 = 10;
+SELECT test_attr1 AS b FROM test_table WHERE test_attr1 = 10;
+SELECT * FROM test_table WHERE test_attr1 < 10 AND test_attr2 = 5;
+SELECT * FROM test_table WHERE test_attr1 > 10 AND test_attr2 = 5;
+SET sr_plan.write_mode = false;
+
+-- every query has a hash of its own
+SELECT count(*), count(DISTINCT query_hash) FROM sr_plans;
+
+-- recomputed from the text, as on upgrade, hashes stay the same
+SELECT count(*) FROM sr_plans
+WHERE query_hash IS DISTINCT FROM sr_plan_query_hash(query);
+UPDATE sr_plans SET enable = true;
+SET sr_plan.log_usage = NOTICE;
+
+-- neither _p() arguments nor layout of the query change the hash
+SELECT * FROM test_table WHERE test_attr1 = _p(15);
+SELECT * FROM test_table WHERE test_attr1 = _p(15)  ;
+SELECT  *  FROM  test_table  WHERE  test_attr1  =  10;
+select * from test_table where test_attr1 = 15;
+
+-- while constants, aliases and operators do
+SELECT * FROM test_table WHERE test_attr1 = 11;
+SELECT test_attr1 AS c FROM test_table WHERE test_attr1 = 10;
+SELECT * FROM test_table WHERE test_attr1 >= 10 AND test_attr2 = 5;
+
+DROP EXTENSION sr_plan CASCADE;
+DROP TABLE test_table;
@@ -21,6 +21,12 @@ SELECT * FROM test_table WHERE test_attr1 = _p(15);
 SELECT * FROM test_table WHERE test_attr1 = 10;
 SELECT * FROM test_table WHERE test_attr1 = 15;
 
+-- disabled plan must not be used from the backend cache
+UPDATE sr_plans SET enable = false WHERE query = 'SELECT * FROM test_table WHERE test_attr1 = 10;';
+SELECT * FROM test_table WHERE test_attr1 = 10;
+UPDATE sr_plans SET enable = true;
+SELECT * FROM test_table WHERE test_attr1 = 10;
+
 SELECT enable, query FROM sr_plans ORDER BY length(query);
 DROP TABLE test_table;
 SELECT enable, query FROM sr_plans ORDER BY length(query);
@@ -32,5 +38,16 @@ SELECT * FROM test_table WHERE test_attr1 = 10;
 SELECT * FROM test_table WHERE test_attr1 = 10;
 SELECT * FROM test_table WHERE test_attr1 = 15;
 
+-- plans filtered out by sr_plan.capture_* are not saved
+SET sr_plan.write_mode = true;
+SET sr_plan.capture_min_cost = 1e10;
+SELECT * FROM test_table WHERE test_attr2 = 1;
+SET sr_plan.capture_min_cost = 0;
+SET sr_plan.capture_sample_rate = 0;
+SELECT * FROM test_table WHERE test_attr2 = 2;
+RESET sr_plan.capture_sample_rate;
+SET sr_plan.write_mode = false;
+SELECT count(*) FROM sr_plans;
+
 DROP EXTENSION sr_plan CASCADE;
 DROP TABLE test_table;
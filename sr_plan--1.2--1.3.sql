@@ -0,0 +1,167 @@
+/* keep plans inline, so that lookups don't fetch them from TOAST */
+ALTER TABLE sr_plans ALTER COLUMN plan SET STORAGE MAIN;
+
+/* storage applies to new values only, so rewrite plans saved before */
+UPDATE sr_plans SET plan = plan || '';
+
+CREATE FUNCTION sr_plan_query_hash(query text)
+RETURNS int4
+AS 'MODULE_PATHNAME', 'sr_plan_query_hash'
+LANGUAGE C STRICT VOLATILE;
+
+/* query_hash is computed from the Query tree in another way since 1.3 */
+DO $$
+DECLARE
+	r		record;
+	hash	int4;
+	path	text := pg_catalog.current_setting('search_path');
+BEGIN
+	/*
+	 * Names in queries are resolved like in sessions which captured them,
+	 * rather than in this script, whose search_path is the schema of sr_plan.
+	 */
+	PERFORM pg_catalog.set_config('search_path',
+		pg_catalog.concat_ws(', ', NULLIF(reset_val, ''), '@extschema@'),
+		true)
+	FROM pg_catalog.pg_settings WHERE name = 'search_path';
+
+	FOR r IN SELECT ctid, query FROM @extschema@.sr_plans LOOP
+		BEGIN
+			hash := @extschema@.sr_plan_query_hash(r.query);
+		EXCEPTION WHEN OTHERS THEN
+			hash := NULL;
+		END;
+
+		IF hash IS NULL THEN
+			RAISE WARNING 'sr_plan: query_hash of plan for query "%" is not recomputed', r.query
+				USING HINT = 'The plan won''t be used, capture it again.';
+		ELSE
+			UPDATE @extschema@.sr_plans SET query_hash = hash
+			WHERE ctid = r.ctid;
+		END IF;
+	END LOOP;
+
+	PERFORM pg_catalog.set_config('search_path', path, true);
+END
+$$;
+
+CREATE FUNCTION sr_plan_invalidate_cache() RETURNS trigger
+AS 'MODULE_PATHNAME', 'sr_plan_invalidate_cache'
+LANGUAGE C;
+
+CREATE TRIGGER sr_plans_invalidate_cache
+	AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON sr_plans
+	FOR EACH STATEMENT EXECUTE PROCEDURE sr_plan_invalidate_cache();
+
+CREATE FUNCTION sr_plan_filter_add() RETURNS trigger
+AS 'MODULE_PATHNAME', 'sr_plan_filter_add'
+LANGUAGE C;
+
+CREATE TRIGGER sr_plans_filter_add
+	AFTER INSERT OR UPDATE ON sr_plans
+	FOR EACH ROW WHEN (NEW.enable) EXECUTE PROCEDURE sr_plan_filter_add();
+
+CREATE FUNCTION sr_plan_skipped_lookups()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'sr_plan_skipped_lookups'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sr_plan_stats(
+	OUT dbid				oid,
+	OUT query_hash			int4,
+	OUT plan_hash			int4,
+	OUT hits				int8,
+	OUT misses				int8,
+	OUT captures			int8,
+	OUT total_lookup_time	float8,
+	OUT max_lookup_time		float8,
+	OUT deserialize_time	float8,
+	OUT plan_bytes			int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sr_plan_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW sr_plan_stats AS SELECT * FROM sr_plan_stats();
+
+CREATE FUNCTION sr_plan_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'sr_plan_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION sr_plan_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION sr_plan_prewarm(
+	OUT plans		int8,
+	OUT bytes		int8,
+	OUT load_time	float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sr_plan_prewarm'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sr_plan_export_objects(plan text)
+RETURNS text[]
+AS 'MODULE_PATHNAME', 'sr_plan_export_objects'
+LANGUAGE C STRICT STABLE;
+
+CREATE FUNCTION sr_plan_export(
+	OUT query		text,
+	OUT enable		boolean,
+	OUT plan		text,
+	OUT objects		text[])
+RETURNS SETOF record
+AS $$
+	SELECT p.query::text, p.enable, p.plan,
+		   @extschema@.sr_plan_export_objects(p.plan)
+	FROM @extschema@.sr_plans p
+$$ LANGUAGE sql STABLE;
+
+CREATE FUNCTION sr_plan_import_plan(
+	query				text,
+	plan				text,
+	objects				text[],
+	OUT query_hash		int4,
+	OUT query_id		int8,
+	OUT plan_hash		int4,
+	OUT plan			text,
+	OUT reloids			oid[],
+	OUT index_reloids	oid[])
+RETURNS record
+AS 'MODULE_PATHNAME', 'sr_plan_import_plan'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sr_plan_import(plans regclass)
+RETURNS bigint
+LANGUAGE plpgsql AS $$
+DECLARE
+	imported	bigint;
+BEGIN
+	EXECUTE format('INSERT INTO @extschema@.sr_plans
+		SELECT i.query_hash, i.query_id, i.plan_hash, p.enable, p.query,
+			   i.plan, i.reloids, i.index_reloids
+		FROM %s p,
+			 LATERAL @extschema@.sr_plan_import_plan(p.query, p.plan, p.objects) i
+		WHERE i.query_hash IS NOT NULL AND NOT EXISTS (
+			SELECT 1 FROM @extschema@.sr_plans s
+			WHERE s.query_hash = i.query_hash AND s.plan_hash = i.plan_hash)',
+		plans);
+	GET DIAGNOSTICS imported = ROW_COUNT;
+	RETURN imported;
+END
+$$;
+
+CREATE FUNCTION sr_plan_template_save()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'sr_plan_template_save'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION sr_plan_template_save() FROM PUBLIC;
+
+/* plans of dropped relations are deleted at once since 1.3 */
+DROP FUNCTION sr_plan_invalid_table() CASCADE;
+
+CREATE FUNCTION sr_plan_invalid_table() RETURNS event_trigger
+AS 'MODULE_PATHNAME', 'sr_plan_invalid_table'
+LANGUAGE C;
+
+CREATE EVENT TRIGGER sr_plan_invalid_table ON sql_drop
+    EXECUTE PROCEDURE sr_plan_invalid_table();
@@ -1,7 +1,14 @@
+#include <float.h>
+
 #include "sr_plan.h"
 #include "commands/defrem.h"
 #include "commands/event_trigger.h"
 #include "commands/extension.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
+#include "parser/parsetree.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_extension.h"
 #include "catalog/indexing.h"
 #include "access/sysattr.h"
@@ -9,6 +16,18 @@
 #include "access/hash.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "port/atomics.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "rewrite/rewriteHandler.h"
+#include "tcop/tcopprot.h"
 #include "miscadmin.h"
 
 #if PG_VERSION_NUM >= 100000
@@ -25,18 +44,28 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(do_nothing);
 PG_FUNCTION_INFO_V1(show_plan);
 PG_FUNCTION_INFO_V1(_p);
+PG_FUNCTION_INFO_V1(sr_plan_invalidate_cache);
+PG_FUNCTION_INFO_V1(sr_plan_invalid_table);
+PG_FUNCTION_INFO_V1(sr_plan_skipped_lookups);
+PG_FUNCTION_INFO_V1(sr_plan_query_hash);
 
 void _PG_init(void);
 void _PG_fini(void);
 
 static planner_hook_type srplan_planner_hook_next = NULL;
 post_parse_analyze_hook_type srplan_post_parse_analyze_hook_next = NULL;
+static shmem_startup_hook_type srplan_shmem_startup_hook_next = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type srplan_shmem_request_hook_next = NULL;
+#endif
 
 typedef struct SrPlanCachedInfo {
 	bool	enabled;
 	bool	write_mode;
 	bool	explain_query;
 	int		log_usage;
+	int		capture_mode;
+	bool	lookup_nowait;
 	Oid		fake_func;
 	Oid		schema_oid;
 	Oid		sr_plans_oid;
@@ -46,6 +75,12 @@ typedef struct SrPlanCachedInfo {
 	const char   *query_text;
 } SrPlanCachedInfo;
 
+/* Counters shared by all backends */
+typedef struct SrPlanSharedState {
+	pg_atomic_uint64	skipped_lookups;
+	pg_atomic_uint64	sr_plans_changes;	/* see sr_plans_changed() */
+} SrPlanSharedState;
+
 typedef struct show_plan_funcctx {
 	ExplainFormat	format;
 	char		   *output;
@@ -57,6 +92,8 @@ static SrPlanCachedInfo cachedInfo = {
 	false,			/* write_mode */
 	false,			/* explain_query */
 	0,				/* log_usage */
+	SR_PLAN_CAPTURE_SYNC,	/* capture_mode */
+	false,			/* lookup_nowait */
 	0,				/* fake_func */
 	InvalidOid,		/* schema_oid */
 	InvalidOid,		/* sr_plans_reloid */
@@ -66,12 +103,55 @@ static SrPlanCachedInfo cachedInfo = {
 	NULL
 };
 
+static SrPlanSharedState *shared_state = NULL;
+
+/* sr_plans_changes when the plan cache was reset */
+static uint64 seen_sr_plans_changes = 0;
+static uint64 seen_known_plans_changes = 0;
+static bool count_change_at_commit = false;
+
+/* sr_plan_invalid_table() is deleting plans of dropped relations */
+static bool deleting_dropped_plans = false;
+
+/* sr_plans cached plans were read from */
+static Oid cache_sr_plans_oid = InvalidOid;
+
+/* sr_plan.capture_* filters of write_mode */
+static double	capture_min_duration = 0.0;
+static double	capture_min_cost = 0.0;
+static double	capture_sample_rate = 1.0;
+static int		capture_max_per_second = 0;
+
+/* sr_plan.prewarm */
+static bool		prewarm_on_start = false;
+static bool		prewarm_done = false;
+
+/* used if sr_plan is not in shared_preload_libraries */
+static uint64 local_skipped_lookups = 0;
+
+/* depth of sr_planner() calls */
+static int		planner_level = 0;
+
+/*
+ * Before 13 the text of a statement planned inside of planning of another
+ * one is unknown, so only top level statements could be captured.
+ */
+#if PG_VERSION_NUM >= 130000
+#define capture_allowed()	(cachedInfo.write_mode)
+#else
+#define capture_allowed()	(cachedInfo.write_mode && planner_level == 1)
+#endif
+
 #if PG_VERSION_NUM >= 130000
 static PlannedStmt *sr_planner(Query *parse, const char *query_string,
 								int cursorOptions, ParamListInfo boundParams);
+static PlannedStmt *sr_planner_internal(Query *parse, const char *query_string,
+								int cursorOptions, ParamListInfo boundParams);
 #else
 static PlannedStmt *sr_planner(Query *parse, int cursorOptions,
 								ParamListInfo boundParams);
+static PlannedStmt *sr_planner_internal(Query *parse, int cursorOptions,
+								ParamListInfo boundParams);
 #endif
 
 static void sr_analyze(ParseState *pstate, Query *query);
@@ -80,19 +160,20 @@ static Oid get_sr_plan_schema(void);
 static Oid sr_get_relname_oid(Oid schema_oid, const char *relname);
 static bool sr_query_walker(Query *node, void *context);
 static bool sr_query_expr_walker(Node *node, void *context);
+static bool extern_params_walker(Node *node, void *context);
+static List *number_literals(List *literals, bool replace);
 void walker_callback(void *node);
 static void sr_plan_relcache_hook(Datum arg, Oid relid);
 
-static void plan_tree_visitor(Plan *plan,
-				  void (*visitor) (Plan *plan, void *context),
-				  void *context);
-static void execute_for_plantree(PlannedStmt *planned_stmt,
-					 void (*proc) (void *context, Plan *plan),
-					 void *context);
 static void restore_params(void *context, Plan *plan);
-static Datum get_query_hash(Query *node);
 static void collect_indexid(void *context, Plan *plan);
 
+/*
+ * field4 of advisory locktags taken by sr_plan, pg_advisory_lock()
+ * uses 1 and 2.
+ */
+#define SR_PLAN_LOCKTAG_CAPTURE		3
+
 struct QueryParam
 {
 	int location;
@@ -100,10 +181,20 @@ struct QueryParam
 	void *node;
 };
 
+/* Literal of the query in sr_plan.auto_parameterize mode */
+struct QueryLiteral
+{
+	int		location;
+	Const  *value;
+	Node  **ref;				/* where it is in the query */
+};
+
 struct QueryParamsContext
 {
 	bool	collect;
 	List   *params;
+	bool	with_literals;
+	List   *literals;
 };
 
 struct IndexIds
@@ -111,10 +202,21 @@ struct IndexIds
 	List   *ids;
 };
 
+/* Filled by lookup_plan_by_query_hash() for sr_plan_stats */
+struct FrozenPlanInfo
+{
+	int32	plan_hash;
+	int64	plan_bytes;
+	double	deserialize_time;	/* in msec */
+};
+
 List *query_params;
 
+/*
+ * Forget Oids of sr_plan objects, they are looked up again on next use.
+ */
 static void
-invalidate_oids(void)
+reset_oids(void)
 {
 	cachedInfo.schema_oid = InvalidOid;
 	cachedInfo.sr_plans_oid = InvalidOid;
@@ -124,6 +226,89 @@ invalidate_oids(void)
 	cachedInfo.index_reloids_index_oid = InvalidOid;
 }
 
+static void
+invalidate_oids(void)
+{
+	reset_oids();
+
+	/* Cached and known plans could be changed or removed from sr_plans */
+	sr_plan_cache_reset();
+	if (shared_state)
+	{
+		seen_sr_plans_changes = pg_atomic_read_u64(&shared_state->sr_plans_changes);
+		seen_known_plans_changes = seen_sr_plans_changes;
+	}
+}
+
+/*
+ * Plans deleted by sr_plan_invalid_table() don't invalidate sr_plans in
+ * relcache, so known plans are forgotten on invalidation of the dropped
+ * relations if sr_plans has been changed since they were last forgotten.
+ */
+static void
+check_known_plans(void)
+{
+	uint64		changes;
+
+	if (shared_state == NULL)
+	{
+		sr_plan_forget_plans();
+		return;
+	}
+
+	changes = pg_atomic_read_u64(&shared_state->sr_plans_changes);
+	if (changes != seen_known_plans_changes)
+	{
+		sr_plan_forget_plans();
+		seen_known_plans_changes = changes;
+	}
+}
+
+/*
+ * Return true if sr_plans of any database could be changed since the plan
+ * cache was reset. Every change is counted both by the trigger and at
+ * commit, before invalidation messages are sent, so a change committed
+ * after the reset is never missed. Changes committed by COMMIT PREPARED are
+ * counted by the trigger only.
+ */
+static bool
+sr_plans_changed(void)
+{
+	return shared_state == NULL ||
+		pg_atomic_read_u64(&shared_state->sr_plans_changes) != seen_sr_plans_changes;
+}
+
+static void
+sr_plans_change_callback(XactEvent event, void *arg)
+{
+	if (!count_change_at_commit)
+		return;
+
+	if (event == XACT_EVENT_COMMIT)
+		pg_atomic_fetch_add_u64(&shared_state->sr_plans_changes, 1);
+
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+		event == XACT_EVENT_PREPARE)
+		count_change_at_commit = false;
+}
+
+static void
+count_sr_plans_change(void)
+{
+	static bool callback_registered = false;
+
+	if (shared_state == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&shared_state->sr_plans_changes, 1);
+	if (!callback_registered)
+	{
+		RegisterXactCallback(sr_plans_change_callback, NULL);
+		callback_registered = true;
+	}
+	count_change_at_commit = true;
+}
+
 static bool 
 init_sr_plan(void)
 {
@@ -164,6 +349,14 @@ init_sr_plan(void)
 		elog(WARNING, "sr_plan extension installed incorrectly");
 		return false;
 	}
+
+	/* sr_plans could be recreated while its messages were lost */
+	if (cachedInfo.sr_plans_oid != cache_sr_plans_oid)
+	{
+		sr_plan_cache_reset();
+		cache_sr_plans_oid = cachedInfo.sr_plans_oid;
+	}
+
 	if (relcache_callback_needed)
 	{
 		CacheRegisterRelcacheCallback(sr_plan_relcache_hook, PointerGetDatum(NULL));
@@ -218,8 +411,30 @@ is_drop_extension_stmt(Node *stmt)
 static void
 sr_plan_relcache_hook(Datum arg, Oid relid)
 {
-	if (relid == InvalidOid || (relid == cachedInfo.sr_plans_oid))
+	Oid			sr_plans_oid = cachedInfo.sr_plans_oid;
+
+	if (relid == InvalidOid)
+	{
+		/*
+		 * All of relcache is reset, e.g. on overflow of the invalidation
+		 * queue, and a message about sr_plans could be lost with others. Oids
+		 * are looked up again, but plans are kept if sr_plans is the same.
+		 */
+		if (sr_plans_changed())
+			invalidate_oids();
+		else
+			reset_oids();
+	}
+	else if (relid == sr_plans_oid)
 		invalidate_oids();
+	else
+	{
+		sr_plan_cache_relcache(relid);
+		check_known_plans();
+	}
+
+	sr_plan_template_relcache(relid);
+	sr_plan_archive_relcache(relid, sr_plans_oid);
 }
 
 /*
@@ -360,6 +575,15 @@ params_restore_visitor(Plan *plan, void *context)
 {
 	expression_tree_walker((Node *) plan->qual, sr_query_expr_walker, context);
 	expression_tree_walker((Node *) plan->targetlist, sr_query_expr_walker, context);
+
+	if (IsA(plan, ModifyTable))
+	{
+		ModifyTable *mt = (ModifyTable *) plan;
+
+		expression_tree_walker((Node *) mt->returningLists, sr_query_expr_walker, context);
+		expression_tree_walker((Node *) mt->onConflictSet, sr_query_expr_walker, context);
+		expression_tree_walker(mt->onConflictWhere, sr_query_expr_walker, context);
+	}
 }
 
 static void
@@ -368,6 +592,286 @@ restore_params(void *context, Plan *plan)
 	plan_tree_visitor(plan, params_restore_visitor, context);
 }
 
+static bool
+param_sites_walker(Node *node, void *context)
+{
+	List	  **sites = context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, FuncExpr) && ((FuncExpr *) node)->funcid == cachedInfo.fake_func)
+	{
+		*sites = lappend(*sites, node);
+		return false;
+	}
+
+	return expression_tree_walker(node, param_sites_walker, context);
+}
+
+static void
+param_sites_visitor(Plan *plan, void *context)
+{
+	expression_tree_walker((Node *) plan->qual, param_sites_walker, context);
+	expression_tree_walker((Node *) plan->targetlist, param_sites_walker, context);
+
+	if (IsA(plan, ModifyTable))
+	{
+		ModifyTable *mt = (ModifyTable *) plan;
+
+		expression_tree_walker((Node *) mt->returningLists, param_sites_walker, context);
+		expression_tree_walker((Node *) mt->onConflictSet, param_sites_walker, context);
+		expression_tree_walker(mt->onConflictWhere, param_sites_walker, context);
+	}
+}
+
+static void
+collect_param_sites(void *context, Plan *plan)
+{
+	plan_tree_visitor(plan, param_sites_visitor, context);
+}
+
+/*
+ * Return all _p() calls which restore_params() would visit, in the same
+ * order.
+ */
+List *
+sr_plan_param_sites(PlannedStmt *pl_stmt)
+{
+	List	   *sites = NIL;
+
+	execute_for_plantree(pl_stmt, collect_param_sites, &sites);
+	return sites;
+}
+
+static int
+query_param_cmp(const void *a, const void *b)
+{
+	const struct QueryParam *pa = *(struct QueryParam * const *) a;
+	const struct QueryParam *pb = *(struct QueryParam * const *) b;
+
+	if (pa->location != pb->location)
+		return (pa->location < pb->location) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Copy cached plan with _p() arguments replaced by 'params'. Arguments are
+ * swapped in the cached tree itself just for copying, so there is no need
+ * to walk the plan or to search for each parameter in a list.
+ */
+static PlannedStmt *
+copy_with_params(PlannedStmt *pl_stmt, FuncExpr **sites, int nsites,
+				 List *params)
+{
+	PlannedStmt		   *result;
+	struct QueryParam **sorted;
+	struct QueryParam	key;
+	struct QueryParam  *keyp = &key;
+	void			  **saved_args;
+	Oid				   *saved_collids;
+	int					nparams = list_length(params);
+	int					i;
+	ListCell		   *lc;
+
+	if (nsites == 0 || nparams == 0)
+		return copyObject(pl_stmt);
+
+	sorted = palloc(sizeof(struct QueryParam *) * nparams);
+	i = 0;
+	foreach(lc, params)
+		sorted[i++] = lfirst(lc);
+	qsort(sorted, nparams, sizeof(struct QueryParam *), query_param_cmp);
+
+	saved_args = palloc(sizeof(void *) * nsites);
+	saved_collids = palloc(sizeof(Oid) * nsites);
+
+	for (i = 0; i < nsites; i++)
+	{
+		FuncExpr		   *fexpr = sites[i];
+		struct QueryParam **found;
+
+		saved_args[i] = linitial(fexpr->args);
+		saved_collids[i] = fexpr->funccollid;
+
+		/* HACK: location of _p() is kept in funccollid, see sr_query_expr_walker */
+		key.location = fexpr->funccollid;
+		found = bsearch(&keyp, sorted, nparams, sizeof(struct QueryParam *),
+						query_param_cmp);
+		if (found)
+		{
+			fexpr->funccollid = (*found)->funccollid;
+			linitial(fexpr->args) = (*found)->node;
+
+			if (cachedInfo.log_usage)
+				elog(cachedInfo.log_usage, "sr_plan: restored parameter on %d", (*found)->location);
+		}
+	}
+
+	PG_TRY();
+	{
+		result = copyObject(pl_stmt);
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nsites; i++)
+		{
+			linitial(sites[i]->args) = saved_args[i];
+			sites[i]->funccollid = saved_collids[i];
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (i = 0; i < nsites; i++)
+	{
+		linitial(sites[i]->args) = saved_args[i];
+		sites[i]->funccollid = saved_collids[i];
+	}
+
+	pfree(sorted);
+	pfree(saved_args);
+	pfree(saved_collids);
+
+	return result;
+}
+
+/*
+ * Make plancache invalidate statements using the frozen plan on any change
+ * of sr_plans. Until then a prepared statement or PL/pgSQL query keeps the
+ * frozen plan as its generic plan, with no lookups at all.
+ */
+static void
+depend_on_sr_plans(PlannedStmt *pl_stmt)
+{
+	pl_stmt->relationOids = lappend_oid(list_copy(pl_stmt->relationOids),
+										cachedInfo.sr_plans_oid);
+}
+
+/*
+ * Return statement executing cached plan with _p() arguments of the query.
+ */
+static PlannedStmt *
+use_cached_plan(SrPlanCacheEntry *entry, List *params)
+{
+	PlannedStmt		   *result;
+	struct QueryParam **sorted;
+	List			   *args = NIL;
+	int					nparams = list_length(params);
+	int					i,
+						j;
+	ListCell		   *lc;
+
+	if (entry->nslots < 0)
+		return copy_with_params(entry->pl_stmt, entry->sites, entry->nsites,
+								params);
+
+	/* Both slots and parameters are ordered by location */
+	sorted = palloc(sizeof(struct QueryParam *) * (nparams + 1));
+	i = 0;
+	foreach(lc, params)
+		sorted[i++] = lfirst(lc);
+	qsort(sorted, nparams, sizeof(struct QueryParam *), query_param_cmp);
+
+	j = 0;
+	for (i = 0; i < entry->nslots; i++)
+	{
+		int		location = entry->slots[i].location;
+
+		while (j < nparams && sorted[j]->location < location)
+			j++;
+
+		if (j < nparams && sorted[j]->location == location)
+		{
+			args = lappend(args, sorted[j]->node);
+			if (cachedInfo.log_usage)
+				elog(cachedInfo.log_usage, "sr_plan: restored parameter on %d", location);
+		}
+		else
+			args = lappend(args, NULL);
+	}
+	pfree(sorted);
+
+	result = sr_plan_params_bind(entry->pl_stmt, entry->slots, entry->nslots,
+								 args);
+	sr_plan_cache_pin(entry);
+
+	return result;
+}
+
+/*
+ * Fill the backend plan cache with enabled plans, see sr_plan.prewarm.
+ */
+static void
+prewarm_plans(void)
+{
+	SrPlanPrewarmStats	stats;
+
+	if (!sr_plan_cache_prewarm(cachedInfo.sr_plans_oid, cachedInfo.fake_func,
+							   cachedInfo.lookup_nowait, &stats))
+		return;
+
+	prewarm_done = true;
+	if (cachedInfo.log_usage > 0)
+		elog(cachedInfo.log_usage, "sr_plan: prewarmed " INT64_FORMAT " plans of " INT64_FORMAT " bytes in %.3f ms",
+			 stats.plans, stats.bytes, stats.time);
+}
+
+/*
+ * Return statement executing 'pl_stmt' found outside of sr_plans, keeping it
+ * in the backend cache, or NULL if partitions it scans can't be refreshed.
+ * 'source' is for the log.
+ */
+static PlannedStmt *
+use_loaded_plan(PlannedStmt *pl_stmt, int32 query_hash, int32 plan_hash,
+				struct QueryParamsContext *qp_context, List *literals,
+				const char *source)
+{
+	SrPlanCacheEntry   *entry;
+
+	pl_stmt = sr_plan_partitions_refresh(pl_stmt);
+	if (pl_stmt == NULL)
+		return NULL;
+
+	sr_plan_stats_update(SR_PLAN_STATS_HIT, query_hash, plan_hash,
+						 0.0, 0.0, 0);
+	entry = sr_plan_cache_store(query_hash, plan_hash, pl_stmt,
+								cachedInfo.fake_func);
+	if (entry != NULL)
+		pl_stmt = use_cached_plan(entry, qp_context->params);
+	else
+		execute_for_plantree(pl_stmt, restore_params, qp_context);
+	pl_stmt = sr_plan_literals_bind(pl_stmt, literals);
+	depend_on_sr_plans(pl_stmt);
+	if (cachedInfo.log_usage > 0)
+		elog(cachedInfo.log_usage, "sr_plan: %s plan was used for query hash %d",
+			 source, query_hash);
+
+	return pl_stmt;
+}
+
+/*
+ * Return statement executing the template plan of 'query_hash' if there is
+ * one, see plan_template.c.
+ */
+static PlannedStmt *
+use_template_plan(int32 query_hash, struct QueryParamsContext *qp_context,
+				  List *literals)
+{
+	PlannedStmt		   *pl_stmt;
+	int32				plan_hash;
+
+	if (!sr_plan_use_templates)
+		return NULL;
+
+	pl_stmt = sr_plan_template_lookup(query_hash, &plan_hash);
+	if (pl_stmt == NULL)
+		return NULL;
+
+	return use_loaded_plan(pl_stmt, query_hash, plan_hash, qp_context,
+						   literals, "template");
+}
+
 static void
 collect_indexid_visitor(Plan *plan, void *context)
 {
@@ -400,12 +904,24 @@ collect_indexid(void *context, Plan *plan)
 	plan_tree_visitor(plan, collect_indexid_visitor, context);
 }
 
+/*
+ * Oids of indexes scanned by 'pl_stmt'.
+ */
+List *
+sr_plan_index_oids(PlannedStmt *pl_stmt)
+{
+	struct IndexIds	index_ids = {NIL};
+
+	execute_for_plantree(pl_stmt, collect_indexid, (void *) &index_ids);
+	return index_ids.ids;
+}
+
 static PlannedStmt *
 lookup_plan_by_query_hash(Snapshot snapshot, Relation sr_index_rel,
 							Relation sr_plans_heap, ScanKey key,
-							void *context,
 							int index,
-							char **queryString)
+							char **queryString,
+							struct FrozenPlanInfo *info)
 {
 	int				counter = 0;
 	PlannedStmt	   *pl_stmt = NULL;
@@ -441,16 +957,26 @@ lookup_plan_by_query_hash(Snapshot snapshot, Relation sr_index_rel,
 		if ((index > 0 && index == counter) ||
 				(index == 0 && DatumGetBool(search_values[Anum_sr_enable - 1])))
 		{
-			char *out = TextDatumGetCString(DatumGetTextP((search_values[Anum_sr_plan - 1])));
-			pl_stmt = stringToNode(out);
+			text	   *plan_data = DatumGetTextP(search_values[Anum_sr_plan - 1]);
+			instr_time	start,
+						duration;
+
+			INSTR_TIME_SET_CURRENT(start);
+			pl_stmt = stringToNode(text_to_cstring(plan_data));
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+
+			if (info)
+			{
+				info->plan_hash = DatumGetInt32(search_values[Anum_sr_plan_hash - 1]);
+				info->plan_bytes = VARSIZE(plan_data);
+				info->deserialize_time = INSTR_TIME_GET_MILLISEC(duration);
+			}
 
 			if (queryString)
 				*queryString = TextDatumGetCString(
 						DatumGetTextP((search_values[Anum_sr_query - 1])));
 
-			if (context)
-				execute_for_plantree(pl_stmt, restore_params, context);
-
 			break;
 		}
 	}
@@ -462,147 +988,174 @@ lookup_plan_by_query_hash(Snapshot snapshot, Relation sr_index_rel,
 	return pl_stmt;
 }
 
-/* planner_hook */
-static PlannedStmt *
-#if PG_VERSION_NUM >= 130000
-sr_planner(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
-#else
-sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
-#endif
+/*
+ * Serialize saving of plans for the same query until the end of transaction,
+ * so that the recheck before insert sees plans saved concurrently. Captures
+ * of different queries and lookups are not blocked. Doesn't wait, so that
+ * sessions capturing the same queries in different order can't deadlock:
+ * returns false if another transaction is saving a plan of the query.
+ */
+static bool
+lock_query_hash(int32 query_hash)
 {
-	Datum			query_hash;
-	Relation		sr_plans_heap,
-					sr_index_rel;
-	HeapTuple		tuple;
-	char		   *plan_text;
-	Snapshot		snapshot;
-	ScanKeyData		key;
-	bool			found;
-	Datum			plan_hash;
-	IndexScanDesc	query_index_scan;
-	PlannedStmt	   *pl_stmt = NULL;
-	LOCKMODE		heap_lock =  AccessShareLock;
-	struct QueryParamsContext qp_context = {true, NULL};
-#if PG_VERSION_NUM >= 120000
-	TupleTableSlot *slot;
-#endif
-	static int		level = 0;
+	LOCKTAG		tag;
 
-	level++;
-
-#if PG_VERSION_NUM >= 130000
-#define call_standard_planner() \
-	(srplan_planner_hook_next ? \
-		srplan_planner_hook_next(parse, query_string, cursorOptions, boundParams) : \
-		standard_planner(parse, query_string, cursorOptions, boundParams))
-#else
-#define call_standard_planner() \
-	(srplan_planner_hook_next ? \
-		srplan_planner_hook_next(parse, cursorOptions, boundParams) : \
-		standard_planner(parse, cursorOptions, boundParams))
-#endif
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, (uint32) cachedInfo.sr_plans_oid,
+						 (uint32) query_hash, SR_PLAN_LOCKTAG_CAPTURE);
+	return LockAcquire(&tag, ExclusiveLock, false, true) != LOCKACQUIRE_NOT_AVAIL;
+}
 
-	/* Only save plans for SELECT commands */
-	if (parse->commandType != CMD_SELECT || !cachedInfo.enabled
-			|| cachedInfo.explain_query)
-	{
-		pl_stmt = call_standard_planner();
-		level--;
-		return pl_stmt;
-	}
+/*
+ * Lock sr_plans and its query_hash index without waiting. Returns false
+ * if any of them is locked in a conflicting mode.
+ */
+static bool
+lock_sr_plans_nowait(LOCKMODE lockmode)
+{
+	if (!ConditionalLockRelationOid(cachedInfo.sr_plans_oid, lockmode))
+		return false;
 
-	/* Set extension Oid if needed */
-	if (cachedInfo.schema_oid == InvalidOid)
+	if (!ConditionalLockRelationOid(cachedInfo.sr_index_oid, lockmode))
 	{
-		if (!init_sr_plan())
-		{
-			/* Just call standard_planner() if schema doesn't exist. */
-			pl_stmt = call_standard_planner();
-			level--;
-			return pl_stmt;
-		}
+		UnlockRelationOid(cachedInfo.sr_plans_oid, lockmode);
+		return false;
 	}
 
-	if (cachedInfo.schema_oid == InvalidOid || cachedInfo.sr_plans_oid  == InvalidOid)
-	{
-		/* Just call standard_planner() if schema doesn't exist. */
-		pl_stmt = call_standard_planner();
-		level--;
-		return pl_stmt;
-	}
+	return true;
+}
 
-	/* Make list with all _p functions and his position */
-	sr_query_walker((Query *) parse, &qp_context);
-	query_hash = get_query_hash(parse);
-	ScanKeyInit(&key, 1, BTEqualStrategyNumber, F_INT4EQ, query_hash);
+/* window of sr_plan.capture_max_per_second */
+static TimestampTz	capture_window_start = 0;
+static int			capture_window_captures = 0;
 
-	/* Try to find already planned statement */
-	heap_lock = AccessShareLock;
-#if PG_VERSION_NUM >= 130000
-	sr_plans_heap = table_open(cachedInfo.sr_plans_oid, heap_lock);
+/*
+ * Check sr_plan.capture_* filters which don't need the plan, before the query
+ * is planned.
+ */
+static bool
+capture_sampled(void)
+{
+	if (capture_sample_rate < 1.0)
+	{
+#if PG_VERSION_NUM >= 150000
+		if (pg_prng_double(&pg_global_prng_state) >= capture_sample_rate)
 #else
-	sr_plans_heap = heap_open(cachedInfo.sr_plans_oid, heap_lock);
+		if (random() >= capture_sample_rate * ((double) MAX_RANDOM_VALUE + 1))
 #endif
-	sr_index_rel = index_open(cachedInfo.sr_index_oid, heap_lock);
+			return false;
+	}
 
-	qp_context.collect = false;
-	snapshot = RegisterSnapshot(GetLatestSnapshot());
-	pl_stmt = lookup_plan_by_query_hash(snapshot, sr_index_rel, sr_plans_heap,
-										&key, &qp_context, 0, NULL);
-	if (pl_stmt != NULL)
+	if (capture_max_per_second > 0)
 	{
-		level--;
-		if (cachedInfo.log_usage > 0)
-			elog(cachedInfo.log_usage, "sr_plan: cached plan was used for query: %s", cachedInfo.query_text);
+		TimestampTz		now = GetCurrentTimestamp();
 
-		goto cleanup;
-	}
+		if (TimestampDifferenceExceeds(capture_window_start, now, 1000))
+		{
+			capture_window_start = now;
+			capture_window_captures = 0;
+		}
 
-	if (!cachedInfo.write_mode || level > 1)
-	{
-		/* quick way out if not in write mode */
-		pl_stmt = call_standard_planner();
-		level--;
-		goto cleanup;
+		if (capture_window_captures >= capture_max_per_second)
+			return false;
 	}
 
-	/* close and get AccessExclusiveLock */
-	UnregisterSnapshot(snapshot);
-	index_close(sr_index_rel, heap_lock);
-#if PG_VERSION_NUM >= 130000
-	table_close(sr_plans_heap, heap_lock);
-#else
-	heap_close(sr_plans_heap, heap_lock);
-#endif
+	return true;
+}
 
-	heap_lock = AccessExclusiveLock;
-#if PG_VERSION_NUM >= 130000
-	sr_plans_heap = table_open(cachedInfo.sr_plans_oid, heap_lock);
-#else
-	sr_plans_heap = heap_open(cachedInfo.sr_plans_oid, heap_lock);
-#endif
-	sr_index_rel = index_open(cachedInfo.sr_index_oid, heap_lock);
+/*
+ * Check the new plan against the rest of sr_plan.capture_* filters and count
+ * the capture if it's wanted.
+ */
+static bool
+capture_wanted(PlannedStmt *pl_stmt, double planning_time)
+{
+	if (planning_time < capture_min_duration)
+		return false;
 
-	/* recheck plan in index */
-	snapshot = RegisterSnapshot(GetLatestSnapshot());
-	pl_stmt = lookup_plan_by_query_hash(snapshot, sr_index_rel, sr_plans_heap,
-										&key, &qp_context, 0, NULL);
-	if (pl_stmt != NULL)
-	{
-		level--;
-		goto cleanup;
-	}
+	if (pl_stmt->planTree->total_cost < capture_min_cost)
+		return false;
 
-	/* from now on we use this new plan */
-	pl_stmt = call_standard_planner();
-	level--;
-	plan_text = nodeToString(pl_stmt);
-	plan_hash = hash_any((unsigned char *) plan_text, strlen(plan_text));
+	capture_window_captures++;
+	return true;
+}
+
+/*
+ * Collect everything needed to save 'pl_stmt' into sr_plans.
+ */
+void
+sr_plan_make_capture(SrPlanCapture *capture, Query *parse, const char *query_text,
+			 int32 query_hash, int32 plan_hash, char *plan_text,
+			 PlannedStmt *pl_stmt)
+{
+	List		   *reloids;
+	List		   *index_oids;
+	ListCell	   *lc;
+	int				pos;
+
+	capture->query_hash = query_hash;
+	capture->plan_hash = plan_hash;
+	capture->query_id = (int64) parse->queryId;
+	capture->query = query_text;
+	capture->plan = cstring_to_text(plan_text);
+	pfree(plan_text);
+
+	/* related oids, partitions are refreshed when the plan is loaded */
+	reloids = sr_plan_partitions_reloids(pl_stmt);
+	capture->nreloids = list_length(reloids);
+	capture->reloids = palloc(sizeof(Oid) * capture->nreloids);
+	pos = 0;
+	foreach(lc, reloids)
+		capture->reloids[pos++] = lfirst_oid(lc);
+
+	/* related index oids */
+	index_oids = sr_plan_partitions_index_oids(pl_stmt,
+											   sr_plan_index_oids(pl_stmt));
+	capture->nindex_reloids = list_length(index_oids);
+	capture->index_reloids = palloc(sizeof(Oid) * capture->nindex_reloids);
+	pos = 0;
+	foreach(lc, index_oids)
+		capture->index_reloids[pos++] = lfirst_oid(lc);
+}
+
+ArrayType *
+sr_plan_oid_array(Oid *oids, int len)
+{
+	ArrayType  *result;
+	Datum	   *arr = palloc(sizeof(Datum) * len);
+	int			i;
+
+	for (i = 0; i < len; i++)
+		arr[i] = ObjectIdGetDatum(oids[i]);
+
+	result = construct_array(arr, len, OIDOID, sizeof(Oid), true, 'i');
+	pfree(arr);
+
+	return result;
+}
+
+/*
+ * Insert captured plan into sr_plans unless it's a full duplicate of
+ * a saved one. Both relations must be locked with 'heap_lock'.
+ * Returns false for duplicates.
+ */
+static bool
+store_plan(Relation sr_plans_heap, Relation sr_index_rel, Snapshot snapshot,
+		   LOCKMODE heap_lock, SrPlanCapture *capture)
+{
+	HeapTuple		tuple;
+	ScanKeyData		key;
+	bool			found;
+	IndexScanDesc	query_index_scan;
+#if PG_VERSION_NUM >= 120000
+	TupleTableSlot *slot;
+#endif
 
 	/*
 	 * Try to find existing plan for this query and skip addding it
 	 * to prevent duplicates.
 	 */
+	ScanKeyInit(&key, 1, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(capture->query_hash));
 	query_index_scan = index_beginscan(sr_plans_heap, sr_index_rel,
 									   snapshot, 1, 0);
 	index_rescan(query_index_scan, &key, 1, NULL, 0);
@@ -636,7 +1189,7 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 						  search_values, search_nulls);
 
 		/* Detect full plan duplicate */
-		if (DatumGetInt32(search_values[Anum_sr_plan_hash - 1]) == DatumGetInt32(plan_hash))
+		if (DatumGetInt32(search_values[Anum_sr_plan_hash - 1]) == capture->plan_hash)
 		{
 			found = true;
 			break;
@@ -648,8 +1201,6 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 #endif
 	if (!found)
 	{
-		struct IndexIds	index_ids = {NIL};
-
 		Relation	reloids_index_rel;
 		Relation	index_reloids_index_rel;
 
@@ -657,7 +1208,6 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 		ArrayType  *index_reloids = NULL;
 		Datum		values[Anum_sr_attcount];
 		bool		nulls[Anum_sr_attcount];
-		int			reloids_len = list_length(pl_stmt->relationOids);
 
 		/* prepare indexes */
 		reloids_index_rel = index_open(cachedInfo.reloids_index_oid, heap_lock);
@@ -665,56 +1215,29 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 
 		MemSet(nulls, 0, sizeof(nulls));
 
-		values[Anum_sr_query_hash - 1] = query_hash;
-		values[Anum_sr_query_id - 1] = Int64GetDatum(parse->queryId);
-		values[Anum_sr_plan_hash - 1] = plan_hash;
-		values[Anum_sr_query - 1] = CStringGetTextDatum(cachedInfo.query_text);
-		values[Anum_sr_plan - 1] = CStringGetTextDatum(plan_text);
+		values[Anum_sr_query_hash - 1] = Int32GetDatum(capture->query_hash);
+		values[Anum_sr_query_id - 1] = Int64GetDatum(capture->query_id);
+		values[Anum_sr_plan_hash - 1] = Int32GetDatum(capture->plan_hash);
+		values[Anum_sr_query - 1] = CStringGetTextDatum(capture->query);
+		values[Anum_sr_plan - 1] = PointerGetDatum(capture->plan);
 		values[Anum_sr_enable - 1] = BoolGetDatum(false);
 		values[Anum_sr_reloids - 1] = (Datum) 0;
 		values[Anum_sr_index_reloids - 1] = (Datum) 0;
 
 		/* save related oids */
-		if (reloids_len)
+		if (capture->nreloids)
 		{
-			int			pos;
-			ListCell   *lc;
-			Datum	   *reloids_arr = palloc(sizeof(Datum) * reloids_len);
-
-			pos = 0;
-			foreach(lc, pl_stmt->relationOids)
-			{
-				reloids_arr[pos] = ObjectIdGetDatum(lfirst_oid(lc));
-				pos++;
-			}
-			reloids = construct_array(reloids_arr, reloids_len, OIDOID,
-											 sizeof(Oid), true, 'i');
+			reloids = sr_plan_oid_array(capture->reloids, capture->nreloids);
 			values[Anum_sr_reloids - 1] = PointerGetDatum(reloids);
-
-			pfree(reloids_arr);
 		}
 		else nulls[Anum_sr_reloids - 1] = true;
 
 		/* saved related index oids */
-		execute_for_plantree(pl_stmt, collect_indexid, (void *) &index_ids);
-		if (list_length(index_ids.ids))
+		if (capture->nindex_reloids)
 		{
-			int len = list_length(index_ids.ids);
-			int			pos;
-			ListCell   *lc;
-			Datum	   *ids_arr = palloc(sizeof(Datum) * len);
-
-			pos = 0;
-			foreach(lc, index_ids.ids)
-			{
-				ids_arr[pos] = ObjectIdGetDatum(lfirst_oid(lc));
-				pos++;
-			}
-			index_reloids = construct_array(ids_arr, len, OIDOID,
-											 sizeof(Oid), true, 'i');
+			index_reloids = sr_plan_oid_array(capture->index_reloids,
+										   capture->nindex_reloids);
 			values[Anum_sr_index_reloids - 1] = PointerGetDatum(index_reloids);
-
-			pfree(ids_arr);
 		}
 		else nulls[Anum_sr_index_reloids - 1] = true;
 
@@ -722,7 +1245,11 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 		simple_heap_insert(sr_plans_heap, tuple);
 
 		if (cachedInfo.log_usage)
-			elog(cachedInfo.log_usage, "sr_plan: saved plan for %s", cachedInfo.query_text);
+			elog(cachedInfo.log_usage, "sr_plan: saved plan for %s", capture->query);
+
+		sr_plan_stats_update(SR_PLAN_STATS_CAPTURE, capture->query_hash,
+							 capture->plan_hash, 0.0, 0.0,
+							 VARSIZE(capture->plan));
 
 		index_insert_compat(sr_index_rel,
 					 values, nulls,
@@ -740,34 +1267,731 @@ sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 						 UNIQUE_CHECK_NO);
 		}
 
-		if (index_reloids)
+		if (index_reloids)
+		{
+			index_insert_compat(index_reloids_index_rel,
+						 &values[Anum_sr_index_reloids - 1],
+						 &nulls[Anum_sr_index_reloids-1],
+						 &(tuple->t_self),
+						 sr_plans_heap,
+						 UNIQUE_CHECK_NO);
+		}
+
+		index_close(reloids_index_rel, heap_lock);
+		index_close(index_reloids_index_rel, heap_lock);
+
+		/* Make changes visible */
+		CommandCounterIncrement();
+	}
+
+	return !found;
+}
+
+/*
+ * Save a batch of captured plans in current transaction, skipping
+ * duplicates. Returns false if sr_plan is not installed.
+ */
+bool
+sr_plan_save_captured(SrPlanCapture *captures, int ncaptures)
+{
+	Relation		sr_plans_heap,
+					sr_index_rel;
+	LOCKMODE		heap_lock = RowExclusiveLock;
+	int				i;
+
+	if (cachedInfo.schema_oid == InvalidOid && !init_sr_plan())
+		return false;
+
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(cachedInfo.sr_plans_oid, heap_lock);
+#else
+	sr_plans_heap = heap_open(cachedInfo.sr_plans_oid, heap_lock);
+#endif
+	sr_index_rel = index_open(cachedInfo.sr_index_oid, heap_lock);
+
+	for (i = 0; i < ncaptures; i++)
+	{
+		Snapshot	snapshot;
+
+		/* Someone else is saving a plan of the query, skip this one */
+		if (!lock_query_hash(captures[i].query_hash))
+			continue;
+
+		/* Plans saved by previous iterations must be visible */
+		snapshot = RegisterSnapshot(GetLatestSnapshot());
+
+		store_plan(sr_plans_heap, sr_index_rel, snapshot, heap_lock,
+				   &captures[i]);
+		UnregisterSnapshot(snapshot);
+	}
+
+	index_close(sr_index_rel, heap_lock);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, heap_lock);
+#else
+	heap_close(sr_plans_heap, heap_lock);
+#endif
+
+	return true;
+}
+
+/*
+ * Check if plans of 'parse' could be saved. INSERT ... VALUES has the only
+ * plan possible, so only INSERT ... SELECT is worth it.
+ */
+static bool
+frozen_plan_command(Query *parse)
+{
+	ListCell   *lc;
+
+	switch (parse->commandType)
+	{
+		case CMD_SELECT:
+		case CMD_UPDATE:
+		case CMD_DELETE:
+			return true;
+
+		case CMD_INSERT:
+			foreach(lc, parse->jointree->fromlist)
+			{
+				Node	   *item = (Node *) lfirst(lc);
+
+				if (IsA(item, RangeTblRef) &&
+					rt_fetch(((RangeTblRef *) item)->rtindex,
+							 parse->rtable)->rtekind == RTE_SUBQUERY)
+					return true;
+			}
+			return false;
+
+		default:
+			return false;
+	}
+}
+
+/* planner_hook */
+static PlannedStmt *
+#if PG_VERSION_NUM >= 130000
+sr_planner(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
+#else
+sr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	PlannedStmt	   *pl_stmt;
+
+	/* Keep the depth right if planning fails */
+	planner_level++;
+	PG_TRY();
+	{
+#if PG_VERSION_NUM >= 130000
+		pl_stmt = sr_planner_internal(parse, query_string, cursorOptions,
+									  boundParams);
+#else
+		pl_stmt = sr_planner_internal(parse, cursorOptions, boundParams);
+#endif
+	}
+	PG_CATCH();
+	{
+		planner_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	planner_level--;
+
+	return pl_stmt;
+}
+
+static PlannedStmt *
+#if PG_VERSION_NUM >= 130000
+sr_planner_internal(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
+#else
+sr_planner_internal(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	Datum			query_hash;
+	Relation		sr_plans_heap,
+					sr_index_rel;
+	Snapshot		snapshot;
+	ScanKeyData		key;
+	PlannedStmt	   *pl_stmt = NULL;
+	PlannedStmt	   *frozen_stmt;
+	PlannedStmt	   *result;
+	Query		   *query;
+	bool			generic;
+	char		   *plan_text;
+	int32			plan_hash;
+	uint64			store_generation;
+	instr_time		plan_start,
+					plan_duration,
+					lookup_start,
+					lookup_duration;
+	struct FrozenPlanInfo info;
+	SrPlanCacheEntry *entry;
+	LOCKMODE		heap_lock =  AccessShareLock;
+	struct QueryParamsContext qp_context = {true, NIL, false, NIL};
+	List		   *literals;
+	SrPlanCapture	capture;
+	const char	   *query_text = cachedInfo.query_text;
+
+#if PG_VERSION_NUM >= 130000
+	/* Extended protocol could parse other statements since this one */
+	if (query_string != NULL)
+		query_text = query_string;
+#endif
+
+#if PG_VERSION_NUM >= 130000
+#define call_standard_planner() \
+	(srplan_planner_hook_next ? \
+		srplan_planner_hook_next(parse, query_string, cursorOptions, boundParams) : \
+		standard_planner(parse, query_string, cursorOptions, boundParams))
+#else
+#define call_standard_planner() \
+	(srplan_planner_hook_next ? \
+		srplan_planner_hook_next(parse, cursorOptions, boundParams) : \
+		standard_planner(parse, cursorOptions, boundParams))
+#endif
+
+	if (!frozen_plan_command(parse) || !cachedInfo.enabled
+			|| cachedInfo.explain_query)
+	{
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/* Set extension Oid if needed */
+	if (cachedInfo.schema_oid == InvalidOid)
+	{
+		if (!init_sr_plan())
+		{
+			/* Just call standard_planner() if schema doesn't exist. */
+			pl_stmt = call_standard_planner();
+			return pl_stmt;
+		}
+	}
+
+	if (cachedInfo.schema_oid == InvalidOid || cachedInfo.sr_plans_oid  == InvalidOid)
+	{
+		/* Just call standard_planner() if schema doesn't exist. */
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/* Changes of sr_plans are never frozen */
+	if (parse->resultRelation > 0 &&
+		rt_fetch(parse->resultRelation, parse->rtable)->relid == cachedInfo.sr_plans_oid)
+	{
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/* $n parameters and literals would be mixed up */
+	qp_context.with_literals = sr_plan_auto_parameterize &&
+		!query_tree_walker(parse, extern_params_walker, NULL, 0);
+
+	/* Make list with all _p functions and his position */
+	sr_query_walker((Query *) parse, &qp_context);
+	query_hash = sr_query_hash(parse, cachedInfo.fake_func,
+							   qp_context.with_literals);
+	qp_context.collect = false;
+	literals = number_literals(qp_context.literals, false);
+
+	/* Load enabled plans before the first lookup of the backend */
+	if (prewarm_on_start && !prewarm_done)
+		prewarm_plans();
+
+	/* Cached plans of templates could be out of date */
+	if (sr_plan_use_templates)
+		sr_plan_template_check();
+
+	/* No enabled plan, no need to look for it anywhere */
+	if (!sr_plan_filter_lookup(cachedInfo.sr_plans_oid, DatumGetInt32(query_hash)))
+	{
+		pl_stmt = use_template_plan(DatumGetInt32(query_hash), &qp_context,
+									literals);
+		if (pl_stmt != NULL)
+			return pl_stmt;
+
+		/* Nothing to look for, but maybe something to save */
+		if (capture_allowed())
+			goto capture;
+
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/* Plans already loaded by this backend don't require sr_plans at all */
+	entry = sr_plan_cache_lookup(DatumGetInt32(query_hash));
+	if (entry != NULL)
+	{
+		sr_plan_stats_update(SR_PLAN_STATS_HIT, DatumGetInt32(query_hash),
+							 entry->plan_hash, 0.0, 0.0, 0);
+		pl_stmt = use_cached_plan(entry, qp_context.params);
+		pl_stmt = sr_plan_literals_bind(pl_stmt, literals);
+		depend_on_sr_plans(pl_stmt);
+		if (cachedInfo.log_usage > 0)
+			elog(cachedInfo.log_usage, "sr_plan: cached plan was used for query: %s", query_text);
+
+		return pl_stmt;
+	}
+
+	/* Neither do plans of the archive loaded at startup */
+	pl_stmt = sr_plan_archive_lookup(cachedInfo.sr_plans_oid,
+									 DatumGetInt32(query_hash), &plan_hash);
+	if (pl_stmt != NULL)
+		pl_stmt = use_loaded_plan(pl_stmt, DatumGetInt32(query_hash),
+								  plan_hash, &qp_context, literals, "archived");
+	if (pl_stmt != NULL)
+		return pl_stmt;
+
+	/* Nor plans loaded by other backends */
+	pl_stmt = sr_plan_store_lookup(cachedInfo.sr_plans_oid,
+								   DatumGetInt32(query_hash), &plan_hash,
+								   &store_generation);
+	if (pl_stmt != NULL)
+		pl_stmt = use_loaded_plan(pl_stmt, DatumGetInt32(query_hash),
+								  plan_hash, &qp_context, literals, "shared");
+	if (pl_stmt != NULL)
+		return pl_stmt;
+
+	ScanKeyInit(&key, 1, BTEqualStrategyNumber, F_INT4EQ, query_hash);
+
+	/* Try to find already planned statement */
+	INSTR_TIME_SET_CURRENT(lookup_start);
+	heap_lock = AccessShareLock;
+	if (cachedInfo.lookup_nowait && !lock_sr_plans_nowait(heap_lock))
+	{
+		/* Worse plan is better than waiting for somebody's lock */
+		if (shared_state)
+			pg_atomic_fetch_add_u64(&shared_state->skipped_lookups, 1);
+		else
+			local_skipped_lookups++;
+
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/* Relations are already locked in nowait mode */
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(cachedInfo.sr_plans_oid,
+							   cachedInfo.lookup_nowait ? NoLock : heap_lock);
+#else
+	sr_plans_heap = heap_open(cachedInfo.sr_plans_oid,
+							  cachedInfo.lookup_nowait ? NoLock : heap_lock);
+#endif
+	sr_index_rel = index_open(cachedInfo.sr_index_oid,
+							  cachedInfo.lookup_nowait ? NoLock : heap_lock);
+
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	pl_stmt = lookup_plan_by_query_hash(snapshot, sr_index_rel, sr_plans_heap,
+										&key, 0, NULL, &info);
+	INSTR_TIME_SET_CURRENT(lookup_duration);
+	INSTR_TIME_SUBTRACT(lookup_duration, lookup_start);
+
+	/* Other backends refresh partitions of the plan by themselves */
+	if (pl_stmt != NULL)
+	{
+		sr_plan_store_put(cachedInfo.sr_plans_oid, DatumGetInt32(query_hash),
+						  info.plan_hash, store_generation, pl_stmt);
+		pl_stmt = sr_plan_partitions_refresh(pl_stmt);
+	}
+
+	if (pl_stmt == NULL)
+	{
+		pl_stmt = use_template_plan(DatumGetInt32(query_hash), &qp_context,
+									literals);
+		if (pl_stmt != NULL)
+			goto cleanup;
+
+		sr_plan_stats_update(SR_PLAN_STATS_MISS, DatumGetInt32(query_hash), 0,
+							 INSTR_TIME_GET_MILLISEC(lookup_duration), 0.0, 0);
+	}
+	else
+	{
+		sr_plan_stats_update(SR_PLAN_STATS_HIT, DatumGetInt32(query_hash),
+							 info.plan_hash,
+							 INSTR_TIME_GET_MILLISEC(lookup_duration),
+							 info.deserialize_time, info.plan_bytes);
+		entry = sr_plan_cache_store(DatumGetInt32(query_hash), info.plan_hash,
+									pl_stmt, cachedInfo.fake_func);
+		if (entry != NULL)
+			pl_stmt = use_cached_plan(entry, qp_context.params);
+		else
+			execute_for_plantree(pl_stmt, restore_params, &qp_context);
+		pl_stmt = sr_plan_literals_bind(pl_stmt, literals);
+		depend_on_sr_plans(pl_stmt);
+		if (cachedInfo.log_usage > 0)
+			elog(cachedInfo.log_usage, "sr_plan: cached plan was used for query: %s", query_text);
+
+		goto cleanup;
+	}
+
+	if (!capture_allowed())
+	{
+		/* quick way out if not in write mode */
+		pl_stmt = call_standard_planner();
+		goto cleanup;
+	}
+
+	/* close and reopen for writing */
+	UnregisterSnapshot(snapshot);
+	index_close(sr_index_rel, heap_lock);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, heap_lock);
+#else
+	heap_close(sr_plans_heap, heap_lock);
+#endif
+
+capture:
+	/* Most queries are not captured at all, so don't plan them twice */
+	if (!capture_sampled())
+	{
+		pl_stmt = call_standard_planner();
+		return pl_stmt;
+	}
+
+	/*
+	 * The query is executed with a plan for the values bound now, while the
+	 * saved plan must suit any values of $n parameters and literals. The
+	 * planner scribbles on the query, so a copy is planned first.
+	 */
+	generic = boundParams != NULL || literals != NIL;
+	query = parse;
+	if (generic)
+		parse = copyObject(query);
+
+	/* Plan the query and check whether this plan is worth saving */
+	INSTR_TIME_SET_CURRENT(plan_start);
+	pl_stmt = call_standard_planner();
+	INSTR_TIME_SET_CURRENT(plan_duration);
+	INSTR_TIME_SUBTRACT(plan_duration, plan_start);
+	parse = query;
+	result = pl_stmt;
+
+	if (!capture_wanted(pl_stmt, INSTR_TIME_GET_MILLISEC(plan_duration)))
+		return result;
+
+	/* Plan the saved one without folding the values */
+	if (generic)
+	{
+		boundParams = NULL;
+		number_literals(qp_context.literals, true);
+		pl_stmt = call_standard_planner();
+	}
+
+	/* Skip plans already known to be in sr_plans */
+	sr_plan_capture_collect();
+	plan_text = nodeToString(pl_stmt);
+	plan_hash = DatumGetInt32(hash_any((unsigned char *) plan_text,
+									   strlen(plan_text)));
+	if (sr_plan_known_plan(DatumGetInt32(query_hash), plan_hash))
+	{
+		pfree(plan_text);
+		return result;
+	}
+
+	sr_plan_make_capture(&capture, parse, query_text,
+						 DatumGetInt32(query_hash), plan_hash, plan_text,
+						 pl_stmt);
+
+	/* Let capture worker save the plan, unless the queue is full */
+	if (cachedInfo.capture_mode == SR_PLAN_CAPTURE_ASYNC)
+	{
+		if (sr_plan_capture_enqueue(&capture))
+		{
+			if (cachedInfo.log_usage)
+				elog(cachedInfo.log_usage, "sr_plan: queued plan for %s", capture.query);
+		}
+		else
+			sr_plan_save_captured(&capture, 1);
+
+		return result;
+	}
+
+	/* Captures of nested statements could have reset Oids meanwhile */
+	if (cachedInfo.schema_oid == InvalidOid && !init_sr_plan())
+		return result;
+
+	heap_lock = RowExclusiveLock;
+#if PG_VERSION_NUM >= 130000
+	sr_plans_heap = table_open(cachedInfo.sr_plans_oid, heap_lock);
+#else
+	sr_plans_heap = heap_open(cachedInfo.sr_plans_oid, heap_lock);
+#endif
+	sr_index_rel = index_open(cachedInfo.sr_index_oid, heap_lock);
+
+	/* Someone else is saving a plan of the query, skip the capture */
+	if (!lock_query_hash(DatumGetInt32(query_hash)))
+	{
+		index_close(sr_index_rel, heap_lock);
+#if PG_VERSION_NUM >= 130000
+		table_close(sr_plans_heap, heap_lock);
+#else
+		heap_close(sr_plans_heap, heap_lock);
+#endif
+		return result;
+	}
+
+	/* recheck plan in index, a frozen plan wins over the new one */
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	frozen_stmt = lookup_plan_by_query_hash(snapshot, sr_index_rel, sr_plans_heap,
+											&key, 0, NULL, &info);
+	if (frozen_stmt != NULL)
+		frozen_stmt = sr_plan_partitions_refresh(frozen_stmt);
+	if (frozen_stmt != NULL)
+	{
+		pl_stmt = frozen_stmt;
+		sr_plan_stats_update(SR_PLAN_STATS_HIT, DatumGetInt32(query_hash),
+							 info.plan_hash, 0.0, info.deserialize_time,
+							 info.plan_bytes);
+		entry = sr_plan_cache_store(DatumGetInt32(query_hash), info.plan_hash,
+									pl_stmt, cachedInfo.fake_func);
+		if (entry != NULL)
+			pl_stmt = use_cached_plan(entry, qp_context.params);
+		else
+			execute_for_plantree(pl_stmt, restore_params, &qp_context);
+		pl_stmt = sr_plan_literals_bind(pl_stmt, literals);
+		depend_on_sr_plans(pl_stmt);
+		goto cleanup;
+	}
+
+	/* The saved plan is used since the next execution */
+	if (!store_plan(sr_plans_heap, sr_index_rel, snapshot, heap_lock, &capture))
+		sr_plan_remember_plan(capture.query_hash, capture.plan_hash);
+	pl_stmt = result;
+
+cleanup:
+	UnregisterSnapshot(snapshot);
+
+	index_close(sr_index_rel, heap_lock);
+#if PG_VERSION_NUM >= 130000
+	table_close(sr_plans_heap, heap_lock);
+#else
+	heap_close(sr_plans_heap, heap_lock);
+#endif
+
+	return pl_stmt;
+}
+
+/*
+ * Oid of _p() or InvalidOid if sr_plan is not installed in this database.
+ */
+Oid
+sr_plan_fake_func(void)
+{
+	if (cachedInfo.schema_oid == InvalidOid && !init_sr_plan())
+		return InvalidOid;
+
+	return cachedInfo.fake_func;
+}
+
+/*
+ * Oid of sr_plans or InvalidOid if sr_plan is not installed in this database.
+ */
+Oid
+sr_plan_plans_relid(void)
+{
+	if (cachedInfo.schema_oid == InvalidOid && !init_sr_plan())
+		return InvalidOid;
+
+	return cachedInfo.sr_plans_oid;
+}
+
+#if PG_VERSION_NUM >= 150000
+#define parse_analyze_varparams_compat(stmt, text, types, n) \
+	parse_analyze_varparams((RawStmt *) (stmt), text, types, n, NULL)
+#elif PG_VERSION_NUM >= 100000
+#define parse_analyze_varparams_compat(stmt, text, types, n) \
+	parse_analyze_varparams((RawStmt *) (stmt), text, types, n)
+#else
+#define parse_analyze_varparams_compat(stmt, text, types, n) \
+	parse_analyze_varparams(stmt, text, types, n)
+#endif
+
+/*
+ * Compute query_hash of 'query_text' as the planner does, for plans saved
+ * elsewhere. Types of $n parameters are inferred like for PREPARE without
+ * them. Returns false unless the text has one query which could have a
+ * frozen plan.
+ */
+bool
+sr_plan_hash_query_text(const char *query_text, Query **query,
+						int32 *query_hash)
+{
+	List		   *raw_parsetree_list;
+	List		   *querytree_list = NIL;
+	Node		   *stmt;
+	Node		   *raw_stmt;
+	Oid			   *param_types = NULL;
+	int				nparams = 0;
+	Query		   *parse;
+	bool			with_literals;
+	const char	   *saved_query_text = cachedInfo.query_text;
+	bool			saved_explain_query = cachedInfo.explain_query;
+
+	if (cachedInfo.schema_oid == InvalidOid && !init_sr_plan())
+		return false;
+
+	raw_parsetree_list = pg_parse_query(query_text);
+	if (list_length(raw_parsetree_list) != 1)
+		return false;
+
+	stmt = (Node *) linitial(raw_parsetree_list);
+#if PG_VERSION_NUM >= 100000
+	raw_stmt = ((RawStmt *) stmt)->stmt;
+#else
+	raw_stmt = stmt;
+#endif
+	if (!IsA(raw_stmt, SelectStmt) && !IsA(raw_stmt, InsertStmt) &&
+		!IsA(raw_stmt, UpdateStmt) && !IsA(raw_stmt, DeleteStmt))
+		return false;
+
+	/* sr_analyze() remembers the text of the query being planned */
+	PG_TRY();
+	{
+		parse = parse_analyze_varparams_compat(stmt, query_text,
+											   &param_types, &nparams);
+		querytree_list = QueryRewrite(parse);
+	}
+	PG_CATCH();
+	{
+		cachedInfo.query_text = saved_query_text;
+		cachedInfo.explain_query = saved_explain_query;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	cachedInfo.query_text = saved_query_text;
+	cachedInfo.explain_query = saved_explain_query;
+
+	if (list_length(querytree_list) != 1)
+		return false;
+
+	parse = (Query *) linitial(querytree_list);
+	if (!frozen_plan_command(parse))
+		return false;
+
+	with_literals = sr_plan_auto_parameterize &&
+		!query_tree_walker(parse, extern_params_walker, NULL, 0);
+	*query_hash = DatumGetInt32(sr_query_hash(parse, cachedInfo.fake_func,
+											  with_literals));
+	*query = parse;
+
+	return true;
+}
+
+/*
+ * SQL interface of sr_plan_hash_query_text(), NULL if the query can't have
+ * a frozen plan.
+ */
+Datum
+sr_plan_query_hash(PG_FUNCTION_ARGS)
+{
+	char	   *query_text = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Query	   *query;
+	int32		query_hash;
+
+	if (!sr_plan_hash_query_text(query_text, &query, &query_hash))
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT32(query_hash);
+}
+
+static bool
+extern_params_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Param))
+		return ((Param *) node)->paramkind == PARAM_EXTERN;
+
+	if (IsA(node, Query))
+		return query_tree_walker((Query *) node, extern_params_walker, context, 0);
+
+	return expression_tree_walker(node, extern_params_walker, context);
+}
+
+/* Same operands as hash_operands() restores by location */
+static void
+collect_literals(struct QueryParamsContext *qp_context, List *args,
+				 bool in_array)
+{
+	ListCell   *lc;
+
+	foreach(lc, args)
+	{
+		Node	   *arg = (Node *) lfirst(lc);
+
+		if (sr_plan_is_literal(arg))
 		{
-			index_insert_compat(index_reloids_index_rel,
-						 &values[Anum_sr_index_reloids - 1],
-						 &nulls[Anum_sr_index_reloids-1],
-						 &(tuple->t_self),
-						 sr_plans_heap,
-						 UNIQUE_CHECK_NO);
+			struct QueryLiteral *literal = palloc(sizeof(struct QueryLiteral));
+
+			literal->location = ((Const *) arg)->location;
+			literal->value = (Const *) arg;
+			literal->ref = (Node **) &lfirst(lc);
+			qp_context->literals = lappend(qp_context->literals, literal);
 		}
+		else if (in_array && IsA(arg, ArrayExpr))
+			collect_literals(qp_context, ((ArrayExpr *) arg)->elements, false);
+	}
+}
 
-		index_close(reloids_index_rel, heap_lock);
-		index_close(index_reloids_index_rel, heap_lock);
+static int
+query_literal_cmp(const void *a, const void *b)
+{
+	const struct QueryLiteral *la = *(struct QueryLiteral * const *) a;
+	const struct QueryLiteral *lb = *(struct QueryLiteral * const *) b;
 
-		/* Make changes visible */
-		CommandCounterIncrement();
-	}
+	if (la->location != lb->location)
+		return (la->location < lb->location) ? -1 : 1;
+	return 0;
+}
 
-cleanup:
-	UnregisterSnapshot(snapshot);
+/*
+ * Return values of 'literals' ordered by location, that is by number of the
+ * parameter replacing them in a frozen plan. Literals copied by the parser
+ * share the parameter. With 'replace' literals of the query are replaced by
+ * these parameters.
+ */
+static List *
+number_literals(List *literals, bool replace)
+{
+	struct QueryLiteral **sorted;
+	List	   *values = NIL;
+	int			nliterals = list_length(literals);
+	int			i;
+	ListCell   *lc;
+
+	if (nliterals == 0)
+		return NIL;
+
+	sorted = palloc(sizeof(struct QueryLiteral *) * nliterals);
+	i = 0;
+	foreach(lc, literals)
+		sorted[i++] = lfirst(lc);
+	qsort(sorted, nliterals, sizeof(struct QueryLiteral *), query_literal_cmp);
+
+	for (i = 0; i < nliterals; i++)
+	{
+		Const	   *value = sorted[i]->value;
 
-	index_close(sr_index_rel, heap_lock);
-#if PG_VERSION_NUM >= 130000
-	table_close(sr_plans_heap, heap_lock);
-#else
-	heap_close(sr_plans_heap, heap_lock);
-#endif
+		if (i == 0 || sorted[i - 1]->location != sorted[i]->location)
+			values = lappend(values, value);
 
-	return pl_stmt;
+		if (replace)
+		{
+			Param	   *param = makeNode(Param);
+
+			param->paramkind = PARAM_EXTERN;
+			param->paramid = list_length(values);
+			param->paramtype = value->consttype;
+			param->paramtypmod = value->consttypmod;
+			param->paramcollid = value->constcollid;
+			param->location = value->location;
+			*sorted[i]->ref = (Node *) param;
+		}
+	}
+	pfree(sorted);
+
+	return values;
 }
 
 static bool
@@ -796,6 +2020,14 @@ sr_query_expr_walker(Node *node, void *context)
 	if (node == NULL)
 		return false;
 
+	if (qp_context->collect && qp_context->with_literals)
+	{
+		if (IsA(node, OpExpr) || IsA(node, DistinctExpr) || IsA(node, NullIfExpr))
+			collect_literals(qp_context, ((OpExpr *) node)->args, false);
+		else if (IsA(node, ScalarArrayOpExpr))
+			collect_literals(qp_context, ((ScalarArrayOpExpr *) node)->args, true);
+	}
+
 	if (IsA(node, FuncExpr) && fexpr->funcid == cachedInfo.fake_func)
 	{
 		if (qp_context->collect)
@@ -847,69 +2079,6 @@ sr_query_expr_walker(Node *node, void *context)
 	return expression_tree_walker(node, sr_query_expr_walker, context);
 }
 
-static bool
-sr_query_fake_const_expr_walker(Node *node, void *context)
-{
-	FuncExpr	*fexpr = (FuncExpr *) node;
-
-	if (node == NULL)
-		return false;
-
-	if (IsA(node, FuncExpr) && fexpr->funcid == cachedInfo.fake_func)
-	{
-		Const		   *fakeconst;
-
-		fakeconst = makeConst(23, -1,  0, 4, (Datum) 0, false, true);
-		fexpr->args = list_make1(fakeconst);
-	}
-
-	return expression_tree_walker(node, sr_query_fake_const_expr_walker, context);
-}
-
-static bool
-sr_query_fake_const_walker(Node *node, void *context)
-{
-	if (node == NULL)
-		return false;
-
-	// check for nodes that special work is required for, eg:
-	if (IsA(node, FromExpr))
-		return sr_query_fake_const_expr_walker(node, context);
-
-	// for any node type not specially processed, do:
-	if (IsA(node, Query))
-	{
-		Query	*q = (Query *) node;
-		return query_tree_walker(q, sr_query_fake_const_walker, context, 0);
-	}
-
-	return false;
-}
-
-static Datum
-get_query_hash(Query *node)
-{
-	Datum			result;
-	Node		   *copy;
-	MemoryContext	tmpctx,
-					oldctx;
-	char		   *temp;
-
-	tmpctx = AllocSetContextCreate(CurrentMemoryContext,
-									  "temporary context",
-									  ALLOCSET_DEFAULT_SIZES);
-
-	oldctx = MemoryContextSwitchTo(tmpctx);
-	copy = copyObject((Node *) node);
-	sr_query_fake_const_walker(copy, NULL);
-	temp = nodeToString(copy);
-	result = hash_any((unsigned char *) temp, strlen(temp));
-	MemoryContextSwitchTo(oldctx);
-	MemoryContextDelete(tmpctx);
-
-	return result;
-}
-
 static const struct config_enum_entry log_usage_options[] = {
 	{"none", 0, true},
 	{"debug", DEBUG2, true},
@@ -925,6 +2094,58 @@ static const struct config_enum_entry log_usage_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry capture_mode_options[] = {
+	{"sync", SR_PLAN_CAPTURE_SYNC, false},
+	{"async", SR_PLAN_CAPTURE_ASYNC, false},
+	{NULL, 0, false}
+};
+
+static void
+sr_plan_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (srplan_shmem_request_hook_next)
+		srplan_shmem_request_hook_next();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SrPlanSharedState)));
+	RequestAddinShmemSpace(sr_plan_filter_shmem_size());
+	RequestAddinShmemSpace(sr_plan_capture_shmem_size());
+	RequestAddinShmemSpace(sr_plan_stats_shmem_size());
+	RequestAddinShmemSpace(sr_plan_template_shmem_size());
+	RequestAddinShmemSpace(sr_plan_store_shmem_size());
+	RequestAddinShmemSpace(sr_plan_archive_shmem_size());
+	sr_plan_stats_shmem_request();
+	sr_plan_store_shmem_request();
+	sr_plan_archive_shmem_request();
+}
+
+static void
+sr_plan_shmem_startup(void)
+{
+	bool		found;
+
+	if (srplan_shmem_startup_hook_next)
+		srplan_shmem_startup_hook_next();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared_state = ShmemInitStruct("sr_plan shared state",
+								   sizeof(SrPlanSharedState), &found);
+	if (!found)
+	{
+		pg_atomic_init_u64(&shared_state->skipped_lookups, 0);
+		pg_atomic_init_u64(&shared_state->sr_plans_changes, 0);
+	}
+
+	sr_plan_filter_shmem_init();
+	sr_plan_capture_shmem_init();
+	sr_plan_stats_shmem_init();
+	sr_plan_template_shmem_init();
+	sr_plan_store_shmem_init();
+	sr_plan_archive_shmem_init();
+	LWLockRelease(AddinShmemInitLock);
+}
+
 void
 _PG_init(void)
 {
@@ -950,6 +2171,41 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomIntVariable("sr_plan.plan_cache_size",
+							"Maximum number of frozen plans cached by each backend.",
+							"Zero disables the cache.",
+							&sr_plan_cache_size,
+							256,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sr_plan.use_query_id",
+							 "Use queryId computed by other modules for query hash.",
+							 "Constants of the query are still taken into account.",
+							 &sr_plan_use_query_id,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sr_plan.auto_parameterize",
+							 "Treat literals of query conditions as parameters of frozen plans.",
+							 "Plans of queries differing only in such literals are the same generic plan.",
+							 &sr_plan_auto_parameterize,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("sr_plan.log_usage",
 							 "Log cached plan usage with specified level",
 							 NULL,
@@ -962,6 +2218,243 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("sr_plan.track_stats",
+							 "Collect statistics of frozen plans usage.",
+							 NULL,
+							 &sr_plan_track_stats,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.stats_max",
+							"Maximum number of plans tracked in sr_plan_stats.",
+							NULL,
+							&sr_plan_stats_max,
+							1000,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sr_plan.filter_size",
+							"Size of filter of enabled plans per database.",
+							"Zero disables the filter.",
+							&sr_plan_filter_size,
+							8,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sr_plan.filter_databases",
+							"Number of databases having filter of enabled plans.",
+							NULL,
+							&sr_plan_filter_databases,
+							16,
+							0,
+							INT_MAX / 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sr_plan.shared_store",
+							 "Share enabled plans loaded by backends in dynamic shared memory.",
+							 "Requires PostgreSQL 11 or later.",
+							 &sr_plan_shared_store,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.shared_store_size",
+							"Maximum size of shared store of enabled plans.",
+							NULL,
+							&sr_plan_shared_store_size,
+							64,
+							1,
+							MAX_KILOBYTES / 1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sr_plan.archive",
+							 "Keep enabled plans of all databases in a file loaded at startup.",
+							 NULL,
+							 &sr_plan_archive,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.archive_size",
+							"Maximum size of the archive of enabled plans.",
+							NULL,
+							&sr_plan_archive_size,
+							8,
+							1,
+							1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sr_plan.lookup_nowait",
+							 "Don't wait for locks on sr_plans to look up a frozen plan.",
+							 "If sr_plans is locked, the query is planned as usual.",
+							 &cachedInfo.lookup_nowait,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sr_plan.prewarm",
+							 "Load enabled plans into the plan cache on first query of a backend.",
+							 NULL,
+							 &prewarm_on_start,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sr_plan.use_templates",
+							 "Use plans saved by sr_plan_template_save() in any database.",
+							 "Plans enabled in sr_plans of the database take precedence.",
+							 &sr_plan_use_templates,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("sr_plan.capture_min_duration",
+							 "Minimum planning time of a query to save its plan, in milliseconds.",
+							 NULL,
+							 &capture_min_duration,
+							 0.0,
+							 0.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("sr_plan.capture_min_cost",
+							 "Minimum total cost of a plan to save it.",
+							 NULL,
+							 &capture_min_cost,
+							 0.0,
+							 0.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("sr_plan.capture_sample_rate",
+							 "Fraction of new plans to save.",
+							 NULL,
+							 &capture_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.capture_max_per_second",
+							"Maximum number of plans saved by a backend per second.",
+							"Zero means no limit.",
+							&capture_max_per_second,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("sr_plan.capture_mode",
+							 "How plans captured by write_mode are saved.",
+							 "With async, plans are saved by a background worker "
+							 "and the query does not wait for a lock on sr_plans.",
+							 &cachedInfo.capture_mode,
+							 SR_PLAN_CAPTURE_SYNC,
+							 capture_mode_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.capture_queue_length",
+							"Number of captured plans waiting to be saved.",
+							"Zero disables async capture.",
+							&sr_plan_capture_queue_length,
+							32,
+							0,
+							INT_MAX / 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sr_plan.capture_entry_size",
+							"Maximum size of a captured plan in the queue.",
+							"Larger plans are saved synchronously.",
+							&sr_plan_capture_entry_size,
+							32,
+							1,
+							MAX_KILOBYTES / 1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	/* Shared memory is available only if loaded by shared_preload_libraries */
+	if (process_shared_preload_libraries_in_progress)
+	{
+#if PG_VERSION_NUM >= 150000
+		srplan_shmem_request_hook_next = shmem_request_hook;
+		shmem_request_hook = &sr_plan_shmem_request;
+#else
+		sr_plan_shmem_request();
+#endif
+		srplan_shmem_startup_hook_next = shmem_startup_hook;
+		shmem_startup_hook = &sr_plan_shmem_startup;
+	}
+
+	sr_plan_params_init();
+
 	srplan_planner_hook_next = planner_hook;
 	planner_hook = &sr_planner;
 
@@ -987,6 +2480,191 @@ _p(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 }
 
+/*
+ * Statement trigger on sr_plans: make every backend (including this one,
+ * on the next CommandCounterIncrement) drop its cached plans.
+ */
+Datum
+sr_plan_invalidate_cache(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "sr_plan_invalidate_cache: not fired by trigger manager");
+
+	/*
+	 * Plans of dropped relations are evicted on invalidation of these
+	 * relations, other cached plans stay. Known plans are forgotten here,
+	 * other backends forget them on the same invalidation.
+	 */
+	if (!deleting_dropped_plans)
+		CacheInvalidateRelcache(trigdata->tg_relation);
+	else
+		sr_plan_forget_plans();
+	count_sr_plans_change();
+	sr_plan_store_invalidate();
+
+	/* Filter of enabled plans is only able to grow by itself */
+	if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+	{
+		sr_plan_filter_invalidate();
+		sr_plan_archive_invalidate();
+	}
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Sorted Oids of relations dropped by the current command, as returned by
+ * pg_event_trigger_dropped_objects().
+ */
+static Oid *
+dropped_relations(int *nrelations)
+{
+	FmgrInfo		flinfo;
+	ReturnSetInfo	rsinfo;
+	TupleTableSlot *slot;
+	Oid			   *relations;
+	int				maxrelations = 16;
+	int				i;
+	int				n;
+#if PG_VERSION_NUM >= 120000
+	LOCAL_FCINFO(fcinfo, 0);
+#else
+	FunctionCallInfoData fcinfo_data;
+	FunctionCallInfo fcinfo = &fcinfo_data;
+#endif
+
+	MemSet(&rsinfo, 0, sizeof(rsinfo));
+	rsinfo.type = T_ReturnSetInfo;
+	rsinfo.econtext = CreateStandaloneExprContext();
+	rsinfo.allowedModes = (int) SFRM_Materialize;
+
+	fmgr_info(F_PG_EVENT_TRIGGER_DROPPED_OBJECTS, &flinfo);
+	InitFunctionCallInfoData(*fcinfo, &flinfo, 0, InvalidOid, NULL,
+							 (Node *) &rsinfo);
+	(void) FunctionCallInvoke(fcinfo);
+
+	relations = palloc(sizeof(Oid) * maxrelations);
+	*nrelations = 0;
+	if (rsinfo.setResult != NULL)
+	{
+#if PG_VERSION_NUM >= 120000
+		slot = MakeSingleTupleTableSlot(rsinfo.setDesc, &TTSOpsMinimalTuple);
+#else
+		slot = MakeSingleTupleTableSlot(rsinfo.setDesc);
+#endif
+		while (tuplestore_gettupleslot(rsinfo.setResult, true, false, slot))
+		{
+			bool		isnull;
+			Datum		classid = slot_getattr(slot, 1, &isnull);
+			Datum		objid = slot_getattr(slot, 2, &isnull);
+			Datum		objsubid = slot_getattr(slot, 3, &isnull);
+
+			/* Plans may refer to tables, indexes, views and so on */
+			if (DatumGetObjectId(classid) != RelationRelationId ||
+				DatumGetInt32(objsubid) != 0)
+				continue;
+
+			if (*nrelations >= maxrelations)
+			{
+				maxrelations *= 2;
+				relations = repalloc(relations, sizeof(Oid) * maxrelations);
+			}
+			relations[(*nrelations)++] = DatumGetObjectId(objid);
+		}
+		ExecDropSingleTupleTableSlot(slot);
+		tuplestore_end(rsinfo.setResult);
+	}
+	FreeExprContext(rsinfo.econtext, true);
+
+	qsort(relations, *nrelations, sizeof(Oid), oid_cmp);
+	n = 0;
+	for (i = 0; i < *nrelations; i++)
+	{
+		if (n == 0 || relations[n - 1] != relations[i])
+			relations[n++] = relations[i];
+	}
+	*nrelations = n;
+
+	return relations;
+}
+
+/*
+ * sql_drop event trigger: remove plans using dropped tables or indexes.
+ *
+ * Plans of all dropped relations are deleted at once, sr_plans_query_oids
+ * and sr_plans_query_index_oids are looked up by the whole array.
+ */
+Datum
+sr_plan_invalid_table(PG_FUNCTION_ARGS)
+{
+	Oid				sr_plans_oid;
+	Oid			   *relations;
+	int				nrelations;
+	Oid				argtype = OIDARRAYOID;
+	Datum			arg;
+	char		   *query;
+	int				ret;
+
+	if (!CALLED_AS_EVENT_TRIGGER(fcinfo))
+		elog(ERROR, "sr_plan_invalid_table: not fired by event trigger manager");
+
+	sr_plans_oid = sr_plan_plans_relid();
+	if (!OidIsValid(sr_plans_oid))
+		PG_RETURN_VOID();
+
+	relations = dropped_relations(&nrelations);
+	if (nrelations == 0 ||
+		bsearch(&sr_plans_oid, relations, nrelations, sizeof(Oid),
+				oid_cmp) != NULL)
+		PG_RETURN_VOID();
+
+	arg = PointerGetDatum(sr_plan_oid_array(relations, nrelations));
+	query = psprintf("DELETE FROM %s WHERE "
+					 "reloids OPERATOR(pg_catalog.&&) $1 OR "
+					 "index_reloids OPERATOR(pg_catalog.&&) $1",
+					 quote_qualified_identifier(get_namespace_name(cachedInfo.schema_oid),
+												SR_PLANS_TABLE_NAME));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "sr_plan_invalid_table: SPI_connect failed");
+
+	deleting_dropped_plans = true;
+	PG_TRY();
+	{
+		ret = SPI_execute_with_args(query, 1, &argtype, &arg, NULL, false, 0);
+	}
+	PG_CATCH();
+	{
+		deleting_dropped_plans = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	deleting_dropped_plans = false;
+
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "sr_plan_invalid_table: SPI_execute_with_args returned %d", ret);
+
+	SPI_finish();
+	pfree(query);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Number of lookups skipped by sr_plan.lookup_nowait because sr_plans
+ * was locked.
+ */
+Datum
+sr_plan_skipped_lookups(PG_FUNCTION_ARGS)
+{
+	if (shared_state)
+		PG_RETURN_INT64((int64) pg_atomic_read_u64(&shared_state->skipped_lookups));
+
+	PG_RETURN_INT64((int64) local_skipped_lookups);
+}
+
 /*
  *	Construct the result tupledesc for an EXPLAIN
  */
@@ -1087,7 +2765,7 @@ show_plan(PG_FUNCTION_ARGS)
 		snapshot = RegisterSnapshot(GetLatestSnapshot());
 		ScanKeyInit(&key, 1, BTEqualStrategyNumber, F_INT4EQ, query_hash);
 		pl_stmt = lookup_plan_by_query_hash(snapshot, sr_index_rel, sr_plans_heap,
-											&key, NULL, index, &queryString);
+											&key, index, &queryString, NULL);
 		if (pl_stmt == NULL)
 			ereport(ERROR,
 					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -1188,7 +2866,7 @@ show_plan(PG_FUNCTION_ARGS)
  *
  * 'visitor' is applied right before return.
  */
-static void
+void
 plan_tree_visitor(Plan *plan,
 				  void (*visitor) (Plan *plan, void *context),
 				  void *context)
@@ -1213,8 +2891,11 @@ plan_tree_visitor(Plan *plan,
 			break;
 
 		case T_ModifyTable:
+#if PG_VERSION_NUM < 140000
 			foreach (l, ((ModifyTable *) plan)->plans)
 				plan_tree_visitor((Plan *) lfirst(l), visitor, context);
+#endif
+			/* since 14 the only subplan is lefttree */
 			break;
 
 		case T_Append:
@@ -1248,7 +2929,7 @@ plan_tree_visitor(Plan *plan,
 	visitor(plan, context);
 }
 
-static void
+void
 execute_for_plantree(PlannedStmt *planned_stmt,
 					 void (*proc) (void *context, Plan *plan),
 					 void *context)
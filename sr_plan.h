@@ -8,6 +8,7 @@
 #include "nodes/print.h"
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
+#include "utils/array.h"
 #include "utils/jsonb.h"
 #include "utils/builtins.h"
 #include "utils/rel.h"
@@ -17,6 +18,7 @@
 #include "utils/tqual.h"
 #endif
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/datum.h"
 #include "utils/inval.h"
 #include "utils/snapmgr.h"
@@ -32,6 +34,7 @@
 #include "commands/explain.h"
 #include "utils/syscache.h"
 #include "funcapi.h"
+#include "lib/ilist.h"
 
 #define SR_PLANS_TABLE_NAME	"sr_plans"
 #define SR_PLANS_TABLE_QUERY_INDEX_NAME	"sr_plans_query_hash_idx"
@@ -44,6 +47,199 @@ void *jsonb_to_node_tree(Jsonb *json, deserialize_hook_type hook_ptr, void *cont
 Jsonb *node_tree_to_jsonb(const void *obj, Oid fake_func, bool skip_location_from_node);
 void common_walker(const void *obj, void (*callback) (void *));
 
+/* plan_params.c */
+typedef struct SrPlanParamSlot
+{
+	int			location;		/* of _p() in the query */
+	int			paramid;		/* PARAM_EXEC Param replacing _p() */
+	Oid			paramtype;
+	Node	   *arg;			/* argument _p() was captured with */
+} SrPlanParamSlot;
+
+void sr_plan_params_init(void);
+bool sr_plan_params_convert(PlannedStmt *pl_stmt, Oid fake_func,
+							SrPlanParamSlot **slots, int *nslots);
+PlannedStmt *sr_plan_params_bind(PlannedStmt *pl_stmt, SrPlanParamSlot *slots,
+								 int nslots, List *args);
+PlannedStmt *sr_plan_literals_bind(PlannedStmt *pl_stmt, List *values);
+
+/* plan_cache.c */
+typedef struct SrPlanCacheEntry
+{
+	int32			query_hash;		/* hash key, must be first */
+	int32			plan_hash;
+	PlannedStmt	   *pl_stmt;
+	int				nslots;			/* -1 if _p() calls are not converted */
+	SrPlanParamSlot *slots;			/* Params replacing _p() calls */
+	int				nsites;
+	FuncExpr	  **sites;			/* _p() calls of unconverted pl_stmt */
+	struct SrPlanCacheTree *tree;	/* memory of all above */
+	int				ndeps;
+	struct SrPlanCacheDep *deps;	/* relations and indexes used by the plan */
+	dlist_node		lru_node;
+} SrPlanCacheEntry;
+
+extern int	sr_plan_cache_size;
+
+/* Result of sr_plan_cache_prewarm() */
+typedef struct SrPlanPrewarmStats
+{
+	int64		plans;
+	int64		bytes;			/* size of the plans in sr_plans */
+	double		time;			/* in msec */
+} SrPlanPrewarmStats;
+
+SrPlanCacheEntry *sr_plan_cache_lookup(int32 query_hash);
+SrPlanCacheEntry *sr_plan_cache_store(int32 query_hash, int32 plan_hash,
+									  PlannedStmt *pl_stmt, Oid fake_func);
+void sr_plan_cache_pin(SrPlanCacheEntry *entry);
+void sr_plan_cache_reset(void);
+void sr_plan_cache_relcache(Oid relid);
+bool sr_plan_cache_prewarm(Oid sr_plans_oid, Oid fake_func, bool nowait,
+						   SrPlanPrewarmStats *stats);
+bool sr_plan_known_plan(int32 query_hash, int32 plan_hash);
+void sr_plan_remember_plan(int32 query_hash, int32 plan_hash);
+void sr_plan_forget_plans(void);
+
+/* query_hash.c */
+extern bool	sr_plan_use_query_id;
+extern bool	sr_plan_auto_parameterize;
+
+Datum sr_query_hash(Query *query, Oid fake_func, bool literals);
+
+/*
+ * Operand of an operator which becomes a parameter of the frozen plan in
+ * sr_plan.auto_parameterize mode. Constants made by the parser itself have
+ * no location.
+ */
+#define sr_plan_is_literal(node) \
+	(IsA((node), Const) && ((Const *) (node))->location >= 0 && \
+	 ((Const *) (node))->consttype != UNKNOWNOID)
+
+/* Plan captured by sr_plan.write_mode, ready to be saved in sr_plans */
+typedef struct SrPlanCapture
+{
+	int32		query_hash;
+	int32		plan_hash;
+	int64		query_id;
+	const char *query;
+	text	   *plan;
+	int			nreloids;
+	Oid		   *reloids;
+	int			nindex_reloids;
+	Oid		   *index_reloids;
+} SrPlanCapture;
+
+/* sr_plan.capture_mode */
+typedef enum
+{
+	SR_PLAN_CAPTURE_SYNC,
+	SR_PLAN_CAPTURE_ASYNC
+} SrPlanCaptureMode;
+
+/* sr_plan.c */
+bool sr_plan_save_captured(SrPlanCapture *captures, int ncaptures);
+void sr_plan_make_capture(SrPlanCapture *capture, Query *parse,
+						  const char *query_text, int32 query_hash,
+						  int32 plan_hash, char *plan_text,
+						  PlannedStmt *pl_stmt);
+ArrayType *sr_plan_oid_array(Oid *oids, int len);
+List *sr_plan_index_oids(PlannedStmt *pl_stmt);
+Oid sr_plan_fake_func(void);
+Oid sr_plan_plans_relid(void);
+bool sr_plan_hash_query_text(const char *query_text, Query **query,
+							 int32 *query_hash);
+List *sr_plan_param_sites(PlannedStmt *pl_stmt);
+void plan_tree_visitor(Plan *plan,
+					   void (*visitor) (Plan *plan, void *context),
+					   void *context);
+void execute_for_plantree(PlannedStmt *planned_stmt,
+						  void (*proc) (void *context, Plan *plan),
+						  void *context);
+
+/* capture.c */
+extern int	sr_plan_capture_queue_length;
+extern int	sr_plan_capture_entry_size;
+
+Size sr_plan_capture_shmem_size(void);
+void sr_plan_capture_shmem_init(void);
+bool sr_plan_capture_enqueue(SrPlanCapture *capture);
+void sr_plan_capture_collect(void);
+void sr_plan_capture_forget(void);
+PGDLLEXPORT void sr_plan_capture_main(Datum main_arg);
+
+/* stats.c */
+typedef enum
+{
+	SR_PLAN_STATS_HIT,
+	SR_PLAN_STATS_MISS,
+	SR_PLAN_STATS_CAPTURE
+} SrPlanStatsKind;
+
+extern bool	sr_plan_track_stats;
+extern int	sr_plan_stats_max;
+
+Size sr_plan_stats_shmem_size(void);
+void sr_plan_stats_shmem_request(void);
+void sr_plan_stats_shmem_init(void);
+void sr_plan_stats_update(SrPlanStatsKind kind, int32 query_hash,
+						  int32 plan_hash, double lookup_time,
+						  double deserialize_time, int64 plan_bytes);
+
+/* plan_export.c */
+List *sr_plan_export_names(const char *plan_text);
+HTAB *sr_plan_object_cache_create(const char *name, MemoryContext mcxt);
+char *sr_plan_remap_plan(const char *plan_text, char **objects, int nobjects,
+						 HTAB *cache, const char **missing, List **relations);
+
+/* plan_template.c */
+extern bool	sr_plan_use_templates;
+
+Size sr_plan_template_shmem_size(void);
+void sr_plan_template_shmem_init(void);
+void sr_plan_template_check(void);
+PlannedStmt *sr_plan_template_lookup(int32 query_hash, int32 *plan_hash);
+void sr_plan_template_relcache(Oid relid);
+
+/* plan_store.c */
+extern bool	sr_plan_shared_store;
+extern int	sr_plan_shared_store_size;
+
+Size sr_plan_store_shmem_size(void);
+void sr_plan_store_shmem_request(void);
+void sr_plan_store_shmem_init(void);
+PlannedStmt *sr_plan_store_lookup(Oid sr_plans_oid, int32 query_hash,
+								  int32 *plan_hash, uint64 *generation);
+void sr_plan_store_put(Oid sr_plans_oid, int32 query_hash, int32 plan_hash,
+					   uint64 generation, PlannedStmt *pl_stmt);
+void sr_plan_store_invalidate(void);
+
+/* plan_archive.c */
+extern bool	sr_plan_archive;
+extern int	sr_plan_archive_size;
+
+Size sr_plan_archive_shmem_size(void);
+void sr_plan_archive_shmem_request(void);
+void sr_plan_archive_shmem_init(void);
+PlannedStmt *sr_plan_archive_lookup(Oid sr_plans_oid, int32 query_hash,
+									int32 *plan_hash);
+void sr_plan_archive_invalidate(void);
+void sr_plan_archive_relcache(Oid relid, Oid sr_plans_oid);
+
+/* plan_partitions.c */
+PlannedStmt *sr_plan_partitions_refresh(PlannedStmt *pl_stmt);
+List *sr_plan_partitions_reloids(PlannedStmt *pl_stmt);
+List *sr_plan_partitions_index_oids(PlannedStmt *pl_stmt, List *index_oids);
+
+/* filter.c */
+extern int	sr_plan_filter_size;
+extern int	sr_plan_filter_databases;
+
+Size sr_plan_filter_shmem_size(void);
+void sr_plan_filter_shmem_init(void);
+bool sr_plan_filter_lookup(Oid sr_plans_oid, int32 query_hash);
+void sr_plan_filter_invalidate(void);
+
 /*
  * MakeTupleTableSlot()
  */
@@ -0,0 +1,266 @@
+/*
+ * stats.c
+ *		Shared-memory statistics of frozen plans usage.
+ *
+ * Counters are kept per (database, query_hash, plan_hash) in a hash table of
+ * sr_plan.stats_max entries. Misses of a database are accounted in a single
+ * entry with zero query_hash and plan_hash, so that queries which have no
+ * frozen plan don't fill the table. Like in pg_stat_statements, the table is
+ * only locked exclusively to add or remove entries, while counters of an
+ * existing entry are updated under its own spinlock. New entries are not
+ * added when the table is full, which is checked before taking the lock
+ * exclusively.
+ */
+#include "sr_plan.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_stats);
+PG_FUNCTION_INFO_V1(sr_plan_stats_reset);
+
+#define SR_PLAN_STATS_COLS	10
+
+typedef struct SrPlanStatsKey
+{
+	Oid			dbid;
+	int32		query_hash;
+	int32		plan_hash;
+} SrPlanStatsKey;
+
+typedef struct SrPlanStatsCounters
+{
+	int64		hits;
+	int64		misses;
+	int64		captures;
+	double		total_lookup_time;	/* in msec */
+	double		max_lookup_time;
+	double		deserialize_time;
+	int64		plan_bytes;			/* size of the plan in sr_plans */
+} SrPlanStatsCounters;
+
+typedef struct SrPlanStatsEntry
+{
+	SrPlanStatsKey		key;		/* hash key, must be first */
+	slock_t				mutex;		/* protects counters */
+	SrPlanStatsCounters	counters;
+} SrPlanStatsEntry;
+
+bool	sr_plan_track_stats = true;
+int		sr_plan_stats_max = 1000;
+
+static LWLock  *stats_lock = NULL;
+static HTAB	   *stats_hash = NULL;
+
+Size
+sr_plan_stats_shmem_size(void)
+{
+	return hash_estimate_size(sr_plan_stats_max, sizeof(SrPlanStatsEntry));
+}
+
+void
+sr_plan_stats_shmem_request(void)
+{
+	RequestNamedLWLockTranche("sr_plan stats", 1);
+}
+
+void
+sr_plan_stats_shmem_init(void)
+{
+	HASHCTL		info;
+
+	stats_lock = &(GetNamedLWLockTranche("sr_plan stats"))->lock;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(SrPlanStatsKey);
+	info.entrysize = sizeof(SrPlanStatsEntry);
+	stats_hash = ShmemInitHash("sr_plan stats",
+							   sr_plan_stats_max, sr_plan_stats_max,
+							   &info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Account a hit, miss or capture of the plan.
+ */
+void
+sr_plan_stats_update(SrPlanStatsKind kind, int32 query_hash, int32 plan_hash,
+					 double lookup_time, double deserialize_time,
+					 int64 plan_bytes)
+{
+	SrPlanStatsKey		key;
+	SrPlanStatsEntry   *entry;
+	SrPlanStatsCounters *c;
+
+	if (!sr_plan_track_stats || stats_hash == NULL || sr_plan_stats_max == 0)
+		return;
+
+	key.dbid = MyDatabaseId;
+	if (kind == SR_PLAN_STATS_MISS)
+	{
+		key.query_hash = 0;
+		key.plan_hash = 0;
+	}
+	else
+	{
+		key.query_hash = query_hash;
+		key.plan_hash = plan_hash;
+	}
+
+	LWLockAcquire(stats_lock, LW_SHARED);
+	entry = (SrPlanStatsEntry *) hash_search(stats_hash, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		if (hash_get_num_entries(stats_hash) >= sr_plan_stats_max)
+		{
+			LWLockRelease(stats_lock);
+			return;
+		}
+
+		/* Need exclusive lock to add an entry */
+		LWLockRelease(stats_lock);
+		LWLockAcquire(stats_lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(stats_hash) >= sr_plan_stats_max)
+		{
+			entry = (SrPlanStatsEntry *) hash_search(stats_hash, &key,
+													 HASH_FIND, NULL);
+			if (entry == NULL)
+			{
+				LWLockRelease(stats_lock);
+				return;
+			}
+		}
+		else
+		{
+			entry = (SrPlanStatsEntry *) hash_search(stats_hash, &key,
+													 HASH_ENTER, &found);
+			if (!found)
+			{
+				SpinLockInit(&entry->mutex);
+				MemSet(&entry->counters, 0, sizeof(entry->counters));
+			}
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	c = &entry->counters;
+	switch (kind)
+	{
+		case SR_PLAN_STATS_HIT:
+			c->hits++;
+			break;
+		case SR_PLAN_STATS_MISS:
+			c->misses++;
+			break;
+		case SR_PLAN_STATS_CAPTURE:
+			c->captures++;
+			break;
+	}
+	c->total_lookup_time += lookup_time;
+	if (lookup_time > c->max_lookup_time)
+		c->max_lookup_time = lookup_time;
+	c->deserialize_time += deserialize_time;
+	if (plan_bytes > 0)
+		c->plan_bytes = plan_bytes;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(stats_lock);
+}
+
+/*
+ * sr_plan_stats() RETURNS SETOF record
+ */
+Datum
+sr_plan_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	SrPlanStatsEntry   *entry;
+
+	if (stats_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sr_plan must be loaded via shared_preload_libraries")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(stats_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum				values[SR_PLAN_STATS_COLS];
+		bool				nulls[SR_PLAN_STATS_COLS];
+		SrPlanStatsCounters	c;
+		int					i = 0;
+
+		SpinLockAcquire(&entry->mutex);
+		c = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = Int32GetDatum(entry->key.query_hash);
+		values[i++] = Int32GetDatum(entry->key.plan_hash);
+		values[i++] = Int64GetDatum(c.hits);
+		values[i++] = Int64GetDatum(c.misses);
+		values[i++] = Int64GetDatum(c.captures);
+		values[i++] = Float8GetDatum(c.total_lookup_time);
+		values[i++] = Float8GetDatum(c.max_lookup_time);
+		values[i++] = Float8GetDatum(c.deserialize_time);
+		values[i++] = Int64GetDatum(c.plan_bytes);
+		Assert(i == SR_PLAN_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(stats_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * sr_plan_stats_reset() RETURNS void
+ */
+Datum
+sr_plan_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	SrPlanStatsEntry   *entry;
+
+	if (stats_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sr_plan must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(stats_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(stats_hash, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(stats_lock);
+
+	PG_RETURN_VOID();
+}
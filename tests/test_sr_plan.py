@@ -25,7 +25,7 @@ my_dir = os.path.dirname(os.path.abspath(__file__))
 repo_dir = os.path.abspath(os.path.join(my_dir, '../'))
 temp_dir = tempfile.mkdtemp()
 
-upgrade_to = '1.2'
+upgrade_to = '1.3'
 check_upgrade_from = ['rel_1.0', '1.1.0']
 
 compilation = '''
@@ -85,6 +85,42 @@ class Tests(unittest.TestCase):
 
         return node
 
+    def test_concurrent_capture(self):
+        ''' Test capturing plans by concurrent sessions '''
+
+        script = os.path.join(temp_dir, 'capture.sql')
+        with open(script, 'w') as f:
+            f.write('\\set id random(1, 1000)\n')
+            f.write('SELECT * FROM test_table WHERE test_attr1 = _p(:id);\n')
+
+        with self.start_node() as node:
+            node.append_conf("sr_plan.write_mode = on\n")
+            node.reload()
+
+            with node.connect() as con:
+                # the capture holds the lock of the query until commit
+                con.begin()
+                con.execute(queries[0])
+
+                # would wait for the transaction above if the lock blocked
+                res = node.execute("set statement_timeout = '5s'; " +
+                                   queries[0])
+                self.assertEqual(res, [(10, 11)])
+                con.commit()
+
+            res = node.execute('select count(*) from sr_plans')
+            self.assertEqual(res, [(1, )])
+
+            node.pgbench_run(options=['-n', '-t', '200', '-f', script,
+                                      '-c', '4', '-j', '4'])
+
+            # sessions capturing the same query must not produce
+            # duplicates, _p() makes it one query for any :id
+            res = node.execute('SELECT count(DISTINCT query_hash), count(*) '
+                               'FROM sr_plans')
+            self.assertEqual(res, [(1, 1)])
+            node.stop()
+
     def test_hash_consistency(self):
         ''' Test query hash consistency '''
 
@@ -112,6 +148,540 @@ class Tests(unittest.TestCase):
 
             self.assertEqual(queries1, queries2)
 
+    def test_lookup_nowait(self):
+        ''' Test lookup of frozen plan while sr_plans is locked '''
+
+        with self.start_node() as node:
+            node.psql("set sr_plan.write_mode=on; " + queries[0])
+            node.psql("update sr_plans set enable = true")
+
+            with node.connect() as con:
+                con.begin()
+                con.execute("lock sr_plans in access exclusive mode")
+
+                # would hang without lookup_nowait
+                res = node.execute("set sr_plan.lookup_nowait=on; " + queries[0])
+                self.assertEqual(res, [(10, 11)])
+                con.rollback()
+
+            res = node.execute("select sr_plan_skipped_lookups()")
+            self.assertEqual(res, [(1, )])
+            node.stop()
+
+    def test_extended_protocol(self):
+        ''' Test capture and use of plans of prepared statements '''
+
+        script = os.path.join(temp_dir, 'prepared.sql')
+        with open(script, 'w') as f:
+            f.write('\\set id random(1, 20)\n')
+            f.write('SELECT * FROM test_table WHERE test_attr1 = :id;\n')
+
+        with self.start_node() as node:
+            pgbench = ['-n', '-M', 'prepared', '-t', '20', '-f', script]
+            node.safe_psql("alter system set sr_plan.write_mode = on")
+            node.reload()
+            node.pgbench_run(options=pgbench)
+            node.safe_psql("alter system reset sr_plan.write_mode")
+            node.reload()
+
+            # values bound at capture don't make different plans
+            res = node.execute("select count(*) from sr_plans "
+                               "where query like '%test_attr1 = $1%'")
+            self.assertEqual(res, [(1, )])
+
+            node.psql("update sr_plans set enable = true")
+            node.psql("select sr_plan_stats_reset()")
+            node.pgbench_run(options=pgbench)
+
+            res = node.execute("select sum(hits) > 0 from sr_plan_stats")
+            self.assertEqual(res, [(True, )])
+            node.stop()
+
+    def test_nested_statements(self):
+        ''' Test capture and reuse of plans of queries in functions '''
+
+        func = ("create function f(i int) returns int as $$ begin "
+                "return (select test_attr2 from test_table "
+                "where test_attr1 = i); end $$ language plpgsql immutable")
+        count = "select count(*) from sr_plans where query like '%attr1 = i%'"
+
+        with self.start_node() as node:
+            version = int(node.execute("show server_version_num")[0][0])
+            node.psql(func)
+
+            # f() is evaluated while the outer query is planned
+            node.psql("set sr_plan.write_mode=on; select f(10)")
+            res = node.execute(count)
+            self.assertEqual(res, [(1 if version >= 130000 else 0, )])
+
+            node.psql("set sr_plan.write_mode=on; "
+                      "select f(test_attr1) from test_table")
+            res = node.execute(count)
+            self.assertEqual(res, [(1, )])
+
+            # plancache keeps using the frozen plan without looking it up
+            node.psql("update sr_plans set enable = true")
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute("select sum(f(i % 20 + 1)) "
+                               "from generate_series(1, 100) i")
+            self.assertEqual(res, [(1150, )])
+
+            hits = node.execute("select sum(hits) from sr_plan_stats")[0][0]
+            self.assertGreater(hits, 0)
+            self.assertLess(hits, 20)
+            node.stop()
+
+    def test_parallel_params(self):
+        ''' Test _p() parameters of a frozen parallel plan '''
+
+        parallel = ("set max_parallel_workers_per_gather = 2; "
+                    "set parallel_setup_cost = 0; "
+                    "set parallel_tuple_cost = 0; "
+                    "set min_parallel_table_scan_size = 0; ")
+
+        with self.start_node() as node:
+            node.psql(parallel + "set sr_plan.write_mode=on; " + queries[0])
+            node.psql("update sr_plans set enable = true")
+
+            # parameters must reach workers both from sr_plans and the cache
+            q = "SELECT * FROM test_table WHERE test_attr1 = _p(%d);"
+            res = node.execute(parallel + q % 15)
+            self.assertEqual(res, [(15, 16)])
+            res = node.execute(parallel + q % 12 + q % 17)
+            self.assertEqual(res, [(17, 18)])
+            node.stop()
+
+    def test_modify_table(self):
+        ''' Test frozen plans of UPDATE, DELETE and INSERT ... SELECT '''
+
+        upd = ("UPDATE test_table SET test_attr2 = test_attr2 + 1 "
+               "WHERE test_attr1 = _p(%d) RETURNING test_attr2 * _p(1);")
+        ins = ("WITH d AS (DELETE FROM test_table WHERE test_attr1 = _p(%d) "
+               "RETURNING *) INSERT INTO test_table SELECT * FROM d;")
+
+        with self.start_node() as node:
+            node.psql("set sr_plan.write_mode=on; " + upd % 1 + ins % 1)
+            node.psql("set sr_plan.write_mode=on; INSERT INTO test_table VALUES (0, 0)")
+            res = node.execute("select count(*) from sr_plans")
+            self.assertEqual(res, [(2, )])
+
+            node.psql("update sr_plans set enable = true")
+            node.psql("select sr_plan_stats_reset()")
+
+            # parameters are restored both in quals and RETURNING
+            res = node.execute(upd % 5 + upd % 5)
+            self.assertEqual(res, [(8, )])
+            res = node.execute(ins % 5 + "SELECT count(*) FROM test_table")
+            self.assertEqual(res, [(21, )])
+
+            res = node.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(3, )])
+
+            # plans are invalidated along with the table
+            node.psql("drop table test_table")
+            res = node.execute("select count(*) from sr_plans")
+            self.assertEqual(res, [(0, )])
+            node.stop()
+
+    def test_auto_parameterize(self):
+        ''' Test frozen plans shared by queries differing in literals '''
+
+        auto = "set sr_plan.auto_parameterize = on; "
+        q = "SELECT * FROM test_table WHERE test_attr1 = %d;"
+        q_in = "SELECT * FROM test_table WHERE test_attr1 IN (%d, %d);"
+
+        with self.start_node() as node:
+            node.psql("create index on test_table(test_attr1)")
+            for i in range(1, 6):
+                node.psql(auto + "set sr_plan.write_mode=on; " + q % i)
+            node.psql(auto + "set sr_plan.write_mode=on; " + q_in % (1, 2))
+
+            # literals of conditions don't make different queries
+            res = node.execute("select count(*) from sr_plans")
+            self.assertEqual(res, [(2, )])
+            res = node.execute("select count(*) from sr_plans "
+                               "where query like '%test_attr1 = 1;'")
+            self.assertEqual(res, [(1, )])
+
+            node.psql("update sr_plans set enable = true")
+            node.psql("select sr_plan_stats_reset()")
+
+            # both from sr_plans and the cache
+            res = node.execute(auto + q % 15 + q % 17)
+            self.assertEqual(res, [(17, 18)])
+            res = node.execute(auto + q_in % (3, 19))
+            self.assertEqual(res, [(3, 4), (19, 20)])
+
+            res = node.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(3, )])
+
+            # values are not a part of the query without auto_parameterize
+            res = node.execute(q % 15)
+            self.assertEqual(res, [(15, 16)])
+            res = node.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(3, )])
+            node.stop()
+
+    def test_export_import(self):
+        ''' Test moving frozen plans to a cluster with other Oids '''
+
+        staging = ("create table staging(query text, enable boolean, "
+                   "plan text, objects text[])")
+
+        with self.start_node() as node1, self.start_node() as node2:
+            node1.psql("create index test_idx on test_table(test_attr1)")
+            node1.psql("set enable_seqscan=off; set sr_plan.write_mode=on; " +
+                       queries[0])
+            node1.psql("update sr_plans set enable = true")
+            rows = node1.execute("select * from sr_plan_export()")
+            self.assertEqual(len(rows), 1)
+
+            # shift Oids of the same objects
+            node2.psql("create table pad(a int); drop table test_table")
+            node2.psql(sql_init)
+            node2.psql("create index test_idx on test_table(test_attr1)")
+            node2.psql(staging)
+            with node2.connect() as con:
+                for row in rows:
+                    con.execute("insert into staging values (%s, %s, %s, %s)",
+                                *row)
+                con.commit()
+
+            res = node2.execute("select sr_plan_import('staging')")
+            self.assertEqual(res, [(1, )])
+            res = node2.execute("select sr_plan_import('staging')")
+            self.assertEqual(res, [(0, )])
+            res = node2.execute("select 'test_table'::regclass = any(reloids), "
+                                "'test_idx'::regclass = any(index_reloids) "
+                                "from sr_plans")
+            self.assertEqual(res, [(True, True)])
+
+            node2.psql("select sr_plan_stats_reset()")
+            res = node2.execute(queries[0].replace("10", "15"))
+            self.assertEqual(res, [(15, 16)])
+            res = node2.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(1, )])
+
+            node1.stop()
+            node2.stop()
+
+    def test_export_partitions(self):
+        ''' Test moving plans pruning partitions at run time '''
+
+        query = "select count(*) from parts where id = (select 15);"
+        staging = ("create table staging(query text, enable boolean, "
+                   "plan text, objects text[])")
+        partitions = ("select string_agg(oid::text, ' ' order by relname) "
+                      "from pg_class where relname like 'parts\\_%'")
+
+        with self.start_node() as node1, self.start_node() as node2:
+            version = int(node1.execute("show server_version_num")[0][0])
+            if version < 120000:
+                node1.stop()
+                node2.stop()
+                return
+
+            # shift Oids of the same objects
+            node2.psql("create table pad(a int)")
+            for node in (node1, node2):
+                node.psql("create table parts (id int) partition by range (id)")
+                for i in range(2):
+                    node.psql("create table parts_%d partition of parts "
+                              "for values from (%d) to (%d)"
+                              % (i, i * 10, i * 10 + 10))
+                node.psql("insert into parts select generate_series(0, 19)")
+
+            node1.psql("set sr_plan.write_mode=on; " + query)
+            node1.psql("update sr_plans set enable = true")
+            rows = node1.execute("select * from sr_plan_export()")
+            self.assertEqual(len(rows), 1)
+
+            node2.psql(staging)
+            with node2.connect() as con:
+                for row in rows:
+                    con.execute("insert into staging values (%s, %s, %s, %s)",
+                                *row)
+                con.commit()
+
+            res = node2.execute("select sr_plan_import('staging')")
+            self.assertEqual(res, [(1, )])
+
+            # partitions to prune are the local ones
+            res = node2.execute("select substring(plan from "
+                                "':relid_map ([0-9 ]+[0-9])') from sr_plans")
+            self.assertEqual(res, node2.execute(partitions))
+
+            node2.psql("select sr_plan_stats_reset()")
+            res = node2.execute(query + "select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(1, )])
+            res = node2.execute(query)
+            self.assertEqual(res, [(1, )])
+
+            node1.stop()
+            node2.stop()
+
+    def test_templates(self):
+        ''' Test plans of one database used by another '''
+
+        tpl = "set sr_plan.use_templates = on; "
+
+        with self.start_node() as node:
+            node.psql("create index test_idx on test_table(test_attr1)")
+            node.psql("set enable_seqscan=off; set sr_plan.write_mode=on; " +
+                      queries[0])
+            node.psql("update sr_plans set enable = true")
+            res = node.execute("select sr_plan_template_save()")
+            self.assertEqual(res, [(1, )])
+
+            # same schema with other Oids
+            node.psql("create database tenant")
+            node.psql("create table pad(a int)", dbname="tenant")
+            node.psql("create extension sr_plan", dbname="tenant")
+            node.psql(sql_init, dbname="tenant")
+            node.psql("create index test_idx on test_table(test_attr1)",
+                      dbname="tenant")
+
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(tpl + queries[0].replace("10", "15"),
+                               dbname="tenant")
+            self.assertEqual(res, [(15, 16)])
+            res = node.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(1, )])
+            res = node.execute("select count(*) from sr_plans",
+                               dbname="tenant")
+            self.assertEqual(res, [(0, )])
+
+            # templates using missing objects are ignored
+            node.psql("drop index test_idx", dbname="tenant")
+            res = node.execute(tpl + queries[0], dbname="tenant")
+            self.assertEqual(res, [(10, 11)])
+            res = node.execute("select sum(hits) from sr_plan_stats")
+            self.assertEqual(res, [(1, )])
+            node.stop()
+
+    def test_relcache_eviction(self):
+        ''' Test eviction of cached plans using a changed relation '''
+
+        other = "select test_attr2 from other_table where test_attr1 = _p(1);"
+        stats = ("select query_hash, total_lookup_time > 0 from sr_plan_stats "
+                 "order by 2")
+
+        with self.start_node() as node:
+            node.psql("create table other_table as select * from test_table")
+            node.psql("set sr_plan.write_mode=on; " + queries[0] + other)
+            node.psql("update sr_plans set enable = true")
+
+            with node.connect(autocommit=True) as con:
+                con.execute(queries[0])
+                con.execute(other)
+                con.execute("select sr_plan_stats_reset()")
+
+                # only the plan of other_table is looked up again
+                con.execute("create index on other_table(test_attr2)")
+                con.execute(queries[0])
+                con.execute(other)
+                res = con.execute(stats)
+                self.assertEqual([r[1] for r in res], [False, True])
+            node.stop()
+
+    def test_drop_relations(self):
+        ''' Test removal of plans using dropped relations '''
+
+        tables = ["t%d" % i for i in range(3)]
+        plans = "select count(*) from sr_plans"
+
+        with self.start_node() as node:
+            for t in tables:
+                node.psql("create table %s as select * from test_table" % t)
+            node.psql("create index t2_idx on t2(test_attr1)")
+            node.psql("set enable_seqscan=off; set sr_plan.write_mode=on; " +
+                      "".join(queries[0].replace("test_table", t)
+                              for t in tables + ["test_table"]))
+            node.psql("update sr_plans set enable = true")
+            self.assertEqual(node.execute(plans), [(4, )])
+
+            # one command drops both tables and the index
+            node.psql("drop table t0, t1; drop index t2_idx")
+            res = node.execute("select count(*) from sr_plans "
+                               "where query like '%test_table%'")
+            self.assertEqual(res, [(1, )])
+            self.assertEqual(node.execute(plans), [(1, )])
+            node.stop()
+
+    def test_partitions(self):
+        ''' Test frozen plans following partitions of a table '''
+
+        query = "select count(*) from events where id = _p(5);"
+        # _p() is volatile, so there is no runtime pruning by the key
+        key_query = ("select count(*) from events "
+                     "where id = _p(5) and created >= _p(0);")
+        stats = "select sum(hits), sum(misses) from sr_plan_stats"
+
+        with self.start_node() as node:
+            version = int(node.execute("show server_version_num")[0][0])
+            if version < 120000:
+                node.stop()
+                return
+
+            node.psql("create table events (id int, created int) "
+                      "partition by range (created)")
+            for i in range(3):
+                node.psql("create table events_%d partition of events "
+                          "for values from (%d) to (%d)"
+                          % (i, i * 100, i * 100 + 100))
+            node.psql("create index on events (id)")
+            node.psql("insert into events select i % 10, i from "
+                      "generate_series(0, 299) i")
+            node.psql("analyze events")
+
+            node.psql("set enable_seqscan=off; set sr_plan.write_mode=on; " +
+                      query + key_query)
+            node.psql("update sr_plans set enable = true")
+
+            # rotate partitions
+            node.psql("drop table events_0")
+            node.psql("create table events_3 partition of events "
+                      "for values from (300) to (400)")
+            node.psql("insert into events select i % 10, i from "
+                      "generate_series(300, 399) i")
+            self.assertEqual(node.execute("select count(*) from sr_plans"),
+                             [(2, )])
+
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(query + stats)
+            self.assertEqual(res, [(1, 0)])
+            self.assertEqual(node.execute(query), [(30, )])
+
+            plan = "\n".join(r[0] for r in
+                             node.execute("explain (costs off) " + query))
+            self.assertIn("events_3_id_idx", plan)
+            self.assertNotIn("events_0", plan)
+
+            # events_3 can't be added to the plan pruned by the key
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(key_query + stats)
+            self.assertEqual(res, [(0, 1)])
+            self.assertEqual(node.execute(key_query), [(30, )])
+            node.stop()
+
+    def test_prewarm(self):
+        ''' Test loading of enabled plans into the backend cache '''
+
+        stats = "select sum(hits), sum(total_lookup_time) from sr_plan_stats"
+
+        with self.start_node() as node:
+            node.psql("set sr_plan.write_mode=on; " + queries[0] + queries[1])
+            node.psql("update sr_plans set enable = true")
+
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute("select plans, bytes > 0 from sr_plan_prewarm()")
+            self.assertEqual(res, [(2, True)])
+
+            # cached plans are not looked up in sr_plans
+            res = node.execute("select sr_plan_prewarm(); " + queries[0] +
+                               queries[1] + stats)
+            self.assertEqual(res, [(2, 0.0)])
+
+            node.append_conf("sr_plan.prewarm = on\n")
+            node.reload()
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + stats)
+            self.assertEqual(res, [(1, 0.0)])
+            node.stop()
+
+    def test_shared_store(self):
+        ''' Test plans shared by backends '''
+
+        stats = "select sum(hits), sum(total_lookup_time) from sr_plan_stats"
+
+        with self.start_node() as node:
+            version = int(node.execute("show server_version_num")[0][0])
+            node.append_conf("sr_plan.shared_store = on\n")
+            node.restart()
+
+            node.psql("set sr_plan.write_mode=on; " + queries[0])
+            node.psql("update sr_plans set enable = true")
+
+            # first backend loads the plan from sr_plans
+            node.psql("select sr_plan_stats_reset()")
+            node.psql(queries[0])
+
+            # next ones find it in the store
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + stats)
+            self.assertEqual(res[0][0], 1)
+            if version >= 110000:
+                self.assertEqual(res[0][1], 0.0)
+
+            # modified sr_plans is read again
+            node.psql("update sr_plans set enable = false")
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + "select count(*) from sr_plan_stats "
+                               "where hits > 0")
+            self.assertEqual(res, [(0, )])
+            node.stop()
+
+    def test_archive(self):
+        ''' Test plans loaded from the archive at startup '''
+
+        stats = "select sum(hits), sum(total_lookup_time) from sr_plan_stats"
+
+        with self.start_node() as node:
+            node.append_conf("sr_plan.archive = on\n")
+            node.restart()
+
+            node.psql("set sr_plan.write_mode=on; " + queries[0])
+            node.psql("update sr_plans set enable = true")
+            archive = os.path.join(node.data_dir, "sr_plan_archive")
+            self.assertTrue(os.path.exists(archive))
+
+            node.restart()
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + stats)
+            self.assertEqual(res, [(1, 0.0)])
+
+            # disabled plans are removed from the archive
+            with open(archive, 'rb') as f:
+                image = f.read()
+            node.psql("update sr_plans set enable = false")
+            node.restart()
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + "select count(*) from sr_plan_stats "
+                               "where hits > 0")
+            self.assertEqual(res, [(0, )])
+
+            # and are not used from a file behind sr_plans
+            node.stop()
+            with open(archive, 'wb') as f:
+                f.write(image)
+            node.start()
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute(queries[0] + "select count(*) from sr_plan_stats "
+                               "where hits > 0")
+            self.assertEqual(res, [(0, )])
+            node.stop()
+
+    def test_stats(self):
+        ''' Test sr_plan_stats counters '''
+
+        with self.start_node() as node:
+            node.psql("set sr_plan.write_mode=on; " + queries[0])
+            node.psql("update sr_plans set enable = true")
+            node.psql("select sr_plan_stats_reset()")
+
+            # first lookup goes to sr_plans, second one is cached
+            node.psql(queries[0] + queries[0])
+
+            res = node.execute("select hits, misses, plan_bytes > 0 "
+                               "from sr_plan_stats s join sr_plans p "
+                               "using (query_hash, plan_hash)")
+            self.assertEqual(res, [(2, 0, True)])
+
+            node.psql("select sr_plan_stats_reset()")
+            res = node.execute("select count(*) from sr_plan_stats")
+            self.assertEqual(res, [(0, )])
+            node.stop()
+
     def test_update(self):
         copytree(repo_dir, temp_dir)
         dumps = []